@@ -3,6 +3,36 @@
 #include <iostream>
 #include <chrono>
 #include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <list>
+#include <cstdint>
+#include <limits>
+#include <deque>
+#include <memory>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <set>
+#include <map>
+#include <queue>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sched.h>
 #include <termios.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -39,6 +69,11 @@ struct FpsStats {
         return avgFps;
     }
 };
+// Wall-clock timestamp for anything written to disk (audit trail).
+static inline long long wallClockMs() {
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+}
 // ---- End timing helpers ----
 
 // ---- Terminal (Unix) non-blocking input helpers ----
@@ -46,7 +81,7 @@ static struct termios orig_termios;
 static bool term_raw_enabled = false;
 
 void enableRawTerminal() {
-    if (term_raw_enabled) return;
+    if (term_raw_enabled || !isatty(STDIN_FILENO)) return;
     struct termios raw;
     tcgetattr(STDIN_FILENO, &orig_termios);
     raw = orig_termios;
@@ -101,6 +136,10 @@ static inline bool isExitKey(int k) {
 volatile sig_atomic_t g_signal_exit = 0;
 void handleSignal(int) { g_signal_exit = 1; }
 
+// SIGHUP with --config: re-read the config file instead of exiting.
+volatile sig_atomic_t g_reload_request = 0;
+void handleReloadSignal(int) { g_reload_request = 1; }
+
 // Centralized exit request check (window key, terminal key, or signal)
 static inline bool exitRequested(int windowKey) {
     if (isExitKey(windowKey)) return true;
@@ -134,148 +173,5949 @@ static void listCameras(int maxIndexToProbe = 10) {
     }
 }
 
-int main(int argc, char** argv) {
-    // Constants for clarity
-    const int kFrameWidth = 640;
-    const int kFrameHeight = 480;
-    const char* kWindowTitle = "QR Detect";
+// ---- Camera hot-plug ----
+// When the camera stops delivering frames the capture loop asks this
+// manager to get it back instead of exiting. It watches /dev with inotify
+// and retries the open as soon as the device node is (re)created or its
+// attributes change (udev fixes permissions right after creating it), so
+// a replugged camera is reopened within milliseconds and nothing polls
+// while it is gone. The capture object is reused, so everything built on
+// it (detectors, sinks, tracker) carries on.
+class CameraHotplug {
+public:
+    struct Stats {
+        uint64_t outages = 0;
+        double totalMs = 0.0;
+        double longestMs = 0.0;
+    };
 
-    // Parse optional input source
-    // Usage: ./detector [--list] [0|1]
-    if (argc >= 2 && std::string(argv[1]) == "--list") {
-        listCameras(2); // only probe 0 and 1
-        return 0;
+    CameraHotplug(int index, int width, int height)
+        : index_(index), width_(width), height_(height), node_(cv::format("video%d", index)) {}
+    ~CameraHotplug() { if (fd_ >= 0) ::close(fd_); }
+
+    bool start() {
+        fd_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd_ < 0) return false;
+        return ::inotify_add_watch(fd_, "/dev", IN_CREATE | IN_ATTRIB | IN_DELETE) >= 0;
     }
 
-    int requestedIndex = -1;
-    if (argc >= 2) {
-        std::string arg = argv[1];
-        bool numeric = !arg.empty() &&
-                       std::all_of(arg.begin(), arg.end(), [](unsigned char c){ return std::isdigit(c); });
-        if (!numeric) {
-            std::cerr << "仅支持摄像头索引 0 或 1 (不支持图片/视频路径)." << std::endl;
-            return 2;
+    // Blocks until `cap` delivers frames again; false if `shouldExit` fired first.
+    template <typename ExitCheck>
+    bool reconnect(cv::VideoCapture& cap, ExitCheck shouldExit) {
+        const double lostAt = nowMs();
+        ++stats_.outages;
+        std::cerr << "摄像头 /dev/" << node_ << " 读取失败, 等待重新连接..." << std::endl;
+        cap.release();
+        drainEvents(); // only events after the failure matter
+
+        // A glitch that did not remove the node: try straight away, then
+        // fall back to a slow retry in case no event ever arrives.
+        bool attempt = nodeExists();
+        double nextRetry = nowMs() + 1000.0;
+        for (;;) {
+            if (attempt && reopen(cap)) break;
+            if (shouldExit()) {
+                account(nowMs() - lostAt);
+                return false;
+            }
+            // The timeout only bounds how long exit keys/signals wait.
+            pollfd pfd = { fd_, POLLIN, 0 };
+            ::poll(&pfd, 1, 200);
+            attempt = drainEvents();
+            if (!attempt && nowMs() >= nextRetry) {
+                attempt = nodeExists();
+                nextRetry = nowMs() + 1000.0;
+            }
         }
-        requestedIndex = std::stoi(arg);
-        if (requestedIndex < 0 || requestedIndex > 1) {
-            std::cerr << "无效的摄像头索引 " << requestedIndex
-                      << ". 仅支持 0 或 1." << std::endl;
-            return 2;
+        const double outage = nowMs() - lostAt;
+        account(outage);
+        std::cout << cv::format("camera /dev/%s reconnected after %.0f ms outage", node_.c_str(), outage)
+                  << std::endl;
+        return true;
+    }
+
+    const Stats& stats() const { return stats_; }
+
+private:
+    bool nodeExists() const {
+        struct stat st;
+        return ::stat(("/dev/" + node_).c_str(), &st) == 0;
+    }
+
+    bool reopen(cv::VideoCapture& cap) {
+        if (!tryOpenCamera(index_, cap, width_, height_)) return false;
+        cv::Mat probe;
+        if (cap.read(probe) && !probe.empty()) return true;
+        cap.release();
+        return false;
+    }
+
+    // Returns true if any pending event created or touched our node.
+    bool drainEvents() {
+        bool ours = false;
+        alignas(struct inotify_event) char buf[4096];
+        for (;;) {
+            ssize_t n = ::read(fd_, buf, sizeof(buf));
+            if (n <= 0) break;
+            for (char* p = buf; p < buf + n;) {
+                const struct inotify_event* ev = reinterpret_cast<const struct inotify_event*>(p);
+                if (ev->len && node_ == ev->name && (ev->mask & (IN_CREATE | IN_ATTRIB))) ours = true;
+                p += sizeof(struct inotify_event) + ev->len;
+            }
         }
+        return ours;
     }
 
-    cv::VideoCapture cap;
+    void account(double ms) {
+        stats_.totalMs += ms;
+        stats_.longestMs = std::max(stats_.longestMs, ms);
+    }
 
-    if (requestedIndex >= 0) {
-        if (!tryOpenCamera(requestedIndex, cap, 640, 480)) {
-            std::cerr << "无法打开摄像头索引 " << requestedIndex
-                      << " (仅支持 0 或 1)." << std::endl;
-            return 3;
+    const int index_;
+    const int width_, height_;
+    const std::string node_;
+    int fd_ = -1;
+    Stats stats_;
+};
+// ---- End camera hot-plug ----
+
+// ---- Detection result helpers ----
+struct DetectedCode {
+    std::string payload;      // empty when located but not decoded
+    cv::Point2f quad[4];      // corners in full-resolution frame coordinates
+    int trackId = -1;         // assigned by CodeTracker, -1 if untracked
+    std::string symbology;    // empty for QR, else the barcode type (e.g. "EAN_13")
+
+    cv::Point2f center() const {
+        return cv::Point2f((quad[0].x + quad[1].x + quad[2].x + quad[3].x) / 4.f,
+                           (quad[0].y + quad[1].y + quad[2].y + quad[3].y) / 4.f);
+    }
+};
+
+// Convert the points/decoded pair returned by detectAndDecodeMulti into one
+// entry per code. OpenCV hands back Nx4 or 4xN (or flattened) point mats
+// depending on version, so normalise to CV_32FC2 (codes, 4) first.
+static std::vector<DetectedCode> collectCodes(const cv::Mat& points,
+                                              const std::vector<std::string>& decoded) {
+    std::vector<DetectedCode> codes;
+    if (points.empty()) return codes;
+
+    cv::Mat pts;
+    if (points.type() == CV_32FC2) pts = points;
+    else {
+        points.convertTo(pts, CV_32F);
+        if (pts.channels() != 2) pts = pts.reshape(2); // ensure 2-channel
+    }
+
+    int count = 0;
+    int rows = pts.rows, cols = pts.cols;
+    if (cols == 4 && rows >= 1) {
+        count = rows;
+    } else if (rows == 4 && cols >= 1) {
+        count = cols;
+    } else if ((rows * cols) % 4 == 0) {
+        count = (rows * cols) / 4;
+        // reshape to (count, 4)
+        pts = pts.reshape(2, count);
+        rows = pts.rows; cols = pts.cols;
+    }
+
+    codes.resize(count);
+    for (int i = 0; i < count; ++i) {
+        for (int k = 0; k < 4; ++k) {
+            cv::Vec2f v;
+            if (cols == 4 && rows == count) v = pts.at<cv::Vec2f>(i, k);
+            else if (rows == 4 && cols == count) v = pts.at<cv::Vec2f>(k, i);
+            else v = pts.at<cv::Vec2f>(i, k); // after reshape above
+            codes[i].quad[k] = cv::Point2f(v[0], v[1]);
         }
-    } else {
-        // No argument: try 0 then 1 only
-        int indices[2] = {0,1};
-        bool opened = false;
-        for (int idx : indices) {
-            if (tryOpenCamera(idx, cap, 640, 480)) { opened = true; break; }
+        if (i < static_cast<int>(decoded.size())) codes[i].payload = decoded[i];
+    }
+    return codes;
+}
+// ---- End detection result helpers ----
+
+// ---- Lens undistortion for code regions ----
+// Wide-angle distortion bends codes near the image edges. Rather than
+// cv::remap on every full frame, only candidates that failed to decode are
+// rectified from an undistorted view of their own region. The undistortion
+// maps are split into 64x64 tiles that are computed the first time a
+// region touches them and kept, so steady state costs one small remap.
+// The undistorted view has the frame's size but its own camera matrix,
+// scaled like getOptimalNewCameraMatrix(alpha=1): the whole captured frame
+// fits inside it, so codes near the edges, which barrel distortion pushes
+// outwards, are not cropped away.
+class LensModel {
+public:
+    // OpenCV calibration YAML/XML: camera_matrix, distortion_coefficients and
+    // optionally image_width/image_height (intrinsics are rescaled when the
+    // capture resolution differs).
+    bool load(const std::string& path, cv::Size frameSize, std::string& err) {
+        cv::FileStorage fs;
+        try {
+            if (!fs.open(path, cv::FileStorage::READ)) { err = "无法打开 " + path; return false; }
+        } catch (const cv::Exception& e) {
+            err = e.what();
+            return false;
         }
-        if (!opened) {
-            std::cerr << "无法打开摄像头 (仅尝试 /dev/video0 与 /dev/video1).\n"
-                      << "提示:\n"
-                      << "  1) 运行: ./detector --list 查看可用设备 (仅列出 0,1)\n"
-                      << "  2) 指定: ./detector 0  或  ./detector 1\n"
-                      << "  3) 现在已不支持文件/图片/URL 输入\n";
-            return 1;
+        cv::Mat K, D;
+        fs["camera_matrix"] >> K;
+        fs["distortion_coefficients"] >> D;
+        if (K.rows != 3 || K.cols != 3) { err = "camera_matrix 必须是 3x3"; return false; }
+        K.convertTo(K, CV_64F);
+        D.convertTo(D, CV_64F);
+        const int nd = static_cast<int>(D.total());
+        if (nd != 4 && nd != 5 && nd != 8) { err = "distortion_coefficients 需要 4, 5 或 8 个值"; return false; }
+
+        double sx = 1.0, sy = 1.0;
+        int calW = (int)fs["image_width"], calH = (int)fs["image_height"];
+        if (calW > 0 && calH > 0) {
+            sx = static_cast<double>(frameSize.width) / calW;
+            sy = static_cast<double>(frameSize.height) / calH;
         }
+        fx_ = K.at<double>(0, 0) * sx; cx_ = K.at<double>(0, 2) * sx;
+        fy_ = K.at<double>(1, 1) * sy; cy_ = K.at<double>(1, 2) * sy;
+        for (int i = 0; i < 8; ++i) k_[i] = 0.0;
+        const double* d = D.ptr<double>();
+        // OpenCV order: k1 k2 p1 p2 [k3 [k4 k5 k6]]
+        k_[0] = d[0]; k_[1] = d[1]; p1_ = d[2]; p2_ = d[3];
+        if (nd >= 5) k_[2] = d[4];
+        if (nd == 8) { k_[3] = d[5]; k_[4] = d[6]; k_[5] = d[7]; }
+        size_ = frameSize;
+        fitNewCameraMatrix();
+        tilesX_ = (size_.width + kTile - 1) / kTile;
+        tilesY_ = (size_.height + kTile - 1) / kTile;
+        tiles_.clear();
+        tiles_.resize(static_cast<size_t>(tilesX_) * tilesY_);
+        built_ = 0;
+        return true;
     }
 
-    // QR code detector
-    cv::QRCodeDetector qrDetector;
+    bool loaded() const { return size_.width > 0; }
+    cv::Size size() const { return size_; }
 
-    Mat frame;
+    // Ideal pixel (undistorted view) -> where it lands in the captured frame.
+    cv::Point2f distort(const cv::Point2f& p) const {
+        double x = (p.x - ncx_) / nfx_, y = (p.y - ncy_) / nfy_;
+        double xd, yd;
+        applyModel(x, y, xd, yd);
+        return cv::Point2f(static_cast<float>(xd * fx_ + cx_), static_cast<float>(yd * fy_ + cy_));
+    }
 
-    // Enable terminal key handling with RAII
-    TerminalRawGuard terminalGuard;
+    // Captured pixel -> ideal pixel in the undistorted view.
+    cv::Point2f undistort(const cv::Point2f& p) const {
+        double x, y;
+        undistortNormalized((p.x - cx_) / fx_, (p.y - cy_) / fy_, x, y);
+        return cv::Point2f(static_cast<float>(x * nfx_ + ncx_), static_cast<float>(y * nfy_ + ncy_));
+    }
 
-    // Register signal handlers for clean exit (restores terminal)
-    signal(SIGINT, handleSignal);
-    signal(SIGTERM, handleSignal);
-    signal(SIGHUP, handleSignal);
+    // Undistorted view of `rect` (undistorted coordinates, clipped to the
+    // frame) sampled from the captured frame.
+    void remapRegion(const cv::Mat& frame, const cv::Rect& rect, cv::Mat& out) {
+        const cv::Rect r = rect & cv::Rect(0, 0, size_.width, size_.height);
+        if (r.empty()) { out.release(); return; }
+        mapX_.create(r.height, r.width, CV_32FC1);
+        mapY_.create(r.height, r.width, CV_32FC1);
+        for (int ty = r.y / kTile; ty <= (r.y + r.height - 1) / kTile; ++ty) {
+            for (int tx = r.x / kTile; tx <= (r.x + r.width - 1) / kTile; ++tx) {
+                const Tile& t = tile(tx, ty);
+                const cv::Rect tr(tx * kTile, ty * kTile, t.mapX.cols, t.mapX.rows);
+                const cv::Rect part = tr & r;
+                for (int y = part.y; y < part.y + part.height; ++y) {
+                    const size_t bytes = sizeof(float) * part.width;
+                    std::memcpy(mapX_.ptr<float>(y - r.y) + (part.x - r.x),
+                                t.mapX.ptr<float>(y - tr.y) + (part.x - tr.x), bytes);
+                    std::memcpy(mapY_.ptr<float>(y - r.y) + (part.x - r.x),
+                                t.mapY.ptr<float>(y - tr.y) + (part.x - tr.x), bytes);
+                }
+            }
+        }
+        cv::remap(frame, out, mapX_, mapY_, cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+    }
 
-    FpsStats stats;
-    
-    while (true) {
-        double start = nowMs(); // start timing this frame
+    size_t tilesBuilt() const { return built_; }
+    size_t tilesTotal() const { return tiles_.size(); }
 
-        if (!cap.read(frame) || frame.empty()) break;
+private:
+    enum { kTile = 64 };
+    struct Tile {
+        cv::Mat mapX, mapY; // CV_32FC1, empty until first use
+    };
 
-        // Detect and decode multiple QR codes
-        std::vector<std::string> decoded;
-        // Use a fixed-type Mat (Nx4, CV_32FC2) as required by OpenCV for multi points
-        cv::Mat points; // rows = num codes, cols = 4, type = CV_32FC2
-        bool found = qrDetector.detectAndDecodeMulti(frame, decoded, points);
-
-        int detectedCount = 0;
-        if (found && !points.empty()) {
-            // Normalize to CV_32FC2
-            cv::Mat pts;
-            if (points.type() == CV_32FC2) pts = points;
-            else {
-                points.convertTo(pts, CV_32F);
-                if (pts.channels() != 2) pts = pts.reshape(2); // ensure 2-channel
-            }
-
-            int codes = 0;
-            int rows = pts.rows, cols = pts.cols;
-            if (cols == 4 && rows >= 1) {
-                codes = rows;
-            } else if (rows == 4 && cols >= 1) {
-                codes = cols;
-            } else if ((rows * cols) % 4 == 0) {
-                codes = (rows * cols) / 4;
-                // reshape to (codes, 4)
-                pts = pts.reshape(2, codes);
-                rows = pts.rows; cols = pts.cols;
-            }
-            detectedCount = codes;
-
-            for (int i = 0; i < codes; ++i) {
-                std::vector<cv::Point> poly;
-                poly.reserve(4);
-                cv::Point2f center(0.f, 0.f);
-                for (int k = 0; k < 4; ++k) {
-                    cv::Vec2f v;
-                    if (cols == 4 && rows == codes) v = pts.at<cv::Vec2f>(i, k);
-                    else if (rows == 4 && cols == codes) v = pts.at<cv::Vec2f>(k, i);
-                    else v = pts.at<cv::Vec2f>(i, k); // after reshape above
-                    center.x += v[0]; center.y += v[1];
-                    poly.emplace_back(cv::Point(cvRound(v[0]), cvRound(v[1])));
+    // Fixed-point iteration, as cv::undistortPoints.
+    void undistortNormalized(double xd, double yd, double& x, double& y) const {
+        x = xd;
+        y = yd;
+        for (int it = 0; it < 10; ++it) {
+            double r2 = x * x + y * y;
+            double radial = radialFactor(r2);
+            double dx = 2 * p1_ * x * y + p2_ * (r2 + 2 * x * x);
+            double dy = p1_ * (r2 + 2 * y * y) + 2 * p2_ * x * y;
+            x = (xd - dx) / radial;
+            y = (yd - dy) / radial;
+        }
+    }
+
+    // New intrinsics whose view holds the undistorted image of every border
+    // pixel (the outer rectangle, as alpha=1 does).
+    void fitNewCameraMatrix() {
+        double x0 = 1e9, y0 = 1e9, x1 = -1e9, y1 = -1e9;
+        const int W = size_.width - 1, H = size_.height - 1;
+        const int kSteps = 32;
+        for (int i = 0; i <= kSteps; ++i) {
+            const double u = static_cast<double>(W) * i / kSteps, v = static_cast<double>(H) * i / kSteps;
+            const double border[4][2] = { { u, 0 }, { u, (double)H }, { 0, v }, { (double)W, v } };
+            for (int b = 0; b < 4; ++b) {
+                double x, y;
+                undistortNormalized((border[b][0] - cx_) / fx_, (border[b][1] - cy_) / fy_, x, y);
+                x0 = std::min(x0, x); x1 = std::max(x1, x);
+                y0 = std::min(y0, y); y1 = std::max(y1, y);
+            }
+        }
+        nfx_ = x1 > x0 ? W / (x1 - x0) : fx_;
+        nfy_ = y1 > y0 ? H / (y1 - y0) : fy_;
+        ncx_ = -x0 * nfx_;
+        ncy_ = -y0 * nfy_;
+    }
+
+    double radialFactor(double r2) const {
+        double num = 1 + r2 * (k_[0] + r2 * (k_[1] + r2 * k_[2]));
+        double den = 1 + r2 * (k_[3] + r2 * (k_[4] + r2 * k_[5]));
+        return num / den;
+    }
+
+    void applyModel(double x, double y, double& xd, double& yd) const {
+        double r2 = x * x + y * y;
+        double radial = radialFactor(r2);
+        xd = x * radial + 2 * p1_ * x * y + p2_ * (r2 + 2 * x * x);
+        yd = y * radial + p1_ * (r2 + 2 * y * y) + 2 * p2_ * x * y;
+    }
+
+    const Tile& tile(int tx, int ty) {
+        Tile& t = tiles_[static_cast<size_t>(ty) * tilesX_ + tx];
+        if (!t.mapX.empty()) return t;
+        const int x0 = tx * kTile, y0 = ty * kTile;
+        const int w = std::min<int>(kTile, size_.width - x0), h = std::min<int>(kTile, size_.height - y0);
+        t.mapX.create(h, w, CV_32FC1);
+        t.mapY.create(h, w, CV_32FC1);
+        for (int y = 0; y < h; ++y) {
+            float* mx = t.mapX.ptr<float>(y);
+            float* my = t.mapY.ptr<float>(y);
+            for (int x = 0; x < w; ++x) {
+                cv::Point2f src = distort(cv::Point2f(static_cast<float>(x0 + x), static_cast<float>(y0 + y)));
+                mx[x] = src.x;
+                my[x] = src.y;
+            }
+        }
+        ++built_;
+        return t;
+    }
+
+    double fx_ = 1, fy_ = 1, cx_ = 0, cy_ = 0;     // captured frame
+    double nfx_ = 1, nfy_ = 1, ncx_ = 0, ncy_ = 0; // undistorted view
+    double k_[8];
+    double p1_ = 0, p2_ = 0;
+    cv::Size size_;
+    int tilesX_ = 0, tilesY_ = 0;
+    std::vector<Tile> tiles_;
+    size_t built_ = 0;
+    cv::Mat mapX_, mapY_;
+};
+// ---- End lens undistortion ----
+
+// ---- Band-fused finder scan ----
+// For large frames the usual chain (full-frame cvtColor, full-frame
+// threshold, full-frame finder search) streams the image through DRAM
+// three times. This scanner walks the frame in horizontal bands sized to
+// stay in L2: each band is converted to gray, thresholded and scanned for
+// 1:1:3:1:1 finder runs while it is still cache-resident, so the colour
+// frame is read once and the gray/binary data never leave the cache.
+// State that spans band edges (the column means used by the threshold and
+// the finder clusters still growing downwards) is carried across.
+// Runs are matched in both polarities in the same pass, so light-on-dark
+// finders cost one extra ratio test per run, not a second scan.
+struct FinderHit {
+    float x, y;     // finder centre, frame pixels
+    float module;   // estimated module size in pixels
+    bool inverted;  // light-on-dark finder
+};
+
+// Padded code bounds from three grouped finders.
+struct FinderRegion {
+    cv::Rect rect;
+    bool inverted;
+};
+
+struct FinderGroupStats {
+    uint64_t hits = 0;
+    uint64_t regions = 0;
+    uint64_t droppedPartners = 0; // candidates beyond the per-finder cap
+};
+
+class BandFinderScanner {
+public:
+    // bandBytes = working-set budget per band; 0 = half the L2 size.
+    explicit BandFinderScanner(size_t bandBytes = 0) : bandBytes_(bandBytes ? bandBytes : defaultBudget()) {}
+
+    // Finder centres in `frame` (8UC1 or 8UC3).
+    const std::vector<FinderHit>& scan(const cv::Mat& frame) {
+        CV_Assert(frame.type() == CV_8UC1 || frame.type() == CV_8UC3);
+        const int w = frame.cols;
+        // Per band row: colour input + gray + binary.
+        const size_t rowBytes = static_cast<size_t>(w) * (frame.channels() + 2);
+        bandRows_ = static_cast<int>(std::max<size_t>(8, bandBytes_ / std::max<size_t>(1, rowBytes)));
+        bandRows_ = std::min(bandRows_, frame.rows);
+        begin(w);
+
+        for (int y0 = 0; y0 < frame.rows; y0 += bandRows_) {
+            const int rows = std::min(bandRows_, frame.rows - y0);
+            const cv::Mat band = frame(cv::Rect(0, y0, w, rows));
+            if (band.channels() == 3) cv::cvtColor(band, grayBand_, cv::COLOR_BGR2GRAY);
+            else grayBand_ = band;
+            binRow_.resize(w);
+            for (int r = 0; r < rows; ++r) {
+                binarizeRow(grayBand_.ptr<uchar>(r), w, binRow_.data());
+                scanRow(binRow_.data(), w, y0 + r);
+            }
+        }
+        closeClusters(std::numeric_limits<int>::max());
+        return hits_;
+    }
+
+    // The same scan as separate whole-frame passes: gray plane, binary
+    // plane, then the finder scan. Same hits as scan(); the benchmark's
+    // baseline for what the fusion saves.
+    const std::vector<FinderHit>& scanSeparate(const cv::Mat& frame) {
+        CV_Assert(frame.type() == CV_8UC1 || frame.type() == CV_8UC3);
+        const int w = frame.cols;
+        bandRows_ = frame.rows;
+        begin(w);
+        if (frame.channels() == 3) cv::cvtColor(frame, grayBand_, cv::COLOR_BGR2GRAY);
+        else grayBand_ = frame;
+        binPlane_.create(frame.rows, w, CV_8UC1);
+        for (int y = 0; y < frame.rows; ++y) binarizeRow(grayBand_.ptr<uchar>(y), w, binPlane_.ptr<uchar>(y));
+        for (int y = 0; y < frame.rows; ++y) scanRow(binPlane_.ptr<uchar>(y), w, y);
+        closeClusters(std::numeric_limits<int>::max());
+        return hits_;
+    }
+
+    int bandRows() const { return bandRows_; }
+
+    static size_t defaultBudget() {
+        long l2 = -1;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+        l2 = ::sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+        return l2 > 0 ? static_cast<size_t>(l2) / 2 : static_cast<size_t>(512 * 1024);
+    }
+
+private:
+    void begin(int w) {
+        hits_.clear();
+        open_.clear();
+        colMean_.assign(w, 128 << 4); // 12.4 fixed point, carried across bands
+        prefix_.resize(w + 1);
+        window_ = std::max(8, w / 32);
+    }
+
+    // Threshold against a local mean: per-column running mean over the rows
+    // above (carried from band to band) averaged over a horizontal window.
+    void binarizeRow(const uchar* gray, int w, uchar* bin) {
+        prefix_[0] = 0;
+        for (int x = 0; x < w; ++x) {
+            int& m = colMean_[x];
+            m += ((gray[x] << 4) - m) >> 3; // ~8-row exponential mean, 12.4 fixed point
+            prefix_[x + 1] = prefix_[x] + m;
+        }
+        const int half = window_ / 2;
+        for (int x = 0; x < w; ++x) {
+            const int a = std::max(0, x - half), b = std::min(w, x + half + 1);
+            const int mean = static_cast<int>((prefix_[b] - prefix_[a]) / (b - a)) >> 4;
+            bin[x] = gray[x] < mean - 6 ? 1 : 0; // 1 = dark
+        }
+    }
+
+    static bool finderRatio(const int c[5]) {
+        const int total = c[0] + c[1] + c[2] + c[3] + c[4];
+        if (total < 7) return false;
+        const float m = total / 7.f, v = m / 2.f;
+        return std::fabs(m - c[0]) < v && std::fabs(m - c[1]) < v && std::fabs(3.f * m - c[2]) < 3.f * v &&
+               std::fabs(m - c[3]) < v && std::fabs(m - c[4]) < v;
+    }
+
+    // Run-length encode the row once, then test every five consecutive
+    // runs: starting on a dark run is a normal finder, on a light run an
+    // inverted one.
+    void scanRow(const uchar* bin, int w, int y) {
+        runs_.clear();
+        int len = 1;
+        for (int x = 1; x < w; ++x) {
+            if (bin[x] == bin[x - 1]) { ++len; continue; }
+            runs_.push_back(len);
+            len = 1;
+        }
+        runs_.push_back(len);
+        const bool firstDark = w > 0 && bin[0];
+        int x0 = 0;
+        for (size_t i = 0; i + 5 <= runs_.size(); x0 += runs_[i], ++i) {
+            const int* c = &runs_[i];
+            if (!finderRatio(c)) continue;
+            const bool inverted = ((i & 1) == 0) != firstDark;
+            const float cx = x0 + c[0] + c[1] + c[2] / 2.f;
+            addRowHit(cx, y, (c[0] + c[1] + c[2] + c[3] + c[4]) / 7.f, inverted);
+        }
+        closeClusters(y);
+    }
+
+    // Rows through the finder's 3x3 core all show the ratio at about the same
+    // x; consecutive row hits are stacked into one cluster per finder.
+    void addRowHit(float x, int y, float module, bool inverted) {
+        for (size_t i = 0; i < open_.size(); ++i) {
+            Cluster& c = open_[i];
+            if (c.inverted != inverted) continue;
+            const float mx = c.sumX / c.hits, mm = c.sumModule / c.hits;
+            if (std::fabs(mx - x) < 1.5f * mm && std::fabs(mm - module) < 0.5f * mm && c.lastY >= y - 2) {
+                c.sumX += x;
+                c.sumModule += module;
+                c.lastY = y;
+                ++c.hits;
+                return;
+            }
+        }
+        Cluster c = { x, module, y, y, 1, inverted };
+        open_.push_back(c);
+    }
+
+    // Emit clusters that stopped growing before row `y`.
+    void closeClusters(int y) {
+        for (size_t i = 0; i < open_.size();) {
+            const Cluster& c = open_[i];
+            if (c.lastY >= y - 2) { ++i; continue; }
+            const float module = c.sumModule / c.hits;
+            if (c.hits >= std::max(2, cvRound(module))) {
+                FinderHit h = { c.sumX / c.hits, (c.firstY + c.lastY) / 2.f, module, c.inverted };
+                hits_.push_back(h);
+            }
+            open_[i] = open_.back();
+            open_.pop_back();
+        }
+    }
+
+    struct Cluster {
+        float sumX;
+        float sumModule;
+        int firstY, lastY;
+        int hits;
+        bool inverted;
+    };
+
+    size_t bandBytes_;
+    int bandRows_ = 0;
+    int window_ = 8;
+    cv::Mat grayBand_;
+    cv::Mat binPlane_; // scanSeparate() only
+    std::vector<uchar> binRow_;
+    std::vector<int> runs_;
+    std::vector<int> colMean_;
+    std::vector<int64_t> prefix_;
+    std::vector<Cluster> open_;
+    std::vector<FinderHit> hits_;
+};
+
+// Group finder hits into code regions: three finders of the same polarity
+// and similar module size forming a right angle. Bounds are in frame pixels.
+//
+// Each hit only pairs with partners that could share a symbol with it:
+// same polarity, module within 1.5x, centres between 7 modules (version 1
+// is 14 apart) and 260 modules (version 40 diagonal with slack). Partners
+// are found by a range query on hits sorted by module size and capped at
+// the nearest kMaxPartners, so the triple search is O(n k^2) over the whole
+// frame instead of an O(n^3) over the first few rows' hits.
+static std::vector<FinderRegion> groupFinders(const std::vector<FinderHit>& hits, cv::Size frame,
+                                              FinderGroupStats* stats = nullptr) {
+    static const size_t kMaxPartners = 24;
+    std::vector<FinderRegion> rois;
+    const cv::Rect bounds(0, 0, frame.width, frame.height);
+
+    std::vector<size_t> byModule(hits.size());
+    for (size_t i = 0; i < hits.size(); ++i) byModule[i] = i;
+    std::sort(byModule.begin(), byModule.end(),
+              [&hits](size_t l, size_t r) { return hits[l].module < hits[r].module; });
+    const auto moduleAtLeast = [&hits](size_t idx, float m) { return hits[idx].module < m; };
+
+    std::vector<std::pair<float, size_t> > partners;
+    for (size_t a = 0; a < hits.size(); ++a) {
+        const FinderHit& fa = hits[a];
+        partners.clear();
+        std::vector<size_t>::const_iterator it =
+            std::lower_bound(byModule.begin(), byModule.end(), fa.module / 1.5f, moduleAtLeast);
+        for (; it != byModule.end() && hits[*it].module <= fa.module * 1.5f; ++it) {
+            const size_t b = *it;
+            if (b <= a || hits[b].inverted != fa.inverted) continue; // each triple once, from its lowest index
+            const float d = std::hypot(hits[b].x - fa.x, hits[b].y - fa.y);
+            const float mmin = std::min(fa.module, hits[b].module), mmax = std::max(fa.module, hits[b].module);
+            if (d >= 7 * mmin && d <= 260 * mmax) partners.push_back(std::make_pair(d, b));
+        }
+        if (partners.size() > kMaxPartners) {
+            std::nth_element(partners.begin(), partners.begin() + kMaxPartners, partners.end());
+            if (stats) stats->droppedPartners += partners.size() - kMaxPartners;
+            partners.resize(kMaxPartners);
+        }
+
+        for (size_t pb = 0; pb < partners.size(); ++pb) {
+            for (size_t pc = pb + 1; pc < partners.size(); ++pc) {
+                const FinderHit* f[3] = { &fa, &hits[partners[pb].second], &hits[partners[pc].second] };
+                const float mmin = std::min(f[0]->module, std::min(f[1]->module, f[2]->module));
+                const float mmax = std::max(f[0]->module, std::max(f[1]->module, f[2]->module));
+                if (mmax > 1.5f * mmin) continue;
+                bool ok = false;
+                cv::Point2f corner, p, q;
+                for (int k = 0; k < 3 && !ok; ++k) {
+                    corner = cv::Point2f(f[k]->x, f[k]->y);
+                    p = cv::Point2f(f[(k + 1) % 3]->x, f[(k + 1) % 3]->y) - corner;
+                    q = cv::Point2f(f[(k + 2) % 3]->x, f[(k + 2) % 3]->y) - corner;
+                    const double np = cv::norm(p), nq = cv::norm(q);
+                    if (np < 7 * mmin || nq < 7 * mmin) continue;
+                    ok = std::max(np, nq) < 1.3 * std::min(np, nq) && std::fabs(p.dot(q)) < 0.25 * np * nq;
+                }
+                if (!ok) continue;
+                std::vector<cv::Point2f> pts;
+                pts.push_back(corner);
+                pts.push_back(corner + p);
+                pts.push_back(corner + q);
+                pts.push_back(corner + p + q);
+                cv::Rect r = cv::boundingRect(pts);
+                const int pad = cvCeil(6 * mmax); // finder centre to edge + quiet zone
+                r = cv::Rect(r.x - pad, r.y - pad, r.width + 2 * pad, r.height + 2 * pad) & bounds;
+                bool dup = false;
+                for (size_t i = 0; i < rois.size() && !dup; ++i)
+                    dup = (rois[i].rect & r).area() > 0.6 * std::min(rois[i].rect.area(), r.area());
+                if (!dup && !r.empty()) {
+                    FinderRegion region = { r, fa.inverted };
+                    rois.push_back(region);
                 }
-                center.x /= 4.f; center.y /= 4.f;
+            }
+        }
+    }
+    if (stats) {
+        stats->hits += hits.size();
+        stats->regions += rois.size();
+    }
+    return rois;
+}
+// ---- End band-fused finder scan ----
+
+// ---- Shared per-frame preprocessing ----
+// Gray image, pyramid levels, integral image and an adaptive binary map,
+// each computed on first use and then reused by every symbology detector
+// that runs on the same frame. reset() starts a new frame; buffers are
+// kept, so steady state allocates nothing.
+class SharedPreprocess {
+public:
+    struct Stats {
+        uint64_t frames = 0;
+        double totalMs = 0.0; // time spent building cached buffers
+    };
+
+    void reset(const cv::Mat& frame) {
+        frame_ = frame;
+        grayReady_ = false;
+        levelsReady_ = 0;
+        integralReady_ = binaryReady_ = -1;
+        ++stats_.frames;
+    }
+
+    const cv::Mat& frame() const { return frame_; }
+
+    const cv::Mat& gray() {
+        if (!grayReady_) {
+            const double t0 = nowMs();
+            if (frame_.channels() == 3) cv::cvtColor(frame_, gray_, cv::COLOR_BGR2GRAY);
+            else gray_ = frame_;
+            grayReady_ = true;
+            stats_.totalMs += nowMs() - t0;
+        }
+        return gray_;
+    }
+
+    // Level 0 is the gray image, each further level one pyrDown.
+    const cv::Mat& level(int n) {
+        if (n <= 0) return gray();
+        if (static_cast<int>(levels_.size()) < n) levels_.resize(n);
+        while (levelsReady_ < n) {
+            const cv::Mat& src = level(levelsReady_);
+            const double t0 = nowMs();
+            cv::pyrDown(src, levels_[levelsReady_]);
+            stats_.totalMs += nowMs() - t0;
+            ++levelsReady_;
+        }
+        return levels_[n - 1];
+    }
+
+    // Integral image (CV_32S, one row/column larger) of pyramid level `n`.
+    const cv::Mat& integral(int n) {
+        if (integralReady_ != n) {
+            const cv::Mat& src = level(n);
+            const double t0 = nowMs();
+            cv::integral(src, integral_, CV_32S);
+            integralReady_ = n;
+            stats_.totalMs += nowMs() - t0;
+        }
+        return integral_;
+    }
+
+    // Mean-C adaptive threshold of level `n`: the same adaptiveThreshold
+    // call (block and C) as QrDetector's binarize=adaptive, so sharing the
+    // gray plane gives an identical binary map, border handling included.
+    const cv::Mat& binary(int n) {
+        if (binaryReady_ != n) {
+            const cv::Mat& src = level(n);
+            const double t0 = nowMs();
+            const int block = std::max(15, std::min(src.cols, src.rows) / 16) | 1;
+            cv::adaptiveThreshold(src, binary_, 255, cv::ADAPTIVE_THRESH_MEAN_C, cv::THRESH_BINARY, block, 10);
+            binaryReady_ = n;
+            stats_.totalMs += nowMs() - t0;
+        }
+        return binary_;
+    }
+
+    const Stats& stats() const { return stats_; }
+
+private:
+    cv::Mat frame_;
+    cv::Mat gray_;
+    bool grayReady_ = false;
+    std::vector<cv::Mat> levels_;
+    int levelsReady_ = 0;
+    cv::Mat integral_;
+    int integralReady_ = -1;
+    cv::Mat binary_;
+    int binaryReady_ = -1;
+    Stats stats_;
+};
+// ---- End shared per-frame preprocessing ----
+
+// ---- Detector configuration ----
+// QRCodeDetectorAruco (4.8+) is a separate, usually faster locate backend.
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR >= 8)
+#define QR_HAVE_ARUCO_BACKEND 1
+#else
+#define QR_HAVE_ARUCO_BACKEND 0
+#endif
+
+struct DetectorConfig {
+    std::string backend = "classic"; // classic | aruco
+    std::string locate = "opencv";   // opencv | bands (band-fused finder scan, decode per region)
+    int bandKb = 0;                  // band working-set budget for locate=bands, 0 = L2 / 2
+    double scale = 1.0;              // detection input scale; <1 downsamples first
+    int pyramid = 0;                 // extra pyrDown levels after scaling
+    std::string binarize = "none";   // none | otsu | adaptive
+    int tiles = 1;                   // split the input into tiles x tiles overlapping tiles
+    int stripes = 1;                 // >1: time-sliced locate over this many horizontal stripes
+    int stripeBatch = 1;             // stripes scanned per frame
+    double stripeOverlap = 0.5;      // extra rows above/below each stripe, fraction of its height
+    int threads = 0;                 // cv::setNumThreads; process-wide, 0 = OpenCV default
+    double gate = 0.0;               // skip frames whose texture score is below this, 0 = off
+    bool mirror = true;              // retry located-but-undecoded codes on the transposed grid
 
-                const cv::Point* ptsPoly = poly.data();
-                int npts = static_cast<int>(poly.size());
-                cv::polylines(frame, &ptsPoly, &npts, 1, true, cv::Scalar(0, 255, 0), 3, cv::LINE_AA);
+    std::string describe() const {
+        std::string s = cv::format("backend=%s,scale=%.2f,pyramid=%d,binarize=%s,tiles=%d,threads=%d,gate=%.1f",
+                                   backend.c_str(), scale, pyramid, binarize.c_str(), tiles, threads, gate);
+        if (locate != "opencv") s += ",locate=" + locate;
+        if (bandKb > 0) s += cv::format(",band_kb=%d", bandKb);
+        if (!mirror) s += ",mirror=0";
+        if (stripes > 1)
+            s += cv::format(",stripes=%d,stripe_batch=%d,stripe_overlap=%.2f", stripes, stripeBatch, stripeOverlap);
+        return s;
+    }
+
+    // Share of a full locate pass spent per frame by stripe scanning
+    // (ignoring tracked-region checks).
+    double stripeBudget() const {
+        if (stripes <= 1) return 1.0;
+        return std::min(1.0, std::min(stripeBatch, stripes) * (1.0 + 2.0 * stripeOverlap) / stripes);
+    }
+
+    // Settings that determine the preprocessed detector input; configs with
+    // equal keys can share one prepare() result.
+    std::string preprocessKey() const {
+        return cv::format("%.4f/%d/%s", scale, pyramid, binarize.c_str());
+    }
+};
 
-                const std::string label = (i < static_cast<int>(decoded.size()) ? decoded[i] : std::string());
-                cv::putText(frame, label, cv::Point(cvRound(center.x) - 20, cvRound(center.y) - 10),
-                            cv::FONT_HERSHEY_SIMPLEX, 0.6, cv::Scalar(0, 255, 0), 2, cv::LINE_AA);
+// Parse "key=value,key=value" on top of `cfg`. Unknown keys are errors.
+static bool parseDetectorConfig(const std::string& spec, DetectorConfig& cfg, std::string& err) {
+    std::stringstream ss(spec);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (item.empty()) continue;
+        size_t eq = item.find('=');
+        if (eq == std::string::npos) { err = "缺少 '=': " + item; return false; }
+        std::string key = item.substr(0, eq), value = item.substr(eq + 1);
+        if (key == "backend") {
+            if (value != "classic" && value != "aruco") { err = "未知 backend: " + value; return false; }
+#if !QR_HAVE_ARUCO_BACKEND
+            if (value == "aruco") { err = "backend=aruco 需要 OpenCV >= 4.8"; return false; }
+#endif
+            cfg.backend = value;
+        } else if (key == "scale") {
+            cfg.scale = std::atof(value.c_str());
+            if (cfg.scale <= 0.0 || cfg.scale > 1.0) { err = "scale 取值范围 (0, 1]"; return false; }
+        } else if (key == "pyramid") {
+            cfg.pyramid = std::atoi(value.c_str());
+            if (cfg.pyramid < 0 || cfg.pyramid > 4) { err = "pyramid 取值范围 0..4"; return false; }
+        } else if (key == "binarize") {
+            if (value != "none" && value != "otsu" && value != "adaptive") {
+                err = "未知 binarize: " + value;
+                return false;
             }
+            cfg.binarize = value;
+        } else if (key == "tiles") {
+            cfg.tiles = std::atoi(value.c_str());
+            if (cfg.tiles < 1 || cfg.tiles > 8) { err = "tiles 取值范围 1..8"; return false; }
+        } else if (key == "locate") {
+            if (value != "opencv" && value != "bands") { err = "未知 locate: " + value; return false; }
+            cfg.locate = value;
+        } else if (key == "band_kb") {
+            cfg.bandKb = std::max(0, std::atoi(value.c_str()));
+        } else if (key == "stripes") {
+            cfg.stripes = std::atoi(value.c_str());
+            if (cfg.stripes < 1 || cfg.stripes > 64) { err = "stripes 取值范围 1..64"; return false; }
+        } else if (key == "stripe_batch") {
+            cfg.stripeBatch = std::atoi(value.c_str());
+            if (cfg.stripeBatch < 1) { err = "stripe_batch 至少为 1"; return false; }
+        } else if (key == "stripe_overlap") {
+            cfg.stripeOverlap = std::atof(value.c_str());
+            if (cfg.stripeOverlap < 0.0 || cfg.stripeOverlap > 2.0) { err = "stripe_overlap 取值范围 0..2"; return false; }
+        } else if (key == "threads") {
+            cfg.threads = std::max(0, std::atoi(value.c_str()));
+        } else if (key == "gate") {
+            cfg.gate = std::max(0.0, std::atof(value.c_str()));
+        } else if (key == "mirror") {
+            if (value != "0" && value != "1") { err = "mirror 取值 0 或 1"; return false; }
+            cfg.mirror = value == "1";
+        } else {
+            err = "未知参数: " + key;
+            return false;
         }
-        
-        double dur = nowMs() - start;
-        std::string statsText = cv::format("avg %.2f ms  fps %.1f  QR %d",
-                           stats.updateAvgMs(dur), stats.tickFps(), detectedCount);
-        cv::putText(frame, statsText, cv::Point(10, 30),
-                    cv::FONT_HERSHEY_SIMPLEX, 0.8, cv::Scalar(0,255,0), 2);
+    }
+    if (cfg.tiles > 1 && cfg.stripes > 1) { err = "tiles 与 stripes 不能同时使用"; return false; }
+    if (cfg.locate == "bands" && (cfg.tiles > 1 || cfg.stripes > 1 || cfg.scale < 1.0 ||
+                                  cfg.pyramid > 0 || cfg.binarize != "none")) {
+        err = "locate=bands 自带灰度/二值化, 不能与 scale/pyramid/binarize/tiles/stripes 同时使用";
+        return false;
+    }
+    return true;
+}
+
+// One detection pipeline instance. Not thread-safe; give every thread its own.
+class QrDetector {
+public:
+    // Preprocessed detector input and the factor that maps it back to frame
+    // coordinates.
+    struct Prepared {
+        cv::Mat image;
+        float toFrame = 1.f;
+    };
+
+    struct UndistortStats {
+        uint64_t retried = 0;
+        uint64_t recovered = 0;
+        uint64_t skipped = 0; // candidates on an image the lens does not cover
+        double totalMs = 0.0;
+    };
+
+    struct PolarityStats {
+        uint64_t invertedRegions = 0;  // light-on-dark regions decoded (locate=bands)
+        uint64_t mirrorRetried = 0;
+        uint64_t mirrorRecovered = 0;
+    };
+
+    explicit QrDetector(const DetectorConfig& cfg)
+        : cfg_(cfg), bands_(static_cast<size_t>(cfg.bandKb) * 1024) {}
 
-        cv::imshow(kWindowTitle, frame);
-        int key = cv::waitKey(1);
-        if (exitRequested(key)) break;
+    const DetectorConfig& config() const { return cfg_; }
+
+    // Swap in a new configuration between frames. Scratch buffers, the lens
+    // and the OpenCV detector instances are kept.
+    void reconfigure(const DetectorConfig& cfg) {
+        cfg_ = cfg;
+        bands_ = BandFinderScanner(static_cast<size_t>(cfg.bandKb) * 1024);
+        stripeCursor_ = 0;
+        // prepared_.image may alias a shared plane (prepareShared); the next
+        // prepare() must not write into it in place.
+        prepared_ = Prepared();
     }
 
-    // Terminal restored automatically by TerminalRawGuard
-    cap.release();
-    cv::destroyAllWindows();
-    return 0;
-}
\ No newline at end of file
+    // Optional lens model; candidates that fail to decode are retried on an
+    // undistorted view of their region. The model is not shared across threads.
+    void setLens(const std::shared_ptr<LensModel>& lens) { lens_ = lens; }
+    const UndistortStats& undistortStats() const { return undistort_; }
+    const PolarityStats& polarityStats() const { return polarity_; }
+    const FinderGroupStats& groupStats() const { return grouping_; }
+
+    // `regions` (frame coordinates, e.g. tracked codes from the previous
+    // frame) are always checked in stripe mode; otherwise they are ignored
+    // because the full locate pass covers them anyway.
+    // With `shared`, preprocessing comes from the per-frame cache when the
+    // config allows it (scale=1).
+    std::vector<DetectedCode> detect(const cv::Mat& frame,
+                                     const std::vector<cv::Rect>& regions = std::vector<cv::Rect>(),
+                                     SharedPreprocess* shared = nullptr) {
+        if (!passesGate(frame)) return std::vector<DetectedCode>();
+        std::vector<DetectedCode> codes;
+        if (cfg_.locate == "bands") {
+            codes = locateBands(frame);
+        } else {
+            if (!shared || !prepareShared(*shared, prepared_)) prepare(frame, prepared_);
+            codes = detectPrepared(prepared_, &regions);
+        }
+        if (lens_ && lens_->loaded()) retryAllUndistorted(frame, codes);
+        // locate=bands already retried on the right polarity.
+        if (cfg_.mirror && cfg_.locate != "bands") {
+            for (size_t i = 0; i < codes.size(); ++i)
+                if (codes[i].payload.empty()) retryMirrored(frame, cv::Point(0, 0), codes[i]);
+        }
+        return codes;
+    }
+
+    // Texture gate; counts rejected frames.
+    bool passesGate(const cv::Mat& frame) {
+        if (cfg_.gate <= 0.0 || textureScore(frame) >= cfg_.gate) return true;
+        ++gated_;
+        return false;
+    }
+
+    // Scale, pyramid and binarization. Writes into `out` so callers can keep
+    // the buffers across frames; out.image may alias this detector's scratch
+    // buffers until the next prepare(), so clone it to keep it longer.
+    void prepare(const cv::Mat& frame, Prepared& out) {
+        const cv::Mat* cur = &frame;
+        double factor = 1.0;
+        if (cfg_.scale < 1.0) {
+            cv::resize(*cur, work_, cv::Size(), cfg_.scale, cfg_.scale, cv::INTER_AREA);
+            cur = &work_;
+            factor *= cfg_.scale;
+        }
+        for (int l = 0; l < cfg_.pyramid; ++l) {
+            cv::pyrDown(*cur, level_);
+            std::swap(work_, level_);
+            cur = &work_;
+            factor *= 0.5;
+        }
+        if (cfg_.binarize != "none") {
+            if (cur->channels() == 3) cv::cvtColor(*cur, gray_, cv::COLOR_BGR2GRAY);
+            else gray_ = *cur;
+            if (cfg_.binarize == "otsu") {
+                cv::threshold(gray_, out.image, 0, 255, cv::THRESH_BINARY | cv::THRESH_OTSU);
+            } else {
+                // Block size ~1/16 of the short side, odd, at least 15 px.
+                int block = std::max(15, std::min(gray_.cols, gray_.rows) / 16) | 1;
+                cv::adaptiveThreshold(gray_, out.image, 255, cv::ADAPTIVE_THRESH_MEAN_C,
+                                      cv::THRESH_BINARY, block, 10);
+            }
+        } else {
+            out.image = *cur; // no copy
+        }
+        out.toFrame = static_cast<float>(1.0 / factor);
+    }
+
+    // True if `m` points into one of prepare()'s scratch buffers, i.e. will be
+    // overwritten by the next prepare() on this detector.
+    bool usesScratch(const cv::Mat& m) const {
+        return sameBuffer(m, work_) || sameBuffer(m, level_) || sameBuffer(m, gray_);
+    }
+
+    static bool sameBuffer(const cv::Mat& a, const cv::Mat& b) {
+        return a.data && b.data && a.datastart < b.dataend && b.datastart < a.dataend;
+    }
+
+    // prepare() on top of the shared cache. Scaling by a non power of two is
+    // specific to this detector, so it is not shared.
+    bool prepareShared(SharedPreprocess& shared, Prepared& out) {
+        if (cfg_.scale < 1.0) return false;
+        if (cfg_.binarize == "adaptive") {
+            out.image = shared.binary(cfg_.pyramid);
+        } else if (cfg_.binarize == "otsu") {
+            cv::threshold(shared.level(cfg_.pyramid), out.image, 0, 255, cv::THRESH_BINARY | cv::THRESH_OTSU);
+        } else {
+            out.image = shared.level(cfg_.pyramid);
+        }
+        out.toFrame = static_cast<float>(1 << cfg_.pyramid);
+        return true;
+    }
+
+    std::vector<DetectedCode> detectPrepared(const Prepared& in,
+                                             const std::vector<cv::Rect>* regions = nullptr) {
+        std::vector<DetectedCode> codes;
+        if (cfg_.stripes > 1) {
+            codes = scanStripes(in, regions);
+        } else if (cfg_.tiles <= 1) {
+            codes = locateAndDecode(in.image);
+        } else {
+            // Overlap by ~15% of a tile so codes on a seam land whole in one tile.
+            const int n = cfg_.tiles;
+            const int tw = in.image.cols / n, th = in.image.rows / n;
+            const int ox = tw * 15 / 100, oy = th * 15 / 100;
+            const cv::Rect bounds(0, 0, in.image.cols, in.image.rows);
+            for (int ty = 0; ty < n; ++ty) {
+                for (int tx = 0; tx < n; ++tx) {
+                    cv::Rect r(tx * tw - ox, ty * th - oy, tw + 2 * ox, th + 2 * oy);
+                    r &= bounds;
+                    std::vector<DetectedCode> part = locateAndDecode(in.image(r));
+                    for (size_t i = 0; i < part.size(); ++i) {
+                        for (int k = 0; k < 4; ++k) part[i].quad[k] += cv::Point2f((float)r.x, (float)r.y);
+                        mergeCode(codes, part[i], 0.25f * std::min(tw, th));
+                    }
+                }
+            }
+        }
+        if (in.toFrame != 1.f) {
+            for (size_t i = 0; i < codes.size(); ++i)
+                for (int k = 0; k < 4; ++k) codes[i].quad[k] = codes[i].quad[k] * in.toFrame;
+        }
+        return codes;
+    }
+
+    // Frames rejected by the texture gate so far.
+    uint64_t gatedFrames() const { return gated_; }
+
+    // Mean absolute horizontal gradient on a ~160 px wide nearest-neighbour
+    // thumbnail: reads a few thousand pixels, so it is nearly free compared
+    // with a locate pass, and flat/blurred scenes score close to zero.
+    double textureScore(const cv::Mat& frame) {
+        const int w = std::min(160, frame.cols);
+        const int h = std::max(1, frame.rows * w / std::max(1, frame.cols));
+        cv::resize(frame, thumb_, cv::Size(w, h), 0, 0, cv::INTER_NEAREST);
+        if (thumb_.channels() == 3) cv::cvtColor(thumb_, thumbGray_, cv::COLOR_BGR2GRAY);
+        else thumbGray_ = thumb_;
+        uint64_t sum = 0;
+        for (int y = 0; y < thumbGray_.rows; ++y) {
+            const uchar* p = thumbGray_.ptr<uchar>(y);
+            for (int x = 1; x < thumbGray_.cols; ++x) sum += static_cast<uint64_t>(std::abs(p[x] - p[x - 1]));
+        }
+        return static_cast<double>(sum) / std::max(1, thumbGray_.rows * (thumbGray_.cols - 1));
+    }
+
+private:
+    // Finder scan fused with gray conversion and thresholding, then the
+    // configured backend decodes each grouped region on its own. Inverted
+    // regions are flipped back to dark-on-light first; only the region is
+    // touched, never the frame.
+    std::vector<DetectedCode> locateBands(const cv::Mat& frame) {
+        std::vector<DetectedCode> codes;
+        const std::vector<FinderHit>& hits = bands_.scan(frame);
+        const std::vector<FinderRegion> rois = groupFinders(hits, frame.size(), &grouping_);
+        for (size_t i = 0; i < rois.size(); ++i) {
+            const cv::Rect& r = rois[i].rect;
+            cv::Mat region = frame(r);
+            if (rois[i].inverted) {
+                cv::bitwise_not(region, inverted_);
+                region = inverted_;
+                ++polarity_.invertedRegions;
+            }
+            std::vector<DetectedCode> part = locateAndDecode(region);
+            for (size_t k = 0; k < part.size(); ++k) {
+                // Quads are still region-relative here.
+                if (cfg_.mirror && part[k].payload.empty()) retryMirrored(region, cv::Point(0, 0), part[k]);
+                for (int j = 0; j < 4; ++j) part[k].quad[j] += cv::Point2f((float)r.x, (float)r.y);
+                mergeCode(codes, part[k], 0.25f * r.width);
+            }
+        }
+        return codes;
+    }
+
+    // A mirrored code locates normally (finders are symmetric) but its
+    // module grid reads transposed. Transposing the candidate's patch and
+    // decoding at the known corners is one decode call, paid only by
+    // candidates that already failed. `origin` is where `image` sits in the
+    // coordinate frame of `code` (non-zero for region patches).
+    void retryMirrored(const cv::Mat& image, cv::Point origin, DetectedCode& code) {
+        ++polarity_.mirrorRetried;
+        std::vector<cv::Point2f> q(4);
+        for (int k = 0; k < 4; ++k) q[k] = code.quad[k] - cv::Point2f((float)origin.x, (float)origin.y);
+        cv::Rect box = cv::boundingRect(q);
+        const int pad = std::max(8, box.width / 8);
+        box = cv::Rect(box.x - pad, box.y - pad, box.width + 2 * pad, box.height + 2 * pad) &
+              cv::Rect(0, 0, image.cols, image.rows);
+        if (box.empty()) return;
+        cv::transpose(image(box), mirrored_);
+        // Transposing swaps x and y. The finder corner q0 stays top-left and
+        // must stay first (decode maps points[0] to the symbol origin); the
+        // rest reverse to keep the quad clockwise.
+        const int order[4] = {0, 3, 2, 1};
+        std::vector<cv::Point2f> tq(4);
+        for (int k = 0; k < 4; ++k) tq[k] = cv::Point2f(q[order[k]].y - box.y, q[order[k]].x - box.x);
+        std::string payload = classic_.decode(mirrored_, tq);
+        if (!payload.empty()) {
+            code.payload = payload;
+            ++polarity_.mirrorRecovered;
+        }
+    }
+
+    // Time-sliced locate: each call scans `stripeBatch` of the `stripes`
+    // horizontal stripes (round robin, so every row is revisited within
+    // ceil(stripes / stripeBatch) frames) plus the given regions. Stripes
+    // overlap by `stripeOverlap` of their height on both sides, so a code up
+    // to 2 * overlap stripe heights tall lies whole in at least one stripe.
+    std::vector<DetectedCode> scanStripes(const Prepared& in, const std::vector<cv::Rect>* regions) {
+        std::vector<DetectedCode> codes;
+        const cv::Rect bounds(0, 0, in.image.cols, in.image.rows);
+        const int n = cfg_.stripes;
+        const int h = (in.image.rows + n - 1) / n;
+        const int ov = cvRound(h * cfg_.stripeOverlap);
+        const float mergeRadius = 0.25f * h;
+
+        std::vector<cv::Rect> scanned;
+        for (int b = 0; b < std::min(cfg_.stripeBatch, n); ++b) {
+            const int i = stripeCursor_;
+            stripeCursor_ = (stripeCursor_ + 1) % n;
+            cv::Rect r = cv::Rect(0, i * h - ov, in.image.cols, h + 2 * ov) & bounds;
+            if (r.empty()) continue;
+            scanned.push_back(r);
+            scanRegion(in.image, r, codes, mergeRadius);
+        }
+
+        if (regions) {
+            const float toPrepared = 1.f / in.toFrame;
+            for (size_t i = 0; i < regions->size(); ++i) {
+                const cv::Rect& f = (*regions)[i];
+                // Grow by half the size: the code may have moved since last frame.
+                cv::Rect r(cvFloor((f.x - f.width / 2) * toPrepared), cvFloor((f.y - f.height / 2) * toPrepared),
+                           cvCeil(f.width * 2 * toPrepared), cvCeil(f.height * 2 * toPrepared));
+                r &= bounds;
+                if (r.empty()) continue;
+                bool covered = false;
+                for (size_t k = 0; k < scanned.size() && !covered; ++k) covered = (r & scanned[k]) == r;
+                if (!covered) scanRegion(in.image, r, codes, mergeRadius);
+            }
+        }
+        return codes;
+    }
+
+    void scanRegion(const cv::Mat& image, const cv::Rect& r, std::vector<DetectedCode>& codes, float mergeRadius) {
+        std::vector<DetectedCode> part = locateAndDecode(image(r));
+        for (size_t i = 0; i < part.size(); ++i) {
+            for (int k = 0; k < 4; ++k) part[i].quad[k] += cv::Point2f((float)r.x, (float)r.y);
+            mergeCode(codes, part[i], mergeRadius);
+        }
+    }
+
+    // ROI views (config ROIs) are widened back to their parent frame so the
+    // lens maps apply; anything else the lens was not calibrated for is
+    // skipped, and reported once.
+    void retryAllUndistorted(const cv::Mat& image, std::vector<DetectedCode>& codes) {
+        size_t pending = 0;
+        for (size_t i = 0; i < codes.size(); ++i) pending += codes[i].payload.empty();
+        if (!pending) return;
+        cv::Mat frame = image;
+        cv::Point ofs(0, 0);
+        if (image.size() != lens_->size()) {
+            cv::Size whole;
+            image.locateROI(whole, ofs);
+            if (whole != lens_->size()) {
+                if (undistort_.skipped == 0)
+                    std::cerr << cv::format("镜头标定尺寸 %dx%d 与图像 %dx%d 不符, 跳过去畸变重试",
+                                            lens_->size().width, lens_->size().height, whole.width, whole.height)
+                              << std::endl;
+                undistort_.skipped += pending;
+                return;
+            }
+            frame.adjustROI(ofs.y, whole.height - ofs.y - image.rows, ofs.x, whole.width - ofs.x - image.cols);
+        }
+        const cv::Point2f shift((float)ofs.x, (float)ofs.y);
+        for (size_t i = 0; i < codes.size(); ++i) {
+            if (!codes[i].payload.empty()) continue;
+            for (int k = 0; k < 4; ++k) codes[i].quad[k] += shift;
+            retryUndistorted(frame, codes[i]);
+            for (int k = 0; k < 4; ++k) codes[i].quad[k] -= shift;
+        }
+    }
+
+    // Decode the candidate from an undistorted patch around it, using the
+    // known (undistorted) corners instead of a fresh locate pass. The quad
+    // reported stays in captured-frame coordinates.
+    void retryUndistorted(const cv::Mat& frame, DetectedCode& code) {
+        double t0 = nowMs();
+        ++undistort_.retried;
+        std::vector<cv::Point2f> uq(4);
+        for (int k = 0; k < 4; ++k) uq[k] = lens_->undistort(code.quad[k]);
+        cv::Rect box = cv::boundingRect(uq);
+        const int pad = std::max(8, box.width / 8);
+        box = cv::Rect(box.x - pad, box.y - pad, box.width + 2 * pad, box.height + 2 * pad) &
+              cv::Rect(0, 0, frame.cols, frame.rows);
+        if (!box.empty()) {
+            lens_->remapRegion(frame, box, patch_);
+            for (int k = 0; k < 4; ++k) uq[k] -= cv::Point2f((float)box.x, (float)box.y);
+            std::string payload = classic_.decode(patch_, uq);
+            if (payload.empty()) payload = classic_.detectAndDecode(patch_);
+            if (!payload.empty()) {
+                code.payload = payload;
+                ++undistort_.recovered;
+            }
+        }
+        undistort_.totalMs += nowMs() - t0;
+    }
+
+    std::vector<DetectedCode> locateAndDecode(const cv::Mat& input) {
+        // Detect and decode multiple QR codes
+        std::vector<std::string> decoded;
+        // Use a fixed-type Mat (Nx4, CV_32FC2) as required by OpenCV for multi points
+        cv::Mat points; // rows = num codes, cols = 4, type = CV_32FC2
+        bool found;
+#if QR_HAVE_ARUCO_BACKEND
+        if (cfg_.backend == "aruco") found = aruco_.detectAndDecodeMulti(input, decoded, points);
+        else
+#endif
+        found = classic_.detectAndDecodeMulti(input, decoded, points);
+        if (!found) return std::vector<DetectedCode>();
+        return collectCodes(points, decoded);
+    }
+
+    // Tiles overlap, so the same code can be reported twice: same payload,
+    // or (undecoded) a centre within `radius` of an existing one.
+    static void mergeCode(std::vector<DetectedCode>& codes, const DetectedCode& c, float radius) {
+        for (size_t i = 0; i < codes.size(); ++i) {
+            bool bothDecoded = !codes[i].payload.empty() && !c.payload.empty();
+            bool same = bothDecoded ? codes[i].payload == c.payload
+                                    : cv::norm(codes[i].center() - c.center()) < radius;
+            if (same) {
+                if (codes[i].payload.empty() && !c.payload.empty()) codes[i] = c;
+                return;
+            }
+        }
+        codes.push_back(c);
+    }
+
+    DetectorConfig cfg_;
+    cv::QRCodeDetector classic_;
+#if QR_HAVE_ARUCO_BACKEND
+    cv::QRCodeDetectorAruco aruco_;
+#endif
+    Prepared prepared_;
+    int stripeCursor_ = 0;
+    BandFinderScanner bands_;
+    std::shared_ptr<LensModel> lens_;
+    UndistortStats undistort_;
+    PolarityStats polarity_;
+    FinderGroupStats grouping_;
+    cv::Mat patch_, inverted_, mirrored_;
+    cv::Mat work_, level_, gray_;
+    cv::Mat thumb_, thumbGray_;
+    uint64_t gated_ = 0;
+};
+// ---- End detector configuration ----
+
+// ---- Multiple symbologies per frame ----
+// BarcodeDetector (1D codes) moved into objdetect in 4.8.
+#define QR_HAVE_BARCODE QR_HAVE_ARUCO_BACKEND
+
+// Runs the QR pipeline and any additional symbologies on one shared
+// SharedPreprocess, timing each symbology separately so the marginal cost of
+// adding one is visible.
+class MultiSymbologyDetector {
+public:
+    struct Cost {
+        std::string name;
+        uint64_t frames = 0;
+        uint64_t codes = 0;
+        double totalMs = 0.0;
+    };
+
+    MultiSymbologyDetector(QrDetector& qr, const std::vector<std::string>& extra) : qr_(qr) {
+        costs_.resize(1);
+        costs_[0].name = "qr";
+        for (size_t i = 0; i < extra.size(); ++i) {
+            Cost c;
+            c.name = extra[i];
+            costs_.push_back(c);
+        }
+    }
+
+    // Known names for --symbologies (besides qr).
+    static bool supported(const std::string& name) {
+#if QR_HAVE_BARCODE
+        if (name == "barcode") return true;
+#endif
+        return false;
+    }
+
+    std::vector<DetectedCode> detect(const cv::Mat& frame, const std::vector<cv::Rect>& regions) {
+        shared_.reset(frame);
+        double t0 = nowMs();
+        std::vector<DetectedCode> codes = qr_.detect(frame, regions, &shared_);
+        account(costs_[0], t0, codes.size());
+        for (size_t i = 1; i < costs_.size(); ++i) {
+            t0 = nowMs();
+            size_t before = codes.size();
+#if QR_HAVE_BARCODE
+            if (costs_[i].name == "barcode") detectBarcodes(codes);
+#endif
+            account(costs_[i], t0, codes.size() - before);
+        }
+        return codes;
+    }
+
+    // Per-symbology averages; build time of shared buffers is reported on its
+    // own line since whichever symbology asks first pays it.
+    void printSummary(std::ostream& out) const {
+        const SharedPreprocess::Stats& ps = shared_.stats();
+        const double frames = ps.frames ? static_cast<double>(ps.frames) : 1.0;
+        out << cv::format("symbologies: shared preprocessing %.2f ms/frame", ps.totalMs / frames) << std::endl;
+        for (size_t i = 0; i < costs_.size(); ++i) {
+            const Cost& c = costs_[i];
+            const double n = c.frames ? static_cast<double>(c.frames) : 1.0;
+            out << cv::format("  %-8s %.2f ms/frame, %llu codes", c.name.c_str(), c.totalMs / n,
+                              (unsigned long long)c.codes) << std::endl;
+        }
+    }
+
+private:
+    void account(Cost& c, double t0, size_t found) {
+        c.totalMs += nowMs() - t0;
+        ++c.frames;
+        c.codes += found;
+    }
+
+#if QR_HAVE_BARCODE
+    void detectBarcodes(std::vector<DetectedCode>& codes) {
+        std::vector<std::string> decoded, types;
+        cv::Mat points;
+        if (!barcode_.detectAndDecodeWithType(shared_.gray(), decoded, types, points)) return;
+        std::vector<DetectedCode> found = collectCodes(points, decoded);
+        for (size_t i = 0; i < found.size(); ++i) {
+            found[i].symbology = i < types.size() && !types[i].empty() ? types[i] : "1D";
+            codes.push_back(found[i]);
+        }
+    }
+
+    cv::barcode::BarcodeDetector barcode_;
+#endif
+
+    QrDetector& qr_;
+    SharedPreprocess shared_;
+    std::vector<Cost> costs_;
+};
+// ---- End multiple symbologies per frame ----
+
+// ---- Dual-resolution capture ----
+// Streams at the low capture resolution for the locate pass. When a code is
+// located but not decoded (typically too few pixels per module), the camera
+// is switched to the high resolution for a short burst, only the candidate's
+// region (mapped from low-res coordinates) is decoded, and the camera is
+// switched back. V4L2 cameras generally expose one stream per device, so
+// the switch is a mode change on the same capture; the first frames after a
+// change can still arrive at the old size and are skipped.
+//
+// The excursion is a state machine driven by the capture loop, one frame
+// per step, so the loop keeps handling keys, signals and reloads while the
+// driver settles. Payloads recovered by a burst are merged into the
+// results of the first low-res frame after it.
+class HiResBurst {
+public:
+    struct Stats {
+        uint64_t triggers = 0;
+        uint64_t recovered = 0;
+        uint64_t switchFailures = 0;
+        uint64_t reopens = 0;      // switch back failed, camera reopened
+        bool disabled = false;     // could not get back to the low resolution
+        double upMsTotal = 0.0;    // request -> first high-res frame
+        double downMsTotal = 0.0;  // request -> first low-res frame
+        double burstMsTotal = 0.0; // whole excursion
+    };
+
+    HiResBurst(cv::VideoCapture& cap, int cameraIndex, cv::Size low, cv::Size high, int burstFrames,
+               double cooldownMs)
+        : cap_(cap), index_(cameraIndex), low_(low), high_(high), burst_(std::max(1, burstFrames)),
+          cooldownMs_(cooldownMs) {}
+
+    // Offers a captured frame to a running excursion. Returns true if the
+    // frame was taken (it is not at the low resolution, or is part of the
+    // burst); false means run the normal pipeline on it.
+    bool consume(const cv::Mat& frame) {
+        switch (state_) {
+        case IDLE:
+            return false;
+        case UP:
+            if (frame.size() == high_) {
+                stats_.upMsTotal += nowMs() - requestedAt_;
+                state_ = BURST;
+                burstFrames_ = 0;
+                decodeBurstFrame(frame);
+            } else if (++drained_ >= kMaxDrain) {
+                ++stats_.switchFailures;
+                switchDown();
+            }
+            return true;
+        case BURST:
+            if (frame.size() != high_) {
+                switchDown();
+                return consume(frame);
+            }
+            decodeBurstFrame(frame);
+            return true;
+        case DOWN:
+            if (frame.size() == low_) {
+                stats_.downMsTotal += nowMs() - requestedAt_;
+                finish();
+                return false;
+            }
+            if (++drained_ >= kMaxDrain) {
+                ++stats_.switchFailures;
+                retryDown();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // After detection on a low-res frame: merges payloads recovered by the
+    // last burst into `codes`, then starts a burst if some are undecoded.
+    void update(std::vector<DetectedCode>& codes) {
+        mergeRecovered(codes);
+        if (state_ != IDLE || stats_.disabled || nowMs() < nextAllowed_) return;
+        pending_.clear();
+        for (size_t i = 0; i < codes.size(); ++i)
+            if (codes[i].payload.empty()) pending_.push_back(codes[i]);
+        if (pending_.empty()) return;
+        ++stats_.triggers;
+        startedAt_ = nowMs();
+        any_ = false;
+        request(high_);
+        state_ = UP;
+    }
+
+    // The camera could not be brought back to the low resolution, even by
+    // reopening it; the capture loop has to stop.
+    bool failed() const { return failed_; }
+    const Stats& stats() const { return stats_; }
+
+private:
+    enum State { IDLE, UP, BURST, DOWN };
+    static const int kMaxDrain = 8;   // frames to wait for a mode change
+    static const int kDownAttempts = 3;
+
+    void request(cv::Size size) {
+        cap_.set(cv::CAP_PROP_FRAME_WIDTH, size.width);
+        cap_.set(cv::CAP_PROP_FRAME_HEIGHT, size.height);
+        requestedAt_ = nowMs();
+        drained_ = 0;
+    }
+
+    void switchDown() {
+        request(low_);
+        downAttempts_ = 1;
+        state_ = DOWN;
+    }
+
+    // Everything downstream assumes low_: re-request it (the frames in
+    // between give the driver time, nothing sleeps), then reopen the
+    // camera at low_, and fail if even that does not deliver it.
+    void retryDown() {
+        if (downAttempts_ < kDownAttempts) {
+            ++downAttempts_;
+            request(low_);
+            return;
+        }
+        if (downAttempts_ == kDownAttempts) {
+            ++downAttempts_;
+            ++stats_.reopens;
+            stats_.disabled = true;
+            std::cerr << cv::format("无法切回 %dx%d, 重新打开摄像头并停用高分辨率补拍", low_.width, low_.height)
+                      << std::endl;
+            if (tryOpenCamera(index_, cap_, low_.width, low_.height)) {
+                requestedAt_ = nowMs();
+                drained_ = 0;
+                return;
+            }
+        }
+        std::cerr << cv::format("摄像头无法恢复到 %dx%d", low_.width, low_.height) << std::endl;
+        failed_ = true;
+        state_ = IDLE;
+    }
+
+    void finish() {
+        if (any_) ++stats_.recovered;
+        stats_.burstMsTotal += nowMs() - startedAt_;
+        nextAllowed_ = nowMs() + cooldownMs_;
+        pending_.clear();
+        state_ = IDLE;
+    }
+
+    void decodeBurstFrame(const cv::Mat& hi) {
+        const float sx = static_cast<float>(high_.width) / low_.width;
+        const float sy = static_cast<float>(high_.height) / low_.height;
+        for (size_t p = 0; p < pending_.size();) {
+            if (decodeRegion(hi, pending_[p], sx, sy)) {
+                any_ = true;
+                recovered_.push_back(pending_[p]);
+                pending_.erase(pending_.begin() + p);
+            } else {
+                ++p;
+            }
+        }
+        if (pending_.empty() || ++burstFrames_ >= burst_) switchDown();
+    }
+
+    // The recovered quads are from the frame that triggered the burst; a
+    // candidate still undecoded near the same place takes the payload,
+    // otherwise the code is reported on its own.
+    void mergeRecovered(std::vector<DetectedCode>& codes) {
+        for (size_t r = 0; r < recovered_.size(); ++r) {
+            const DetectedCode& rc = recovered_[r];
+            const cv::Rect box = cv::boundingRect(std::vector<cv::Point2f>(rc.quad, rc.quad + 4));
+            const cv::Point2f c = rc.center();
+            const float reach = 0.5f * std::max(box.width, box.height);
+            bool placed = false;
+            for (size_t i = 0; i < codes.size() && !placed; ++i) {
+                const cv::Point2f d = codes[i].center() - c;
+                if (std::sqrt(d.x * d.x + d.y * d.y) > reach) continue;
+                if (codes[i].payload.empty()) codes[i].payload = rc.payload;
+                placed = codes[i].payload == rc.payload;
+            }
+            if (!placed) codes.push_back(rc);
+        }
+        recovered_.clear();
+    }
+
+    // Decode only the candidate's region of the high-res frame.
+    bool decodeRegion(const cv::Mat& hi, DetectedCode& code, float sx, float sy) {
+        std::vector<cv::Point2f> q(4);
+        for (int k = 0; k < 4; ++k) q[k] = cv::Point2f(code.quad[k].x * sx, code.quad[k].y * sy);
+        cv::Rect box = cv::boundingRect(q);
+        const int pad = std::max(16, box.width / 4); // the code may have moved since the low-res frame
+        box = cv::Rect(box.x - pad, box.y - pad, box.width + 2 * pad, box.height + 2 * pad) &
+              cv::Rect(0, 0, hi.cols, hi.rows);
+        if (box.empty()) return false;
+        const cv::Mat roi = hi(box);
+        for (int k = 0; k < 4; ++k) q[k] -= cv::Point2f((float)box.x, (float)box.y);
+        std::string payload = detector_.decode(roi, q);
+        if (payload.empty()) payload = detector_.detectAndDecode(roi);
+        if (payload.empty()) return false;
+        code.payload = payload;
+        return true;
+    }
+
+    cv::VideoCapture& cap_;
+    const int index_;
+    const cv::Size low_, high_;
+    const int burst_;
+    const double cooldownMs_;
+    State state_ = IDLE;
+    std::vector<DetectedCode> pending_, recovered_;
+    double nextAllowed_ = 0.0;
+    double requestedAt_ = 0.0, startedAt_ = 0.0;
+    int drained_ = 0, burstFrames_ = 0, downAttempts_ = 0;
+    bool any_ = false, failed_ = false;
+    cv::QRCodeDetector detector_;
+    Stats stats_;
+};
+// ---- End dual-resolution capture ----
+
+// ---- Line-scan rolling buffer ----
+// Line-scan cameras deliver a continuous strip of rows instead of frames.
+// Incoming row blocks are appended to a circular image and detection runs
+// over the newly arrived rows plus an overlap that covers the tallest
+// expected code. Each row is written twice (at r % cap and r % cap + cap),
+// so the most recent `cap` rows are always one contiguous view; memory
+// stays at 2 x cap rows however long the belt runs.
+//
+// A code is reported by the pass whose commit interval contains its
+// bottom edge; intervals tile the row axis, so a code that spans a block
+// boundary is reported exactly once. A code whose bottom edge is within
+// `guard` rows of the newest row waits for the next pass, when its quiet
+// zone has arrived.
+class LineScanBuffer {
+public:
+    struct Stats {
+        unsigned long long rows = 0;
+        unsigned long long passes = 0;
+        unsigned long long reported = 0;
+        unsigned long long deferred = 0;   // bottom edge too close to the newest row
+        unsigned long long duplicates = 0; // already covered by an earlier pass
+        unsigned long long droppedRows = 0; // never scanned (a block larger than the first one)
+    };
+
+    // step = rows per detection pass; codeRows = tallest code on the belt.
+    LineScanBuffer(int step, int codeRows, int guard = 8)
+        : step_(std::max(1, step)), guard_(std::max(0, guard)), overlap_(std::max(1, codeRows) + guard_) {}
+
+    void append(const cv::Mat& block) {
+        if (ring_.empty()) {
+            // A pass starts once pending reaches step, so the block that gets
+            // there can overshoot by up to block.rows - 1 rows.
+            cap_ = step_ + block.rows - 1 + overlap_;
+            ring_.create(2 * cap_, block.cols, block.type());
+        }
+        CV_Assert(block.cols == ring_.cols && block.type() == ring_.type());
+        for (int r = 0; r < block.rows; ++r) {
+            const int slot = static_cast<int>(total_ % cap_);
+            const uchar* src = block.ptr<uchar>(r);
+            const size_t bytes = block.cols * block.elemSize();
+            std::memcpy(ring_.ptr<uchar>(slot), src, bytes);
+            std::memcpy(ring_.ptr<uchar>(slot + cap_), src, bytes);
+            ++total_;
+        }
+        stats_.rows += block.rows;
+        pending_ += block.rows;
+        if (pending_ > cap_ - overlap_) {
+            stats_.droppedRows += pending_ - (cap_ - overlap_);
+            committed_ = std::max(committed_, total_ - (cap_ - overlap_) - guard_);
+            pending_ = cap_ - overlap_;
+        }
+    }
+
+    bool ready() const { return pending_ >= step_; }
+
+    // Contiguous view (no copy) of the rows to scan; `firstRow` receives the
+    // absolute row index of its top. Valid until the next append().
+    cv::Mat window(long long& firstRow) const {
+        const long long rows = std::min<long long>(total_, pending_ + overlap_);
+        firstRow = total_ - rows;
+        const int start = static_cast<int>(firstRow % cap_);
+        return ring_.rowRange(start, start + static_cast<int>(rows));
+    }
+
+    // Keeps the codes this pass owns (window coordinates) and advances the
+    // commit line. `rows` receives each kept code's absolute bottom row.
+    std::vector<DetectedCode> commit(const std::vector<DetectedCode>& codes, long long firstRow,
+                                     std::vector<long long>* rows = nullptr) {
+        const long long line = total_ - guard_;
+        std::vector<DetectedCode> out;
+        for (size_t i = 0; i < codes.size(); ++i) {
+            float maxY = codes[i].quad[0].y;
+            for (int k = 1; k < 4; ++k) maxY = std::max(maxY, codes[i].quad[k].y);
+            const long long bottom = firstRow + static_cast<long long>(maxY);
+            if (bottom < committed_) { ++stats_.duplicates; continue; }
+            if (bottom >= line) { ++stats_.deferred; continue; }
+            out.push_back(codes[i]);
+            if (rows) rows->push_back(bottom);
+        }
+        committed_ = std::max(committed_, line);
+        pending_ = 0;
+        ++stats_.passes;
+        stats_.reported += out.size();
+        return out;
+    }
+
+    size_t bytes() const { return ring_.total() * ring_.elemSize(); }
+    const Stats& stats() const { return stats_; }
+
+private:
+    const int step_;
+    const int guard_;
+    const int overlap_;
+    int cap_ = 0;
+    cv::Mat ring_;
+    long long total_ = 0;     // rows appended so far
+    long long pending_ = 0;   // rows not yet covered by a pass
+    long long committed_ = 0; // codes with bottom edge above this row are reported
+    Stats stats_;
+};
+// ---- End line-scan rolling buffer ----
+
+// ---- Cached overlay text ----
+// putText re-rasterises Hershey strokes (with LINE_AA) on every call. Labels
+// are rendered once into an alpha mask keyed by text and style and then
+// alpha-blended onto the frame, so a repeated payload costs one blit.
+struct LabelStyle {
+    double fontScale;
+    int thickness;
+    cv::Scalar color; // BGR
+    int lineType;
+
+    LabelStyle(double scale, int thick, const cv::Scalar& col, int type = cv::LINE_AA)
+        : fontScale(scale), thickness(thick), color(col), lineType(type) {}
+};
+
+class LabelCache {
+public:
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        size_t entries;
+
+        double hitRate() const {
+            uint64_t total = hits + misses;
+            return total ? static_cast<double>(hits) / total : 0.0;
+        }
+    };
+
+    // Payload labels and glyphs are kept apart so a burst of new payloads
+    // cannot evict the glyphs every stats line needs.
+    explicit LabelCache(size_t capacity = 256, size_t glyphCapacity = 256)
+        : labels_(std::max<size_t>(16, capacity)), glyphs_(std::max<size_t>(16, glyphCapacity)) {}
+
+    // Draw `text` with its baseline-left corner at `org`, like cv::putText.
+    void draw(cv::Mat& dst, const std::string& text, cv::Point org, const LabelStyle& style) {
+        if (text.empty()) return;
+        blend(dst, lookup(labels_, text, style), org);
+    }
+
+    // Same result for text that changes every frame (stats line): composed
+    // from cached per-character glyphs instead of caching whole strings.
+    // The pen advances by the glyph's fractional width, as putText does,
+    // so long lines do not drift.
+    void drawGlyphs(cv::Mat& dst, const std::string& text, cv::Point org, const LabelStyle& style) {
+        double pen = org.x;
+        for (size_t i = 0; i < text.size(); ++i) {
+            const Bitmap& g = lookup(glyphs_, std::string(1, text[i]), style);
+            blend(dst, g, cv::Point(cvRound(pen), org.y));
+            pen += g.advance;
+        }
+    }
+
+    // Safe to call from any thread.
+    Stats stats() const {
+        Stats st;
+        st.hits = hits_.load();
+        st.misses = misses_.load();
+        st.evictions = evictions_.load();
+        st.entries = entries_.load();
+        return st;
+    }
+
+private:
+    struct Bitmap {
+        cv::Mat alpha;     // CV_8UC1 coverage
+        cv::Vec3b color;
+        cv::Point offset;  // top-left of `alpha` relative to the text origin
+        double advance;    // pen advance in pixels, fractional for glyphs
+    };
+    typedef std::list<std::string> LruList;
+    struct Entry {
+        Bitmap bitmap;
+        LruList::iterator lruPos;
+    };
+    struct Store {
+        explicit Store(size_t cap) : capacity(cap) {}
+        const size_t capacity;
+        std::unordered_map<std::string, Entry> map;
+        LruList lru;
+    };
+
+    const Bitmap& lookup(Store& store, const std::string& text, const LabelStyle& style) {
+        std::string key = cv::format("%.3f|%d|%d|%.0f,%.0f,%.0f|", style.fontScale, style.thickness,
+                                     style.lineType, style.color[0], style.color[1], style.color[2]) + text;
+        std::unordered_map<std::string, Entry>::iterator it = store.map.find(key);
+        if (it != store.map.end()) {
+            hits_.fetch_add(1, std::memory_order_relaxed);
+            store.lru.splice(store.lru.begin(), store.lru, it->second.lruPos);
+            return it->second.bitmap;
+        }
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        if (store.map.size() >= store.capacity) {
+            store.map.erase(store.lru.back());
+            store.lru.pop_back();
+            evictions_.fetch_add(1, std::memory_order_relaxed);
+        }
+        store.lru.push_front(key);
+        Entry& e = store.map[key];
+        e.bitmap = rasterise(text, style);
+        e.lruPos = store.lru.begin();
+        entries_.store(labels_.map.size() + glyphs_.map.size(), std::memory_order_relaxed);
+        return e.bitmap;
+    }
+
+    static Bitmap rasterise(const std::string& text, const LabelStyle& style) {
+        const int font = cv::FONT_HERSHEY_SIMPLEX;
+        int baseline = 0;
+        cv::Size sz = cv::getTextSize(text, font, style.fontScale, style.thickness, &baseline);
+        const int pad = style.thickness + 1; // room for stroke width and AA fringe
+        Bitmap b;
+        b.alpha = cv::Mat(sz.height + baseline + 2 * pad, sz.width + 2 * pad, CV_8UC1, cv::Scalar(0));
+        cv::putText(b.alpha, text, cv::Point(pad, pad + sz.height), font, style.fontScale,
+                    cv::Scalar(255), style.thickness, style.lineType);
+        b.color = cv::Vec3b(cv::saturate_cast<uchar>(style.color[0]),
+                            cv::saturate_cast<uchar>(style.color[1]),
+                            cv::saturate_cast<uchar>(style.color[2]));
+        b.offset = cv::Point(-pad, -pad - sz.height);
+        // getTextSize() rounds and adds the stroke thickness; a glyph's
+        // advance is measured over a run of copies to keep the fraction.
+        if (text.size() == 1) {
+            const int kRun = 32;
+            const cv::Size run = cv::getTextSize(std::string(kRun, text[0]), font, style.fontScale, style.thickness,
+                                                 &baseline);
+            b.advance = static_cast<double>(run.width - style.thickness) / kRun;
+        } else {
+            b.advance = sz.width - style.thickness;
+        }
+        return b;
+    }
+
+    static void blend(cv::Mat& dst, const Bitmap& b, cv::Point org) {
+        CV_Assert(dst.type() == CV_8UC3);
+        cv::Rect area(org + b.offset, b.alpha.size());
+        cv::Rect clipped = area & cv::Rect(0, 0, dst.cols, dst.rows);
+        if (clipped.empty()) return;
+        const int ax = clipped.x - area.x, ay = clipped.y - area.y;
+        const int c0 = b.color[0], c1 = b.color[1], c2 = b.color[2];
+        for (int y = 0; y < clipped.height; ++y) {
+            const uchar* a = b.alpha.ptr<uchar>(ay + y) + ax;
+            uchar* d = dst.ptr<uchar>(clipped.y + y) + 3 * clipped.x;
+            for (int x = 0; x < clipped.width; ++x, d += 3) {
+                const int w = a[x];
+                if (w == 0) continue;
+                if (w == 255) { d[0] = (uchar)c0; d[1] = (uchar)c1; d[2] = (uchar)c2; continue; }
+                const int iw = 255 - w;
+                d[0] = (uchar)((c0 * w + d[0] * iw + 127) / 255);
+                d[1] = (uchar)((c1 * w + d[1] * iw + 127) / 255);
+                d[2] = (uchar)((c2 * w + d[2] * iw + 127) / 255);
+            }
+        }
+    }
+
+    Store labels_, glyphs_;
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> misses_{0};
+    std::atomic<uint64_t> evictions_{0};
+    std::atomic<size_t> entries_{0};
+};
+
+static const LabelStyle kLabelStyle(0.5, 1, cv::Scalar(0, 255, 0));
+static const LabelStyle kStatsStyle(0.6, 2, cv::Scalar(0, 255, 0), cv::LINE_8);
+
+// Draw quads and payload labels; `scale` maps frame coordinates onto `img`.
+static void drawCodeOverlays(cv::Mat& img, const std::vector<DetectedCode>& codes,
+                             float scale, LabelCache& labels) {
+    for (size_t i = 0; i < codes.size(); ++i) {
+        const DetectedCode& code = codes[i];
+        cv::Point poly[4];
+        for (int k = 0; k < 4; ++k)
+            poly[k] = cv::Point(cvRound(code.quad[k].x * scale), cvRound(code.quad[k].y * scale));
+        const cv::Point* ptsPoly = poly;
+        int npts = 4;
+        cv::polylines(img, &ptsPoly, &npts, 1, true, cv::Scalar(0, 255, 0), 2, cv::LINE_AA);
+
+        cv::Point2f c = code.center();
+        labels.draw(img, code.payload, cv::Point(cvRound(c.x * scale) - 20, cvRound(c.y * scale) - 10),
+                    kLabelStyle);
+    }
+}
+// ---- End cached overlay text ----
+
+// ---- Preview rendering ----
+// What the detection loop hands to preview consumers (window, HTTP stream).
+struct PreviewFrame {
+    cv::Mat frame;                    // full resolution, shared read-only
+    std::vector<DetectedCode> codes;
+    std::string statsText;
+};
+
+// Downscale to at most `maxWidth` and draw the overlays on the small image.
+static void renderPreview(const PreviewFrame& in, int maxWidth, LabelCache& labels, cv::Mat& preview) {
+    const cv::Mat& src = in.frame;
+    double scale = 1.0;
+    if (src.cols > maxWidth) {
+        scale = static_cast<double>(maxWidth) / src.cols;
+        cv::resize(src, preview, cv::Size(maxWidth, cvRound(src.rows * scale)), 0, 0, cv::INTER_AREA);
+    } else {
+        src.copyTo(preview);
+    }
+    drawCodeOverlays(preview, in.codes, static_cast<float>(scale), labels);
+    labels.drawGlyphs(preview, in.statsText, cv::Point(10, 24), kStatsStyle);
+}
+// ---- End preview rendering ----
+
+// ---- Preview display (own thread) ----
+// Owns the HighGUI window. The detection loop hands over the latest frame and
+// its results; this thread downscales, draws the overlays on the small
+// preview and calls imshow/waitKey at a capped rate, so a slow X server or
+// compositor never stalls detection. Frames published while the previous one
+// is still pending simply replace it.
+class PreviewDisplay {
+public:
+    PreviewDisplay(const std::string& title, int maxWidth, double maxFps)
+        : title_(title), maxWidth_(std::max(80, maxWidth)),
+          intervalMs_(maxFps > 0.0 ? 1000.0 / maxFps : 0.0) {}
+    ~PreviewDisplay() { stop(); }
+
+    // Takes effect from the next shown frame.
+    void setMaxFps(double maxFps) { intervalMs_.store(maxFps > 0.0 ? 1000.0 / maxFps : 0.0); }
+
+    void start() {
+        if (worker_.joinable()) return;
+        stopping_ = false;
+        worker_ = std::thread(&PreviewDisplay::run, this);
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cond_.notify_all();
+        if (worker_.joinable()) worker_.join();
+    }
+
+    // True once the refresh interval since the last shown frame has elapsed.
+    // The caller only pays for publish() (which shares its frame buffer)
+    // when the display would actually use the frame.
+    bool due() const { return wanting_.load(std::memory_order_acquire); }
+
+    // Shares the frame's buffer; the caller must not write into it afterwards
+    // (the capture loop releases its handle so the next read allocates).
+    void publish(const cv::Mat& frame, const std::vector<DetectedCode>& codes,
+                 const std::string& statsText) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_.frame = frame;
+            pending_.codes = codes;
+            pending_.statsText = statsText;
+            hasPending_ = true;
+            wanting_.store(false, std::memory_order_release);
+        }
+        cond_.notify_one();
+    }
+
+    // Last key pressed in the preview window, or -1.
+    int takeKey() { return lastKey_.exchange(-1); }
+
+    LabelCache::Stats labelStats() const { return labels_.stats(); }
+
+private:
+    void run() {
+        cv::Mat preview;
+        double lastShown = 0.0;
+        for (;;) {
+            PreviewFrame slot;
+            bool have = false;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                // Wake periodically to keep pumping GUI events.
+                cond_.wait_for(lock, std::chrono::milliseconds(30),
+                               [this] { return hasPending_ || stopping_; });
+                if (stopping_) break;
+                if (hasPending_) {
+                    std::swap(slot, pending_);
+                    hasPending_ = false;
+                    have = true;
+                }
+            }
+
+            if (have) {
+                renderPreview(slot, maxWidth_, labels_, preview);
+                cv::imshow(title_, preview);
+                lastShown = nowMs();
+            }
+
+            // waitKey doubles as the frame pacer: it pumps events until the
+            // next preview frame is due.
+            int waitMs = 1;
+            if (have && intervalMs_ > 0.0)
+                waitMs = std::max(1, static_cast<int>(lastShown + intervalMs_ - nowMs()));
+            int key = cv::waitKey(waitMs);
+            if (key >= 0) lastKey_.store(key);
+            if (nowMs() - lastShown >= intervalMs_)
+                wanting_.store(true, std::memory_order_release);
+        }
+        cv::destroyAllWindows();
+    }
+
+    const std::string title_;
+    const int maxWidth_;
+    std::atomic<double> intervalMs_;
+
+    std::thread worker_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    PreviewFrame pending_;
+    bool hasPending_ = false;
+    bool stopping_ = false;
+    std::atomic<bool> wanting_{true};
+    std::atomic<int> lastKey_{-1};
+    LabelCache labels_; // only touched by the display thread
+};
+// ---- End preview display ----
+
+// ---- MJPEG preview stream (HTTP, localhost only) ----
+// Serves the annotated preview as multipart/x-mixed-replace on
+// http://127.0.0.1:<port>/stream. Like the window it is fed from a
+// latest-frame slot at a capped rate; each preview frame is JPEG-encoded
+// once on the encoder thread and the same buffer is sent to every client.
+// Clients that cannot keep up skip to the newest frame.
+class MjpegServer {
+public:
+    MjpegServer(int port, int maxWidth, double maxFps, int jpegQuality)
+        : port_(port), maxWidth_(std::max(80, maxWidth)),
+          intervalMs_(maxFps > 0.0 ? 1000.0 / maxFps : 0.0), quality_(jpegQuality) {}
+    ~MjpegServer() { stop(); }
+
+    // Takes effect from the next encoded frame.
+    void setMaxFps(double maxFps) { intervalMs_.store(maxFps > 0.0 ? 1000.0 / maxFps : 0.0); }
+
+    bool start() {
+        listenFd_ = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listenFd_ < 0) return false;
+        int one = 1;
+        ::setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(static_cast<uint16_t>(port_));
+        if (::bind(listenFd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+            ::listen(listenFd_, 8) < 0) {
+            ::close(listenFd_);
+            listenFd_ = -1;
+            return false;
+        }
+        stopping_ = false;
+        acceptThread_ = std::thread(&MjpegServer::acceptLoop, this);
+        encodeThread_ = std::thread(&MjpegServer::encodeLoop, this);
+        return true;
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopping_) return;
+            stopping_ = true;
+        }
+        cond_.notify_all();
+        frameCond_.notify_all();
+        if (acceptThread_.joinable()) acceptThread_.join();
+        if (encodeThread_.joinable()) encodeThread_.join();
+        std::list<ClientThread> clients;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            clients.swap(clientThreads_);
+        }
+        for (std::list<ClientThread>::iterator it = clients.begin(); it != clients.end(); ++it) it->thread.join();
+        if (listenFd_ >= 0) { ::close(listenFd_); listenFd_ = -1; }
+    }
+
+    // Same contract as PreviewDisplay: only publish when due, the frame
+    // buffer is shared and must not be written afterwards.
+    bool due() const { return wanting_.load(std::memory_order_acquire); }
+
+    void publish(const cv::Mat& frame, const std::vector<DetectedCode>& codes,
+                 const std::string& statsText) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_.frame = frame;
+            pending_.codes = codes;
+            pending_.statsText = statsText;
+            hasPending_ = true;
+            wanting_.store(false, std::memory_order_release);
+        }
+        cond_.notify_one();
+    }
+
+    int port() const { return port_; }
+    int clientCount() const { return clients_.load(); }
+    uint64_t framesEncoded() const { return encoded_.load(); }
+    uint64_t rejectedClients() const { return rejected_.load(); }
+
+private:
+    typedef std::shared_ptr<const std::vector<uchar> > JpegPtr;
+
+    static const size_t kMaxConnections = 8;
+
+    struct ClientThread {
+        std::thread thread;
+        std::atomic<bool> done{false};
+    };
+
+    void encodeLoop() {
+        cv::Mat preview;
+        LabelCache labels;
+        std::vector<int> params;
+        params.push_back(cv::IMWRITE_JPEG_QUALITY);
+        params.push_back(quality_);
+        for (;;) {
+            PreviewFrame slot;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cond_.wait(lock, [this] { return hasPending_ || stopping_; });
+                if (stopping_) break;
+                std::swap(slot, pending_);
+                hasPending_ = false;
+            }
+            double t0 = nowMs();
+            // Nobody watching: skip the encode but keep the pacing.
+            if (clients_.load() > 0) {
+                renderPreview(slot, maxWidth_, labels, preview);
+                std::shared_ptr<std::vector<uchar> > jpeg(new std::vector<uchar>());
+                if (cv::imencode(".jpg", preview, *jpeg, params)) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    latest_ = jpeg;
+                    ++seq_;
+                    encoded_.fetch_add(1);
+                }
+                frameCond_.notify_all();
+            }
+            double left = intervalMs_ - (nowMs() - t0);
+            if (left > 0) {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cond_.wait_for(lock, std::chrono::microseconds(static_cast<long long>(left * 1000)),
+                               [this] { return stopping_; });
+            }
+            wanting_.store(true, std::memory_order_release);
+        }
+    }
+
+    void acceptLoop() {
+        for (;;) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (stopping_) break;
+            }
+            pollfd pfd;
+            pfd.fd = listenFd_;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            if (::poll(&pfd, 1, 200) <= 0) continue;
+            int fd = ::accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) continue;
+            timeval tv;
+            tv.tv_sec = 2;
+            tv.tv_usec = 0;
+            // A stuck client must not pin its thread forever.
+            ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+            // Join viewers that have gone away, then admit up to the limit.
+            std::list<ClientThread> finished;
+            bool full;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                for (std::list<ClientThread>::iterator it = clientThreads_.begin(); it != clientThreads_.end();) {
+                    std::list<ClientThread>::iterator cur = it++;
+                    if (cur->done.load()) finished.splice(finished.end(), clientThreads_, cur);
+                }
+                full = clientThreads_.size() >= kMaxConnections;
+                if (!full) {
+                    clientThreads_.emplace_back();
+                    ClientThread& c = clientThreads_.back();
+                    c.thread = std::thread(&MjpegServer::serveClient, this, fd, &c.done);
+                }
+            }
+            for (std::list<ClientThread>::iterator it = finished.begin(); it != finished.end(); ++it)
+                it->thread.join();
+            if (full) {
+                rejected_.fetch_add(1);
+                sendAll(fd, "HTTP/1.0 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n");
+                ::close(fd);
+            }
+        }
+    }
+
+    static bool sendAll(int fd, const void* data, size_t len) {
+        const char* p = static_cast<const char*>(data);
+        while (len > 0) {
+            ssize_t n = ::send(fd, p, len, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n;
+            len -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    static bool sendAll(int fd, const std::string& s) { return sendAll(fd, s.data(), s.size()); }
+
+    void serveClient(int fd, std::atomic<bool>* done) {
+        std::string request;
+        char buf[1024];
+        while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+            ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0) break;
+            request.append(buf, static_cast<size_t>(n));
+        }
+        std::string path;
+        if (request.compare(0, 4, "GET ") == 0) {
+            size_t end = request.find(' ', 4);
+            if (end != std::string::npos) path = request.substr(4, end - 4);
+        }
+
+        if (path == "/" || path == "/index.html") {
+            const std::string body = "<html><body style=\"margin:0;background:#000\">"
+                                     "<img src=\"/stream\"></body></html>";
+            sendAll(fd, cv::format("HTTP/1.0 200 OK\r\nContent-Type: text/html\r\n"
+                                   "Content-Length: %zu\r\n\r\n", body.size()) + body);
+        } else if (path == "/stream") {
+            streamTo(fd);
+        } else {
+            sendAll(fd, "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+        }
+        ::close(fd);
+        done->store(true);
+    }
+
+    void streamTo(int fd) {
+        const std::string header =
+            "HTTP/1.0 200 OK\r\n"
+            "Cache-Control: no-cache\r\n"
+            "Connection: close\r\n"
+            "Content-Type: multipart/x-mixed-replace; boundary=qrframe\r\n\r\n";
+        if (!sendAll(fd, header)) return;
+        clients_.fetch_add(1);
+        uint64_t sent = 0;
+        for (;;) {
+            JpegPtr jpeg;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                frameCond_.wait(lock, [&] { return seq_ != sent || stopping_; });
+                if (stopping_) break;
+                jpeg = latest_;
+                sent = seq_;
+            }
+            std::string part = cv::format("--qrframe\r\nContent-Type: image/jpeg\r\n"
+                                          "Content-Length: %zu\r\n\r\n", jpeg->size());
+            if (!sendAll(fd, part) || !sendAll(fd, jpeg->data(), jpeg->size()) || !sendAll(fd, "\r\n"))
+                break;
+        }
+        clients_.fetch_sub(1);
+    }
+
+    const int port_;
+    const int maxWidth_;
+    std::atomic<double> intervalMs_;
+    const int quality_;
+
+    int listenFd_ = -1;
+    std::thread acceptThread_;
+    std::thread encodeThread_;
+    std::list<ClientThread> clientThreads_;  // finished ones reaped on accept, the rest in stop()
+
+    std::mutex mutex_;
+    std::condition_variable cond_;       // pending frame / stop
+    std::condition_variable frameCond_;  // new JPEG for clients
+    PreviewFrame pending_;
+    bool hasPending_ = false;
+    bool stopping_ = false;
+    JpegPtr latest_;
+    uint64_t seq_ = 0;
+
+    std::atomic<bool> wanting_{true};
+    std::atomic<int> clients_{0};
+    std::atomic<uint64_t> encoded_{0};
+    std::atomic<uint64_t> rejected_{0};
+};
+// ---- End MJPEG preview stream ----
+
+// ---- Code tracker ----
+// Associates codes across frames so consumers can react to a code entering
+// or leaving view rather than to every frame it is seen in. Decoded codes
+// match tracks by payload; undecoded quads inherit the id of the nearest
+// track within `matchRadius` so a momentary decode failure does not split
+// a track.
+struct TrackEvent {
+    enum Type { Appeared, Disappeared };
+    Type type;
+    int trackId;
+    std::string payload;
+    DetectedCode code; // last known position
+};
+
+class CodeTracker {
+public:
+    explicit CodeTracker(int maxMissedFrames = 10, float matchRadius = 60.f)
+        : maxMissed_(maxMissedFrames), matchRadius_(matchRadius) {}
+
+    // Assigns trackId on `codes` and returns the appeared/disappeared events
+    // caused by this frame.
+    std::vector<TrackEvent> update(std::vector<DetectedCode>& codes) {
+        std::vector<TrackEvent> events;
+        ++frame_;
+
+        for (size_t i = 0; i < codes.size(); ++i) {
+            DetectedCode& code = codes[i];
+            if (code.payload.empty()) continue;
+            Track* t = findByPayload(code.payload);
+            if (!t) {
+                tracks_.push_back(Track());
+                t = &tracks_.back();
+                t->id = nextId_++;
+                t->payload = code.payload;
+                t->firstFrame = frame_;
+                code.trackId = t->id;
+                t->code = code;
+                TrackEvent ev = { TrackEvent::Appeared, t->id, t->payload, code };
+                events.push_back(ev);
+            }
+            code.trackId = t->id;
+            t->code = code;
+            t->lastFrame = frame_;
+        }
+
+        for (size_t i = 0; i < codes.size(); ++i) {
+            DetectedCode& code = codes[i];
+            if (!code.payload.empty()) continue;
+            Track* t = nearest(code.center());
+            if (!t) continue;
+            code.trackId = t->id;
+            t->code.trackId = t->id;
+            for (int k = 0; k < 4; ++k) t->code.quad[k] = code.quad[k];
+            t->lastFrame = frame_;
+        }
+
+        for (size_t i = 0; i < tracks_.size();) {
+            if (frame_ - tracks_[i].lastFrame > maxMissed_) {
+                TrackEvent ev = { TrackEvent::Disappeared, tracks_[i].id, tracks_[i].payload, tracks_[i].code };
+                events.push_back(ev);
+                tracks_[i] = tracks_.back();
+                tracks_.pop_back();
+            } else {
+                ++i;
+            }
+        }
+        return events;
+    }
+
+    size_t activeTracks() const { return tracks_.size(); }
+
+    // Bounding boxes of the active tracks' last known quads.
+    std::vector<cv::Rect> regions() const {
+        std::vector<cv::Rect> out;
+        out.reserve(tracks_.size());
+        for (size_t i = 0; i < tracks_.size(); ++i) {
+            std::vector<cv::Point2f> q(tracks_[i].code.quad, tracks_[i].code.quad + 4);
+            out.push_back(cv::boundingRect(q));
+        }
+        return out;
+    }
+
+private:
+    struct Track {
+        int id = 0;
+        std::string payload;
+        DetectedCode code;
+        long long firstFrame = 0;
+        long long lastFrame = 0;
+    };
+
+    Track* findByPayload(const std::string& payload) {
+        for (size_t i = 0; i < tracks_.size(); ++i)
+            if (tracks_[i].payload == payload) return &tracks_[i];
+        return nullptr;
+    }
+
+    Track* nearest(const cv::Point2f& p) {
+        Track* best = nullptr;
+        double bestDist = matchRadius_;
+        for (size_t i = 0; i < tracks_.size(); ++i) {
+            double d = cv::norm(tracks_[i].code.center() - p);
+            if (d < bestDist) { bestDist = d; best = &tracks_[i]; }
+        }
+        return best;
+    }
+
+    const int maxMissed_;
+    const float matchRadius_;
+    std::vector<Track> tracks_;
+    long long frame_ = 0;
+    int nextId_ = 1;
+};
+// ---- End code tracker ----
+
+// ---- Asynchronous media sinks ----
+// Sinks receive frames by reference count (cv::Mat shares the buffer, no
+// copy) through a bounded queue and do all encoding and disk I/O on their
+// own worker thread. offer() never blocks: when a worker falls behind, the
+// drop policy decides which item is discarded and the drop is counted.
+struct SinkItem {
+    cv::Mat frame;                    // shared, read-only
+    std::vector<DetectedCode> codes;
+    std::vector<TrackEvent> events;
+    long long timestampMs = 0;        // wall clock
+    long long frameIndex = 0;
+};
+
+enum class DropPolicy { DropNewest, DropOldest };
+
+class AsyncSink {
+public:
+    struct Counters {
+        uint64_t offered = 0;
+        uint64_t dropped = 0;
+        uint64_t written = 0;
+        uint64_t failed = 0;
+    };
+
+    AsyncSink(const std::string& name, size_t capacity, DropPolicy policy)
+        : name_(name), capacity_(std::max<size_t>(1, capacity)), policy_(policy) {}
+    // Concrete sinks must call stop() in their own destructor, while the
+    // members consume() uses still exist; this one only catches a sink that
+    // never started, so an early return never destroys a joinable thread.
+    virtual ~AsyncSink() { stop(); }
+
+    const std::string& name() const { return name_; }
+
+    // Call once the derived sink is fully constructed.
+    void start() {
+        if (!worker_.joinable()) worker_ = std::thread(&AsyncSink::run, this);
+    }
+
+    // Drains what is queued, then joins the worker.
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cond_.notify_all();
+        if (worker_.joinable()) worker_.join();
+    }
+
+    // Returns false if the item (or, with DropOldest, an older one) was dropped.
+    bool offer(const SinkItem& item) {
+        bool accepted = true;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++counters_.offered;
+            if (queue_.size() >= capacity_) {
+                ++counters_.dropped;
+                accepted = false;
+                if (policy_ == DropPolicy::DropNewest) return false;
+                queue_.pop_front();
+            }
+            queue_.push_back(item);
+        }
+        cond_.notify_one();
+        return accepted;
+    }
+
+    Counters counters() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return counters_;
+    }
+
+protected:
+    // Runs on the worker thread. Returns false if the item could not be written.
+    virtual bool consume(const SinkItem& item) = 0;
+    // Runs on the worker thread after the queue has drained.
+    virtual void finish() {}
+
+private:
+    void run() {
+        for (;;) {
+            SinkItem item;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cond_.wait(lock, [this] { return !queue_.empty() || stopping_; });
+                if (queue_.empty()) break; // stopping and drained
+                item = queue_.front();
+                queue_.pop_front();
+            }
+            bool ok = consume(item);
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (ok) ++counters_.written; else ++counters_.failed;
+        }
+        finish();
+    }
+
+    const std::string name_;
+    const size_t capacity_;
+    const DropPolicy policy_;
+    std::thread worker_;
+    mutable std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<SinkItem> queue_;
+    bool stopping_ = false;
+    Counters counters_;
+};
+
+// Annotated MJPG recording. The writer is opened lazily from the first
+// frame's size so the capture resolution need not be known up front.
+class VideoRecorderSink : public AsyncSink {
+public:
+    VideoRecorderSink(const std::string& path, double fps, size_t capacity, DropPolicy policy)
+        : AsyncSink("record", capacity, policy), path_(path), fps_(fps > 0.0 ? fps : 30.0) {}
+    ~VideoRecorderSink() override { stop(); }
+
+protected:
+    bool consume(const SinkItem& item) override {
+        if (!writer_.isOpened()) {
+            if (openFailed_) return false;
+            if (!writer_.open(path_, cv::VideoWriter::fourcc('M','J','P','G'), fps_, item.frame.size())) {
+                std::cerr << "无法打开录像文件 " << path_ << std::endl;
+                openFailed_ = true;
+                return false;
+            }
+        }
+        item.frame.copyTo(canvas_); // never draw into the shared buffer
+        drawCodeOverlays(canvas_, item.codes, 1.f, labels_);
+        writer_.write(canvas_);
+        return true;
+    }
+    void finish() override { writer_.release(); }
+
+private:
+    const std::string path_;
+    const double fps_;
+    cv::VideoWriter writer_;
+    bool openFailed_ = false;
+    cv::Mat canvas_;
+    LabelCache labels_;
+};
+
+// One annotated JPEG per newly appeared track.
+class SnapshotSink : public AsyncSink {
+public:
+    SnapshotSink(const std::string& dir, int jpegQuality, size_t capacity, DropPolicy policy)
+        : AsyncSink("snapshot", capacity, policy), dir_(dir), quality_(jpegQuality) {
+        ::mkdir(dir_.c_str(), 0755); // EEXIST is fine
+    }
+    ~SnapshotSink() override { stop(); }
+
+protected:
+    bool consume(const SinkItem& item) override {
+        item.frame.copyTo(canvas_);
+        drawCodeOverlays(canvas_, item.codes, 1.f, labels_);
+        std::vector<int> params;
+        params.push_back(cv::IMWRITE_JPEG_QUALITY);
+        params.push_back(quality_);
+        bool ok = true;
+        for (size_t i = 0; i < item.events.size(); ++i) {
+            const TrackEvent& ev = item.events[i];
+            if (ev.type != TrackEvent::Appeared) continue;
+            std::string path = cv::format("%s/%lld_track%d.jpg", dir_.c_str(), item.timestampMs, ev.trackId);
+            ok = cv::imwrite(path, canvas_, params) && ok;
+        }
+        return ok;
+    }
+
+private:
+    const std::string dir_;
+    const int quality_;
+    cv::Mat canvas_;
+    LabelCache labels_;
+};
+
+static bool hasAppeared(const std::vector<TrackEvent>& events) {
+    for (size_t i = 0; i < events.size(); ++i)
+        if (events[i].type == TrackEvent::Appeared) return true;
+    return false;
+}
+// ---- End asynchronous media sinks ----
+
+// ---- Code quality analytics ----
+// Per-code diagnostics computed off the hot path: module size, contrast,
+// perspective skew and, for codes that were located but not decoded, the
+// first stage that fails. OpenCV's decoder does not expose its internals,
+// so the stage is determined independently: the quad is rectified, the
+// version is estimated from the timing patterns and the module grid is
+// sampled, then the BCH-protected format and version fields are checked,
+// then every Reed-Solomon block is checked with the decoded version and
+// error-correction level. A code whose blocks are all correctable but
+// still did not decode failed in payload parsing (or OpenCV sampled it
+// differently).
+enum FailureStage { StageDecoded, StageSampling, StageFormat, StageVersion, StageRs, StagePayload, StageCount };
+static const char* const kStageNames[StageCount] = {"decoded", "sampling", "format", "version", "rs", "payload"};
+
+// Reed-Solomon blocks of one symbol (see checkCodewords()).
+struct RsCheck {
+    int blocks = 0;
+    int corrected = 0;     // blocks with errors within their ECC
+    int uncorrectable = 0;
+};
+
+struct CodeDiagnostics {
+    double modulePx = 0.0;  // average module pitch in frame pixels
+    double contrast = 0.0;  // (mean light - mean dark) / 255 over sampled modules
+    double skewDeg = 0.0;   // largest corner-angle deviation from 90 degrees
+    int version = 0;        // estimated, 0 if sampling failed
+    FailureStage stage = StageSampling;
+    RsCheck rs;             // filled for undecoded codes that reach the RS stage
+};
+
+// Largest deviation of the quad's corner angles from a right angle.
+static double quadSkewDeg(const DetectedCode& code) {
+    double worst = 0.0;
+    for (int k = 0; k < 4; ++k) {
+        cv::Point2f a = code.quad[(k + 3) % 4] - code.quad[k];
+        cv::Point2f b = code.quad[(k + 1) % 4] - code.quad[k];
+        double na = cv::norm(a), nb = cv::norm(b);
+        if (na < 1e-3 || nb < 1e-3) return 90.0;
+        double cosang = std::max(-1.0, std::min(1.0, static_cast<double>(a.dot(b)) / (na * nb)));
+        worst = std::max(worst, std::fabs(std::acos(cosang) * 180.0 / CV_PI - 90.0));
+    }
+    return worst;
+}
+
+static int hamming(uint32_t a, uint32_t b) {
+    uint32_t x = a ^ b;
+    int n = 0;
+    while (x) { x &= x - 1; ++n; }
+    return n;
+}
+
+// 15-bit format word as read from one copy (bit i at the positions ISO 18004
+// assigns to it); valid if within 3 bit errors of one of the 32 codewords,
+// whose 5 data bits (ECL indicator, mask) are returned, else -1.
+static int formatWordData(uint32_t word) {
+    for (uint32_t data = 0; data < 32; ++data) {
+        uint32_t rem = data;
+        for (int i = 0; i < 10; ++i) rem = (rem << 1) ^ ((rem >> 9) * 0x537);
+        uint32_t code = ((data << 10) | (rem & 0x3FF)) ^ 0x5412;
+        if (hamming(word, code) <= 3) return static_cast<int>(data);
+    }
+    return -1;
+}
+
+static bool versionWordValid(uint32_t word, int version) {
+    uint32_t rem = static_cast<uint32_t>(version);
+    for (int i = 0; i < 12; ++i) rem = (rem << 1) ^ ((rem >> 11) * 0x1F25);
+    uint32_t code = (static_cast<uint32_t>(version) << 12) | (rem & 0xFFF);
+    return hamming(word, code) <= 3;
+}
+
+// `m` is N x N, 1 = dark, indexed m(y, x). Returns the format data of the
+// first valid copy, or -1.
+static int readFormatInfo(const cv::Mat& m) {
+    const int n = m.rows;
+    auto bit = [&](int x, int y) { return static_cast<uint32_t>(m.at<uchar>(y, x) & 1); };
+    uint32_t a = 0, b = 0;
+    for (int i = 0; i <= 5; ++i) a |= bit(8, i) << i;
+    a |= bit(8, 7) << 6;
+    a |= bit(8, 8) << 7;
+    a |= bit(7, 8) << 8;
+    for (int i = 9; i < 15; ++i) a |= bit(14 - i, 8) << i;
+    for (int i = 0; i < 8; ++i) b |= bit(n - 1 - i, 8) << i;
+    for (int i = 8; i < 15; ++i) b |= bit(8, n - 15 + i) << i;
+    const int data = formatWordData(a);
+    return data >= 0 ? data : formatWordData(b);
+}
+
+static bool versionInfoValid(const cv::Mat& m, int version) {
+    if (version < 7) return true; // no version field below 7
+    const int n = m.rows;
+    uint32_t a = 0, b = 0;
+    for (int i = 0; i < 18; ++i) {
+        int p = n - 11 + i % 3, q = i / 3;
+        a |= static_cast<uint32_t>(m.at<uchar>(q, p) & 1) << i;
+        b |= static_cast<uint32_t>(m.at<uchar>(p, q) & 1) << i;
+    }
+    return versionWordValid(a, version) || versionWordValid(b, version);
+}
+
+// Reed-Solomon check of the sampled symbol: the data modules are read in
+// the standard zigzag order with the format's mask removed, split into the
+// version/ECL's blocks, and each block's syndromes are computed. A block
+// with errors is run through Berlekamp-Massey and a Chien search; it is
+// correctable when the locator has as many roots inside the block as its
+// degree, and at most ecc/2 of them.
+struct GaloisField256 {
+    uint8_t exp[512];
+    uint8_t log[256];
+    GaloisField256() {
+        int x = 1;
+        for (int i = 0; i < 255; ++i) {
+            exp[i] = static_cast<uint8_t>(x);
+            log[x] = static_cast<uint8_t>(i);
+            x <<= 1;
+            if (x & 0x100) x ^= 0x11D;
+        }
+        for (int i = 255; i < 512; ++i) exp[i] = exp[i - 255];
+        log[0] = 0;
+    }
+    uint8_t mul(uint8_t a, uint8_t b) const { return a && b ? exp[log[a] + log[b]] : 0; }
+    uint8_t div(uint8_t a, uint8_t b) const { return a ? exp[log[a] + 255 - log[b]] : 0; }
+};
+// Built during static initialization, like the CRC table.
+static const GaloisField256 kGf256;
+
+// Indexed [ecl][version], ecl 0..3 = L, M, Q, H (ISO 18004 table 9).
+static const int8_t kEccPerBlock[4][41] = {
+    { -1, 7, 10, 15, 20, 26, 18, 20, 24, 30, 18, 20, 24, 26, 30, 22, 24, 28, 30, 28, 28,
+      28, 28, 30, 30, 26, 28, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30 },
+    { -1, 10, 16, 26, 18, 24, 16, 18, 22, 22, 26, 30, 22, 22, 24, 24, 28, 28, 26, 26, 26,
+      26, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28 },
+    { -1, 13, 22, 18, 26, 18, 24, 18, 22, 20, 24, 28, 26, 24, 20, 30, 24, 28, 28, 26, 30,
+      28, 30, 30, 30, 30, 28, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30 },
+    { -1, 17, 28, 22, 16, 22, 28, 26, 26, 24, 28, 24, 28, 22, 24, 24, 30, 28, 28, 26, 28,
+      30, 24, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30 },
+};
+static const int8_t kEccBlocks[4][41] = {
+    { -1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 4, 4, 4, 4, 4, 6, 6, 6, 6, 7, 8,
+      8, 9, 9, 10, 12, 12, 12, 13, 14, 15, 16, 17, 18, 19, 19, 20, 21, 22, 24, 25 },
+    { -1, 1, 1, 1, 2, 2, 4, 4, 4, 5, 5, 5, 8, 9, 9, 10, 10, 11, 13, 14, 16,
+      17, 17, 18, 20, 21, 23, 25, 26, 28, 29, 31, 33, 35, 37, 38, 40, 43, 45, 47, 49 },
+    { -1, 1, 1, 2, 2, 4, 4, 6, 6, 8, 8, 8, 10, 12, 16, 12, 17, 16, 18, 21, 20,
+      23, 23, 25, 27, 29, 34, 34, 35, 38, 40, 43, 45, 48, 51, 53, 56, 59, 62, 65, 68 },
+    { -1, 1, 1, 2, 4, 4, 4, 5, 6, 8, 8, 11, 11, 16, 16, 18, 16, 19, 21, 25, 25,
+      25, 34, 30, 32, 35, 37, 40, 42, 45, 48, 51, 54, 57, 60, 63, 66, 70, 74, 77, 81 },
+};
+
+// Modules used by finders, separators, timing, alignment, format and
+// version information (1 = function module).
+static cv::Mat functionModules(int version) {
+    const int n = 17 + 4 * version;
+    cv::Mat f(n, n, CV_8UC1, cv::Scalar(0));
+    f(cv::Rect(0, 0, 9, 9)).setTo(1);     // top-left finder, separator, format
+    f(cv::Rect(n - 8, 0, 8, 9)).setTo(1); // top-right
+    f(cv::Rect(0, n - 8, 9, 8)).setTo(1); // bottom-left, incl. the dark module
+    f.row(6).setTo(1);
+    f.col(6).setTo(1);
+    if (version >= 2) {
+        const int count = version / 7 + 2;
+        const int step = (version * 8 + count * 3 + 5) / (count * 4 - 4) * 2;
+        std::vector<int> pos(count);
+        pos[0] = 6;
+        for (int i = count - 1, p = n - 7; i >= 1; --i, p -= step) pos[i] = p;
+        for (int i = 0; i < count; ++i) {
+            for (int j = 0; j < count; ++j) {
+                if ((i == 0 && j == 0) || (i == 0 && j == count - 1) || (i == count - 1 && j == 0)) continue;
+                f(cv::Rect(pos[i] - 2, pos[j] - 2, 5, 5)).setTo(1);
+            }
+        }
+    }
+    if (version >= 7) {
+        f(cv::Rect(n - 11, 0, 3, 6)).setTo(1);
+        f(cv::Rect(0, n - 11, 6, 3)).setTo(1);
+    }
+    return f;
+}
+
+static bool maskBit(int mask, int x, int y) {
+    switch (mask) {
+    case 0: return (x + y) % 2 == 0;
+    case 1: return y % 2 == 0;
+    case 2: return x % 3 == 0;
+    case 3: return (x + y) % 3 == 0;
+    case 4: return (x / 3 + y / 2) % 2 == 0;
+    case 5: return x * y % 2 + x * y % 3 == 0;
+    case 6: return (x * y % 2 + x * y % 3) % 2 == 0;
+    default: return ((x + y) % 2 + x * y % 3) % 2 == 0;
+    }
+}
+
+// Errors found in one block (data then ECC codewords): 0 if clean, -1 if
+// beyond what its ECC can correct.
+static int rsBlockErrors(const uint8_t* block, int len, int ecc) {
+    std::vector<uint8_t> syn(ecc);
+    bool clean = true;
+    for (int i = 0; i < ecc; ++i) {
+        uint8_t s = 0;
+        for (int k = 0; k < len; ++k) s = kGf256.mul(s, kGf256.exp[i]) ^ block[k];
+        syn[i] = s;
+        clean = clean && s == 0;
+    }
+    if (clean) return 0;
+
+    std::vector<uint8_t> c(1, 1), b(1, 1);
+    int l = 0, m = 1;
+    uint8_t bd = 1;
+    for (int n = 0; n < ecc; ++n) {
+        uint8_t d = syn[n];
+        for (int i = 1; i <= l && i < static_cast<int>(c.size()); ++i) d ^= kGf256.mul(c[i], syn[n - i]);
+        if (d == 0) { ++m; continue; }
+        std::vector<uint8_t> t = c;
+        const uint8_t coef = kGf256.div(d, bd);
+        if (c.size() < b.size() + m) c.resize(b.size() + m, 0);
+        for (size_t i = 0; i < b.size(); ++i) c[i + m] ^= kGf256.mul(coef, b[i]);
+        if (2 * l <= n) {
+            l = n + 1 - l;
+            b = t;
+            bd = d;
+            m = 1;
+        } else {
+            ++m;
+        }
+    }
+    if (2 * l > ecc) return -1;
+
+    // Chien search over the block's positions: codeword k has degree len-1-k.
+    int roots = 0;
+    for (int deg = 0; deg < len; ++deg) {
+        const uint8_t x = kGf256.exp[(255 - deg % 255) % 255];
+        uint8_t v = 0, xp = 1;
+        for (size_t i = 0; i < c.size(); ++i) {
+            v ^= kGf256.mul(c[i], xp);
+            xp = kGf256.mul(xp, x);
+        }
+        roots += v == 0;
+    }
+    return roots == l ? l : -1;
+}
+
+// `format` is the 5-bit format data from readFormatInfo().
+static RsCheck checkCodewords(const cv::Mat& m, int version, int format) {
+    static const int kEclFromBits[4] = { 1, 0, 3, 2 }; // indicator M, L, H, Q -> L, M, Q, H
+    const int ecl = kEclFromBits[(format >> 3) & 3], mask = format & 7;
+    const int n = m.rows;
+    const cv::Mat func = functionModules(version);
+
+    int raw = (16 * version + 128) * version + 64;
+    if (version >= 2) {
+        const int count = version / 7 + 2;
+        raw -= (25 * count - 10) * count - 55;
+        if (version >= 7) raw -= 36;
+    }
+    const int total = raw / 8;
+    std::vector<uint8_t> words(total, 0);
+    int bit = 0;
+    for (int right = n - 1; right >= 1; right -= 2) {
+        if (right == 6) right = 5;
+        for (int vert = 0; vert < n; ++vert) {
+            for (int j = 0; j < 2; ++j) {
+                const int x = right - j;
+                const bool upward = ((right + 1) & 2) == 0;
+                const int y = upward ? n - 1 - vert : vert;
+                if (func.at<uchar>(y, x) || bit >= total * 8) continue;
+                const int v = (m.at<uchar>(y, x) & 1) ^ (maskBit(mask, x, y) ? 1 : 0);
+                words[bit >> 3] |= static_cast<uint8_t>(v << (7 - (bit & 7)));
+                ++bit;
+            }
+        }
+    }
+
+    // De-interleave; short blocks carry one data codeword less.
+    RsCheck r;
+    const int blocks = kEccBlocks[ecl][version], ecc = kEccPerBlock[ecl][version];
+    const int shortLen = total / blocks, shortBlocks = blocks - total % blocks;
+    const int shortData = shortLen - ecc;
+    std::vector<std::vector<uint8_t> > split(blocks, std::vector<uint8_t>(shortLen + 1, 0));
+    size_t k = 0;
+    for (int i = 0; i <= shortLen; ++i)
+        for (int b = 0; b < blocks; ++b)
+            if (i != shortData || b >= shortBlocks) split[b][i] = words[k++];
+    r.blocks = blocks;
+    for (int b = 0; b < blocks; ++b) {
+        std::vector<uint8_t>& blk = split[b];
+        if (b < shortBlocks) blk.erase(blk.begin() + shortData);
+        const int errors = rsBlockErrors(blk.data(), static_cast<int>(blk.size()), ecc);
+        if (errors < 0) ++r.uncorrectable;
+        else if (errors > 0) ++r.corrected;
+    }
+    return r;
+}
+
+// Rectify the code, pick the version whose timing patterns match best and
+// sample the module grid. Returns false if no version matches convincingly.
+static bool sampleModuleGrid(const cv::Mat& gray, const DetectedCode& code, int& version,
+                             cv::Mat& modules, double& contrast) {
+    double side = 0.0;
+    for (int k = 0; k < 4; ++k) side = std::max(side, cv::norm(code.quad[(k + 1) % 4] - code.quad[k]));
+    const int size = std::max(256, std::min(1024, cvRound(side * 2)));
+    const cv::Point2f dst[4] = { cv::Point2f(0, 0), cv::Point2f((float)size, 0),
+                                 cv::Point2f((float)size, (float)size), cv::Point2f(0, (float)size) };
+    cv::Mat H = cv::getPerspectiveTransform(code.quad, dst);
+    cv::Mat rect, bin;
+    cv::warpPerspective(gray, rect, H, cv::Size(size, size), cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+    double thresh = cv::threshold(rect, bin, 0, 255, cv::THRESH_BINARY | cv::THRESH_OTSU);
+
+    double bestScore = 0.0;
+    int best = 0;
+    for (int v = 1; v <= 40; ++v) {
+        const int n = 17 + 4 * v;
+        const double pitch = static_cast<double>(size) / n;
+        if (pitch < 2.0) break; // too fine to sample reliably
+        int match = 0, total = 0;
+        for (int i = 8; i <= n - 9; ++i) {
+            const int c = cvFloor((i + 0.5) * pitch), r6 = cvFloor(6.5 * pitch);
+            const bool wantDark = (i % 2) == 0;
+            match += (bin.at<uchar>(r6, c) == 0) == wantDark;
+            match += (bin.at<uchar>(c, r6) == 0) == wantDark;
+            total += 2;
+        }
+        double score = total ? static_cast<double>(match) / total : 0.0;
+        if (score > bestScore + 1e-9) { bestScore = score; best = v; }
+    }
+    if (best == 0 || bestScore < 0.8) return false;
+
+    version = best;
+    const int n = 17 + 4 * best;
+    const double pitch = static_cast<double>(size) / n;
+    modules.create(n, n, CV_8UC1);
+    double darkSum = 0, lightSum = 0;
+    int darkN = 0, lightN = 0;
+    for (int y = 0; y < n; ++y) {
+        for (int x = 0; x < n; ++x) {
+            const int v = rect.at<uchar>(cvFloor((y + 0.5) * pitch), cvFloor((x + 0.5) * pitch));
+            const bool dark = v < thresh;
+            modules.at<uchar>(y, x) = dark ? 1 : 0;
+            if (dark) { darkSum += v; ++darkN; } else { lightSum += v; ++lightN; }
+        }
+    }
+    contrast = (darkN && lightN) ? (lightSum / lightN - darkSum / darkN) / 255.0 : 0.0;
+    return true;
+}
+
+static CodeDiagnostics diagnoseCode(const cv::Mat& gray, const DetectedCode& code) {
+    CodeDiagnostics d;
+    d.skewDeg = quadSkewDeg(code);
+    double perimeter = 0.0;
+    for (int k = 0; k < 4; ++k) perimeter += cv::norm(code.quad[(k + 1) % 4] - code.quad[k]);
+
+    cv::Mat modules;
+    if (!sampleModuleGrid(gray, code, d.version, modules, d.contrast)) {
+        d.stage = code.payload.empty() ? StageSampling : StageDecoded;
+        return d;
+    }
+    d.modulePx = perimeter / 4.0 / (17 + 4 * d.version);
+    if (!code.payload.empty()) {
+        d.stage = StageDecoded;
+        return d;
+    }
+    const int format = readFormatInfo(modules);
+    if (format < 0) d.stage = StageFormat;
+    else if (!versionInfoValid(modules, d.version)) d.stage = StageVersion;
+    else {
+        d.rs = checkCodewords(modules, d.version, format);
+        d.stage = d.rs.uncorrectable ? StageRs : StagePayload;
+    }
+    return d;
+}
+
+// Detected/decoded counts per bin of one metric.
+struct YieldHistogram {
+    std::vector<double> edges; // bin i is [edges[i], edges[i+1]), last bin open-ended
+    std::vector<uint64_t> detected, decoded;
+
+    explicit YieldHistogram(const std::vector<double>& e)
+        : edges(e), detected(e.size(), 0), decoded(e.size(), 0) {}
+
+    void add(double v, bool ok) {
+        size_t i = 0;
+        while (i + 1 < edges.size() && v >= edges[i + 1]) ++i;
+        ++detected[i];
+        if (ok) ++decoded[i];
+    }
+
+    void writeJson(std::ostream& out, const char* name) const {
+        out << "  \"" << name << "\": [\n";
+        for (size_t i = 0; i < edges.size(); ++i) {
+            double undecoded = detected[i] ? 1.0 - static_cast<double>(decoded[i]) / detected[i] : 0.0;
+            out << cv::format("    {\"lo\": %g, \"hi\": %s, \"detected\": %llu, \"decoded\": %llu, "
+                              "\"undecoded_rate\": %.4f}%s\n", edges[i],
+                              i + 1 < edges.size() ? cv::format("%g", edges[i + 1]).c_str() : "null",
+                              (unsigned long long)detected[i], (unsigned long long)decoded[i], undecoded,
+                              i + 1 < edges.size() ? "," : "");
+        }
+        out << "  ]";
+    }
+};
+
+// Runs diagnostics on a worker thread; frames arrive through the AsyncSink
+// queue so analytics are sampled, never delaying detection.
+class QualityAnalytics : public AsyncSink {
+public:
+    explicit QualityAnalytics(size_t capacity)
+        : AsyncSink("analytics", capacity, DropPolicy::DropNewest),
+          modulePx_({0, 1, 2, 3, 4, 6, 8, 12, 16}),
+          contrast_({0, 0.1, 0.2, 0.3, 0.4, 0.5, 0.6, 0.8}),
+          skew_({0, 5, 10, 20, 30, 45}),
+          version_({1, 2, 3, 4, 5, 6, 7, 10, 15, 20, 25, 30, 40}) {
+        for (int i = 0; i < StageCount; ++i) stages_[i] = 0;
+    }
+    ~QualityAnalytics() override { stop(); }
+
+    bool exportJson(const std::string& path) const {
+        std::ofstream out(path.c_str());
+        if (!out) return false;
+        std::lock_guard<std::mutex> lock(mutex_);
+        out << "{\n  \"codes\": " << codes_ << ",\n  \"stages\": {";
+        for (int i = 0; i < StageCount; ++i)
+            out << (i ? ", " : "") << "\"" << kStageNames[i] << "\": " << stages_[i];
+        out << "},\n";
+        out << cv::format("  \"rs_blocks\": {\"checked\": %llu, \"clean\": %llu, \"corrected\": %llu, "
+                          "\"uncorrectable\": %llu},\n",
+                          (unsigned long long)rsBlocks_,
+                          (unsigned long long)(rsBlocks_ - rsCorrected_ - rsUncorrectable_),
+                          (unsigned long long)rsCorrected_, (unsigned long long)rsUncorrectable_);
+        modulePx_.writeJson(out, "module_px");
+        out << ",\n";
+        contrast_.writeJson(out, "contrast");
+        out << ",\n";
+        skew_.writeJson(out, "skew_deg");
+        out << ",\n";
+        version_.writeJson(out, "version");
+        out << "\n}\n";
+        return true;
+    }
+
+    void printSummary(std::ostream& out) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        out << "analytics: " << codes_ << " codes;";
+        for (int i = 0; i < StageCount; ++i) out << " " << kStageNames[i] << " " << stages_[i];
+        if (rsBlocks_)
+            out << cv::format("\n  rs blocks of undecoded codes: %llu checked, %llu corrected, %llu uncorrectable",
+                              (unsigned long long)rsBlocks_, (unsigned long long)rsCorrected_,
+                              (unsigned long long)rsUncorrectable_);
+        out << "\n  undecoded rate by module size (px):";
+        for (size_t i = 0; i < modulePx_.edges.size(); ++i) {
+            if (!modulePx_.detected[i]) continue;
+            out << cv::format(" [%g+) %.0f%%", modulePx_.edges[i],
+                              100.0 * (1.0 - static_cast<double>(modulePx_.decoded[i]) / modulePx_.detected[i]));
+        }
+        out << std::endl;
+    }
+
+protected:
+    bool consume(const SinkItem& item) override {
+        const cv::Rect bounds(0, 0, item.frame.cols, item.frame.rows);
+        for (size_t i = 0; i < item.codes.size(); ++i) {
+            const DetectedCode& code = item.codes[i];
+            if (!code.symbology.empty()) continue; // module-grid checks are QR-specific
+            // Only convert the code's neighbourhood to gray.
+            std::vector<cv::Point2f> q(code.quad, code.quad + 4);
+            cv::Rect roi = cv::boundingRect(q);
+            roi = cv::Rect(roi.x - 8, roi.y - 8, roi.width + 16, roi.height + 16) & bounds;
+            if (roi.empty()) continue;
+            if (item.frame.channels() == 3) cv::cvtColor(item.frame(roi), gray_, cv::COLOR_BGR2GRAY);
+            else item.frame(roi).copyTo(gray_);
+            DetectedCode local = code;
+            for (int k = 0; k < 4; ++k) local.quad[k] -= cv::Point2f((float)roi.x, (float)roi.y);
+
+            CodeDiagnostics d = diagnoseCode(gray_, local);
+            const bool ok = d.stage == StageDecoded;
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++codes_;
+            ++stages_[d.stage];
+            rsBlocks_ += d.rs.blocks;
+            rsCorrected_ += d.rs.corrected;
+            rsUncorrectable_ += d.rs.uncorrectable;
+            if (d.version > 0) {
+                modulePx_.add(d.modulePx, ok);
+                contrast_.add(d.contrast, ok);
+                version_.add(d.version, ok);
+            }
+            skew_.add(d.skewDeg, ok);
+        }
+        return true;
+    }
+
+private:
+    cv::Mat gray_; // worker thread only
+    mutable std::mutex mutex_;
+    uint64_t codes_ = 0;
+    uint64_t stages_[StageCount];
+    uint64_t rsBlocks_ = 0, rsCorrected_ = 0, rsUncorrectable_ = 0; // blocks of undecoded codes
+    YieldHistogram modulePx_, contrast_, skew_, version_;
+};
+// ---- End code quality analytics ----
+
+// ---- Shadow A/B detector ----
+// Runs a candidate configuration on a sampled fraction of live frames on a
+// low-priority thread and compares it with what the primary produced for
+// the same frame. Results only feed the comparison; outputs are driven by
+// the primary alone. At most one frame is in flight: a sample that arrives
+// while the shadow is busy is skipped and counted.
+class ShadowRunner {
+public:
+    struct Summary {
+        uint64_t sampled = 0;
+        uint64_t skippedBusy = 0;
+        uint64_t agree = 0;
+        uint64_t disagree = 0;
+        uint64_t primaryDecoded = 0;
+        uint64_t shadowDecoded = 0;
+        double primaryMsTotal = 0.0;
+        double shadowMsTotal = 0.0;
+    };
+
+    ShadowRunner(const DetectorConfig& cfg, double sampleRate, const std::string& logPath,
+                 const std::string& framesDir)
+        : detector_(cfg), sampleRate_(std::min(1.0, std::max(0.0, sampleRate))), framesDir_(framesDir) {
+        if (!logPath.empty()) log_.open(logPath.c_str(), std::ios::out | std::ios::app);
+        if (!framesDir_.empty()) ::mkdir(framesDir_.c_str(), 0755);
+    }
+    ~ShadowRunner() { stop(); }
+
+    void start() {
+        if (!worker_.joinable()) worker_ = std::thread(&ShadowRunner::run, this);
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cond_.notify_all();
+        if (worker_.joinable()) worker_.join();
+    }
+
+    // Deterministic sampling: every 1/sampleRate-th frame.
+    bool wants() {
+        credit_ += sampleRate_;
+        if (credit_ < 1.0) return false;
+        credit_ -= 1.0;
+        return true;
+    }
+
+    // Shares the frame buffer. Returns false if the shadow was still busy.
+    bool submit(const cv::Mat& frame, const std::vector<DetectedCode>& primary,
+                double primaryMs, long long frameIndex) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (busy_) { ++summary_.skippedBusy; return false; }
+            busy_ = true;
+            job_.frame = frame;
+            job_.primary = primary;
+            job_.primaryMs = primaryMs;
+            job_.frameIndex = frameIndex;
+        }
+        cond_.notify_one();
+        return true;
+    }
+
+    Summary summary() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return summary_;
+    }
+
+    const DetectorConfig& config() const { return detector_.config(); }
+
+private:
+    struct Job {
+        cv::Mat frame;
+        std::vector<DetectedCode> primary;
+        double primaryMs = 0.0;
+        long long frameIndex = 0;
+    };
+
+    static std::set<std::string> payloads(const std::vector<DetectedCode>& codes) {
+        std::set<std::string> out;
+        for (size_t i = 0; i < codes.size(); ++i)
+            if (!codes[i].payload.empty()) out.insert(codes[i].payload);
+        return out;
+    }
+
+    static std::string joinSet(const std::set<std::string>& s) {
+        std::string out;
+        for (std::set<std::string>::const_iterator it = s.begin(); it != s.end(); ++it) {
+            if (!out.empty()) out += '|';
+            out += *it;
+        }
+        return out;
+    }
+
+    void run() {
+        // Lowest scheduling priority for this thread only (Linux: per-tid nice).
+        ::setpriority(PRIO_PROCESS, static_cast<id_t>(::syscall(SYS_gettid)), 19);
+        for (;;) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cond_.wait(lock, [this] { return busy_ || stopping_; });
+                if (stopping_) break;
+                std::swap(job, job_);
+            }
+
+            double t0 = nowMs();
+            std::vector<DetectedCode> shadow = detector_.detect(job.frame);
+            double shadowMs = nowMs() - t0;
+
+            std::set<std::string> a = payloads(job.primary), b = payloads(shadow);
+            bool same = a == b && job.primary.size() == shadow.size();
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ++summary_.sampled;
+                if (same) ++summary_.agree; else ++summary_.disagree;
+                summary_.primaryDecoded += a.size();
+                summary_.shadowDecoded += b.size();
+                summary_.primaryMsTotal += job.primaryMs;
+                summary_.shadowMsTotal += shadowMs;
+                busy_ = false;
+            }
+
+            if (!same) {
+                if (log_.is_open()) {
+                    log_ << cv::format("frame=%lld primary_found=%zu primary_decoded=%zu primary_ms=%.2f "
+                                       "shadow_found=%zu shadow_decoded=%zu shadow_ms=%.2f",
+                                       job.frameIndex, job.primary.size(), a.size(), job.primaryMs,
+                                       shadow.size(), b.size(), shadowMs)
+                         << " primary=[" << joinSet(a) << "] shadow=[" << joinSet(b) << "]\n";
+                    log_.flush();
+                }
+                if (!framesDir_.empty())
+                    cv::imwrite(cv::format("%s/disagree_%08lld.png", framesDir_.c_str(), job.frameIndex), job.frame);
+            }
+        }
+    }
+
+    QrDetector detector_;
+    const double sampleRate_;
+    const std::string framesDir_;
+    std::ofstream log_;
+    double credit_ = 0.0;
+
+    std::thread worker_;
+    mutable std::mutex mutex_;
+    std::condition_variable cond_;
+    Job job_;
+    bool busy_ = false;
+    bool stopping_ = false;
+    Summary summary_;
+};
+// ---- End shadow A/B detector ----
+
+// ---- Hot reconfiguration ----
+// Settings that can change while the camera stays open. A reload starts
+// from the command-line values and applies the keys present in the file,
+// so deleting a key reverts it. Config file (OpenCV FileStorage, YAML):
+//   detector: "backend=aruco,stripes=4"   # parsed like --detector
+//   rois: [ [0, 0, 640, 240], [0, 240, 640, 240] ]   # empty = whole frame
+//   record: "out.avi"        # "" stops recording
+//   record_fps: 30
+//   snapshot_dir: "shots"    # "" stops snapshots
+//   preview_fps: 15
+//   http_fps: 5
+struct LiveConfig {
+    int version = 0;
+    DetectorConfig detector;
+    std::vector<cv::Rect> rois;
+    std::string recordPath;
+    double recordFps = 30.0;
+    std::string snapshotDir;
+    double previewFps = 15.0;
+    double httpFps = 5.0;
+};
+
+static bool loadLiveConfig(const std::string& path, const LiveConfig& base, LiveConfig& out, std::string& err) {
+    out = base;
+    cv::FileStorage fs;
+    try {
+        if (!fs.open(path, cv::FileStorage::READ)) { err = "无法打开 " + path; return false; }
+    } catch (const cv::Exception& e) {
+        err = path + ": " + e.what();
+        return false;
+    }
+    cv::FileNode n = fs["detector"];
+    if (!n.empty() && !parseDetectorConfig(static_cast<std::string>(n), out.detector, err)) return false;
+    n = fs["rois"];
+    if (!n.empty()) {
+        out.rois.clear();
+        for (size_t i = 0; i < n.size(); ++i) {
+            const cv::FileNode r = n[static_cast<int>(i)];
+            if (!r.isSeq() || r.size() != 4) { err = "rois 每项应为 [x, y, w, h]"; return false; }
+            cv::Rect rect((int)r[0], (int)r[1], (int)r[2], (int)r[3]);
+            if (rect.width <= 0 || rect.height <= 0) { err = "rois 宽高必须为正"; return false; }
+            out.rois.push_back(rect);
+        }
+    }
+    if (!fs["record"].empty()) out.recordPath = static_cast<std::string>(fs["record"]);
+    if (!fs["record_fps"].empty()) out.recordFps = static_cast<double>(fs["record_fps"]);
+    if (!fs["snapshot_dir"].empty()) out.snapshotDir = static_cast<std::string>(fs["snapshot_dir"]);
+    if (!fs["preview_fps"].empty()) out.previewFps = static_cast<double>(fs["preview_fps"]);
+    if (!fs["http_fps"].empty()) out.httpFps = static_cast<double>(fs["http_fps"]);
+    return true;
+}
+
+// Parses the config file off the capture thread and hands the result to
+// the loop, which applies it between two frames. Reloads are requested by
+// SIGHUP (forwarded by the loop) or over an optional Unix control socket:
+//   reload  -> "ok version=N latency_ms=X" once applied, or "error ..."
+//   status  -> "version=N latency_ms=X file=PATH"
+class ConfigReloader {
+public:
+    ConfigReloader(const std::string& path, const LiveConfig& base, const std::string& controlPath)
+        : path_(path), base_(base), controlPath_(controlPath) {}
+    ~ConfigReloader() { stop(); }
+
+    // Synchronous first load so a bad file fails at startup. Queued as
+    // version 1 for the loop to apply.
+    bool loadInitial(std::string& err) {
+        std::shared_ptr<LiveConfig> cfg(new LiveConfig());
+        if (!loadLiveConfig(path_, base_, *cfg, err)) return false;
+        cfg->version = published_ = 1;
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_ = cfg;
+        requestedAt_ = nowMs();
+        hasPending_.store(true, std::memory_order_release);
+        return true;
+    }
+
+    bool start() {
+        if (!controlPath_.empty()) {
+            listenFd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            if (listenFd_ < 0) return false;
+            sockaddr_un addr;
+            std::memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            std::strncpy(addr.sun_path, controlPath_.c_str(), sizeof(addr.sun_path) - 1);
+            ::unlink(controlPath_.c_str());
+            if (::bind(listenFd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || ::listen(listenFd_, 4) < 0) {
+                ::close(listenFd_);
+                listenFd_ = -1;
+                return false;
+            }
+        }
+        stopping_ = false;
+        worker_ = std::thread(&ConfigReloader::run, this);
+        return true;
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cond_.notify_all();
+        if (worker_.joinable()) worker_.join();
+        if (listenFd_ >= 0) {
+            ::close(listenFd_);
+            ::unlink(controlPath_.c_str());
+            listenFd_ = -1;
+        }
+    }
+
+    // Any thread; the file is parsed on the reloader thread.
+    void request() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            requested_ = true;
+        }
+        cond_.notify_all();
+    }
+
+    // Capture loop, once per frame: an atomic load unless a config is waiting.
+    std::shared_ptr<const LiveConfig> take(double& requestedAt) {
+        if (!hasPending_.load(std::memory_order_acquire)) return std::shared_ptr<const LiveConfig>();
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::shared_ptr<const LiveConfig> cfg = pending_;
+        pending_.reset();
+        requestedAt = requestedAt_;
+        hasPending_.store(false, std::memory_order_release);
+        return cfg;
+    }
+
+    // Capture loop, after applying `version`.
+    void markApplied(int version, double latencyMs) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            applied_ = version;
+            latencyMs_ = latencyMs;
+        }
+        cond_.notify_all();
+    }
+
+private:
+    // Parse and queue; returns the queued version or -1.
+    int reload(std::string& err) {
+        const double t0 = nowMs();
+        std::shared_ptr<LiveConfig> cfg(new LiveConfig());
+        if (!loadLiveConfig(path_, base_, *cfg, err)) return -1;
+        cfg->version = ++published_;
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_ = cfg;
+        requestedAt_ = t0;
+        hasPending_.store(true, std::memory_order_release);
+        return cfg->version;
+    }
+
+    void run() {
+        for (;;) {
+            bool requested = false;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                if (listenFd_ < 0) cond_.wait(lock, [this] { return requested_ || stopping_; });
+                if (stopping_) break;
+                std::swap(requested, requested_);
+            }
+            if (requested) {
+                std::string err;
+                if (reload(err) < 0) std::cerr << "配置重新加载失败: " << err << std::endl;
+            }
+            if (listenFd_ < 0) continue;
+            pollfd pfd = { listenFd_, POLLIN, 0 };
+            if (::poll(&pfd, 1, 100) > 0 && (pfd.revents & POLLIN)) {
+                int fd = ::accept(listenFd_, nullptr, nullptr);
+                if (fd >= 0) {
+                    serveClient(fd);
+                    ::close(fd);
+                }
+            }
+        }
+    }
+
+    void serveClient(int fd) {
+        char buf[256];
+        pollfd pfd = { fd, POLLIN, 0 };
+        if (::poll(&pfd, 1, 1000) <= 0) return;
+        ssize_t n = ::recv(fd, buf, sizeof(buf) - 1, 0);
+        if (n <= 0) return;
+        buf[n] = '\0';
+        std::string cmd(buf);
+        cmd.erase(cmd.find_last_not_of(" \r\n") + 1);
+
+        std::string reply;
+        if (cmd == "reload") {
+            std::string err;
+            int version = reload(err);
+            if (version < 0) {
+                reply = "error " + err;
+            } else {
+                std::unique_lock<std::mutex> lock(mutex_);
+                bool done = cond_.wait_for(lock, std::chrono::seconds(5),
+                                           [&] { return applied_ >= version || stopping_; });
+                reply = done ? cv::format("ok version=%d latency_ms=%.1f", applied_, latencyMs_)
+                             : cv::format("error version=%d not applied within 5 s", version);
+            }
+        } else if (cmd == "status") {
+            std::lock_guard<std::mutex> lock(mutex_);
+            reply = cv::format("version=%d latency_ms=%.1f file=%s", applied_, latencyMs_, path_.c_str());
+        } else {
+            reply = "error unknown command (reload|status)";
+        }
+        reply += "\n";
+        ::send(fd, reply.data(), reply.size(), MSG_NOSIGNAL);
+    }
+
+    const std::string path_;
+    const LiveConfig base_;
+    const std::string controlPath_;
+    int listenFd_ = -1;
+    int published_ = 0; // reloader thread only (after loadInitial)
+
+    std::thread worker_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    bool requested_ = false;
+    bool stopping_ = false;
+    std::shared_ptr<LiveConfig> pending_;
+    double requestedAt_ = 0.0;
+    std::atomic<bool> hasPending_{false};
+    int applied_ = 0;
+    double latencyMs_ = 0.0;
+};
+// ---- End hot reconfiguration ----
+
+// ---- Fleet supervisor ----
+// --fleet runs one detector process per camera so a crashing driver takes
+// down only its own process. Children are pinned to a CPU each, report
+// through a shared-memory segment (one slot per camera, single writer
+// each) and are restarted when they exit or stop heartbeating. The
+// supervisor merges their code events into one stdout stream and serves
+// all metrics on one HTTP endpoint.
+#if ATOMIC_LLONG_LOCK_FREE != 2
+#error "fleet mode needs lock-free 64-bit atomics (shared across processes)"
+#endif
+
+const int kFleetMaxSlots = 8;
+const int kFleetEventRing = 64;
+
+// What a child is doing. The watchdog only enforces the heartbeat timeout
+// while RUNNING or RECONNECTING (the reconnect wait beats on every poll);
+// startup and autotune may legitimately take longer than any frame.
+enum FleetPhase { FLEET_STARTING = 0, FLEET_TUNING, FLEET_RUNNING, FLEET_RECONNECTING };
+
+struct FleetEvent {
+    std::atomic<uint64_t> seq;  // n + 1 once event n is complete, 0 while written
+    double wallMs;
+    int trackId;
+    char payload[240];
+};
+
+struct FleetSlot {
+    std::atomic<int> pid;
+    std::atomic<int> phase;             // FleetPhase
+    std::atomic<uint64_t> heartbeatMs;  // wall clock of the last frame or beat()
+    std::atomic<uint64_t> frames;
+    std::atomic<uint64_t> codes;
+    std::atomic<uint64_t> frameUs;      // moving average per frame
+    std::atomic<uint64_t> fpsMilli;
+    std::atomic<uint64_t> outages;
+    std::atomic<uint64_t> events;       // events published so far
+    FleetEvent ring[kFleetEventRing];
+};
+
+struct FleetShared {
+    FleetSlot slots[kFleetMaxSlots];
+};
+
+// Child side: publishes one camera's metrics and appearance events.
+class FleetReporter {
+public:
+    ~FleetReporter() {
+        if (slot_) slot_->pid.store(0);
+        if (shared_) ::munmap(shared_, sizeof(FleetShared));
+    }
+
+    // spec is "NAME:SLOT" as passed by the supervisor.
+    bool open(const std::string& spec) {
+        size_t colon = spec.rfind(':');
+        if (colon == std::string::npos) return false;
+        const int slot = std::atoi(spec.c_str() + colon + 1);
+        if (slot < 0 || slot >= kFleetMaxSlots) return false;
+        int fd = ::shm_open(spec.substr(0, colon).c_str(), O_RDWR, 0);
+        if (fd < 0) return false;
+        void* p = ::mmap(nullptr, sizeof(FleetShared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) return false;
+        shared_ = static_cast<FleetShared*>(p);
+        slot_ = &shared_->slots[slot];
+        slot_->pid.store(static_cast<int>(::getpid()));
+        return true;
+    }
+
+    // Heartbeat outside the frame loop (startup, autotune, reconnect waits).
+    void beat(FleetPhase phase) {
+        slot_->phase.store(phase, std::memory_order_relaxed);
+        slot_->heartbeatMs.store(static_cast<uint64_t>(wallClockMs()), std::memory_order_relaxed);
+    }
+
+    void frame(double frameMs, double fps, size_t codes, uint64_t outages,
+               const std::vector<TrackEvent>& events) {
+        slot_->phase.store(FLEET_RUNNING, std::memory_order_relaxed);
+        slot_->heartbeatMs.store(static_cast<uint64_t>(wallClockMs()), std::memory_order_relaxed);
+        slot_->frames.fetch_add(1, std::memory_order_relaxed);
+        slot_->codes.fetch_add(codes, std::memory_order_relaxed);
+        slot_->frameUs.store(static_cast<uint64_t>(frameMs * 1000.0), std::memory_order_relaxed);
+        slot_->fpsMilli.store(static_cast<uint64_t>(fps * 1000.0), std::memory_order_relaxed);
+        slot_->outages.store(outages, std::memory_order_relaxed);
+        for (size_t i = 0; i < events.size(); ++i)
+            if (events[i].type == TrackEvent::Appeared) publish(events[i]);
+    }
+
+private:
+    void publish(const TrackEvent& ev) {
+        const uint64_t n = slot_->events.load(std::memory_order_relaxed);
+        FleetEvent& e = slot_->ring[n % kFleetEventRing];
+        e.seq.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        e.wallMs = wallClockMs();
+        e.trackId = ev.trackId;
+        std::strncpy(e.payload, ev.payload.c_str(), sizeof(e.payload) - 1);
+        e.payload[sizeof(e.payload) - 1] = '\0';
+        e.seq.store(n + 1, std::memory_order_release);
+        slot_->events.store(n + 1, std::memory_order_release);
+    }
+
+    FleetShared* shared_ = nullptr;
+    FleetSlot* slot_ = nullptr;
+};
+
+// Output paths get a per-camera suffix so children do not overwrite each other.
+static std::string perCameraPath(const std::string& path, int camera) {
+    const size_t slash = path.rfind('/');
+    const size_t dot = path.rfind('.');
+    const std::string tag = cv::format(".cam%d", camera);
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) return path + tag;
+    return path.substr(0, dot) + tag + path.substr(dot);
+}
+
+class FleetSupervisor {
+public:
+    FleetSupervisor(const std::vector<int>& cameras, const std::vector<std::string>& childArgs, int metricsPort,
+                    int timeoutMs)
+        : cameras_(cameras), childArgs_(childArgs), metricsPort_(metricsPort),
+          timeoutMs_(static_cast<uint64_t>(std::max(100, timeoutMs))),
+          name_(cv::format("/qr-fleet.%d", static_cast<int>(::getpid()))), children_(cameras.size()) {}
+
+    ~FleetSupervisor() {
+        if (listenFd_ >= 0) ::close(listenFd_);
+        if (shared_) {
+            ::munmap(shared_, sizeof(FleetShared));
+            ::shm_unlink(name_.c_str());
+        }
+    }
+
+    int run() {
+        int fd = ::shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0 || ::ftruncate(fd, sizeof(FleetShared)) < 0) {
+            std::cerr << "无法创建共享内存 " << name_ << " (" << std::strerror(errno) << ")" << std::endl;
+            if (fd >= 0) ::close(fd);
+            return 4;
+        }
+        void* p = ::mmap(nullptr, sizeof(FleetShared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) return 4;
+        shared_ = static_cast<FleetShared*>(p); // ftruncate zero-fills: all counters start at 0
+        if (metricsPort_ > 0 && !listenMetrics()) {
+            std::cerr << "无法监听 127.0.0.1:" << metricsPort_ << " (" << std::strerror(errno) << ")" << std::endl;
+            return 4;
+        }
+        if (metricsPort_ > 0)
+            std::cout << "fleet metrics: http://127.0.0.1:" << metricsPort_ << "/metrics" << std::endl;
+
+        for (size_t i = 0; i < cameras_.size(); ++i) spawn(i);
+        while (!g_signal_exit) {
+            pollfd pfd = { listenFd_, POLLIN, 0 };
+            if (::poll(&pfd, listenFd_ >= 0 ? 1 : 0, 20) > 0 && (pfd.revents & POLLIN)) serveMetrics();
+            reap();
+            watchdog();
+            drainEvents();
+        }
+
+        for (size_t i = 0; i < children_.size(); ++i)
+            if (children_[i].pid > 0) ::kill(children_[i].pid, SIGTERM);
+        for (size_t i = 0; i < children_.size(); ++i)
+            if (children_[i].pid > 0) ::waitpid(children_[i].pid, nullptr, 0);
+        drainEvents();
+        for (size_t i = 0; i < children_.size(); ++i)
+            std::cout << cv::format("fleet camera %d: %llu restarts", cameras_[i],
+                                    (unsigned long long)children_[i].restarts) << std::endl;
+        return 0;
+    }
+
+private:
+    struct Child {
+        pid_t pid = -1;
+        double startedMs = 0.0;
+        double restartAtMs = 0.0;  // pending restart time, 0 = none
+        double backoffMs = 50.0;
+        uint64_t restarts = 0;
+        uint64_t eventsRead = 0;
+        uint64_t eventsLost = 0;
+    };
+
+    void spawn(size_t i) {
+        Child& c = children_[i];
+        std::vector<std::string> args;
+        args.push_back("detector");
+        args.insert(args.end(), childArgs_.begin(), childArgs_.end());
+        for (size_t k = 0; k + 1 < args.size(); ++k) {
+            const std::string& a = args[k];
+            if (a == "--record" || a == "--snapshot-dir" || a == "--analytics" || a == "--shadow-log" ||
+                a == "--shadow-frames" || a == "--tune-file" || a == "--journal") {
+                if (!args[k + 1].empty()) args[k + 1] = perCameraPath(args[k + 1], cameras_[i]);
+            }
+        }
+        args.push_back("--headless");
+        args.push_back("--fleet-child");
+        args.push_back(cv::format("%s:%zu", name_.c_str(), i));
+        args.push_back(cv::format("%d", cameras_[i]));
+
+        // The slot starts fresh for the new process; event sequence numbers
+        // carry on so the reader's position stays valid.
+        FleetSlot& slot = shared_->slots[i];
+        slot.phase.store(FLEET_STARTING);
+        slot.heartbeatMs.store(static_cast<uint64_t>(wallClockMs()));
+
+        pid_t pid = ::fork();
+        if (pid == 0) {
+            ::prctl(PR_SET_PDEATHSIG, SIGTERM);
+            const long cpus = ::sysconf(_SC_NPROCESSORS_ONLN);
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(static_cast<int>(i % static_cast<size_t>(std::max(1L, cpus))), &set);
+            ::sched_setaffinity(0, sizeof(set), &set);
+            // Keys belong to the supervisor: a child sharing the terminal
+            // would steal them and switch the shared tty to raw mode.
+            const int devNull = ::open("/dev/null", O_RDONLY);
+            if (devNull >= 0) {
+                ::dup2(devNull, STDIN_FILENO);
+                if (devNull != STDIN_FILENO) ::close(devNull);
+            }
+            std::vector<char*> argv;
+            for (size_t k = 0; k < args.size(); ++k) argv.push_back(const_cast<char*>(args[k].c_str()));
+            argv.push_back(nullptr);
+            ::execv("/proc/self/exe", argv.data());
+            ::_exit(127);
+        }
+        if (pid < 0) {
+            // Out of processes or memory: try again later like a crash.
+            c.pid = -1;
+            c.backoffMs = std::min(5000.0, c.backoffMs * 2.0);
+            c.restartAtMs = nowMs() + c.backoffMs;
+            std::cerr << cv::format("fleet camera %d: fork failed (%s), retrying in %.0f ms", cameras_[i],
+                                    std::strerror(errno), c.backoffMs) << std::endl;
+            return;
+        }
+        c.pid = pid;
+        c.startedMs = nowMs();
+        c.restartAtMs = 0.0;
+        std::cout << cv::format("fleet camera %d: started pid %d on cpu %zu", cameras_[i], static_cast<int>(pid),
+                                i % static_cast<size_t>(std::max(1L, ::sysconf(_SC_NPROCESSORS_ONLN))))
+                  << std::endl;
+    }
+
+    // Restart exited children; quickly unless they are crash-looping.
+    void reap() {
+        int status = 0;
+        pid_t pid;
+        while ((pid = ::waitpid(-1, &status, WNOHANG)) > 0) {
+            for (size_t i = 0; i < children_.size(); ++i) {
+                Child& c = children_[i];
+                if (c.pid != pid) continue;
+                c.pid = -1;
+                const double lived = nowMs() - c.startedMs;
+                c.backoffMs = lived > 2000.0 ? 50.0 : std::min(5000.0, c.backoffMs * 2.0);
+                c.restartAtMs = nowMs() + c.backoffMs;
+                shared_->slots[i].pid.store(0);
+                std::cerr << cv::format("fleet camera %d: pid %d %s %d, restarting in %.0f ms", cameras_[i],
+                                        static_cast<int>(pid), WIFSIGNALED(status) ? "killed by signal" : "exited",
+                                        WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status), c.backoffMs)
+                          << std::endl;
+            }
+        }
+        for (size_t i = 0; i < children_.size(); ++i) {
+            Child& c = children_[i];
+            if (c.pid < 0 && c.restartAtMs > 0.0 && nowMs() >= c.restartAtMs) {
+                ++c.restarts;
+                spawn(i);
+            }
+        }
+    }
+
+    // A child stuck in a driver call never exits on its own.
+    void watchdog() {
+        const uint64_t now = static_cast<uint64_t>(wallClockMs());
+        for (size_t i = 0; i < children_.size(); ++i) {
+            const Child& c = children_[i];
+            if (c.pid <= 0) continue;
+            const int phase = shared_->slots[i].phase.load(std::memory_order_relaxed);
+            if (phase == FLEET_STARTING || phase == FLEET_TUNING) continue;
+            const uint64_t beat = shared_->slots[i].heartbeatMs.load(std::memory_order_relaxed);
+            if (now > beat + timeoutMs_) {
+                std::cerr << cv::format("fleet camera %d: no heartbeat for %.1f s, killing pid %d", cameras_[i],
+                                        (now - beat) / 1000.0, static_cast<int>(c.pid)) << std::endl;
+                ::kill(c.pid, SIGKILL);
+                shared_->slots[i].heartbeatMs.store(now);
+            }
+        }
+    }
+
+    // Merge new events from every slot into one stream, oldest first.
+    void drainEvents() {
+        struct Line { double wallMs; int camera; int trackId; std::string payload; };
+        std::vector<Line> lines;
+        for (size_t i = 0; i < children_.size(); ++i) {
+            Child& c = children_[i];
+            FleetSlot& slot = shared_->slots[i];
+            const uint64_t end = slot.events.load(std::memory_order_acquire);
+            if (end - c.eventsRead > static_cast<uint64_t>(kFleetEventRing)) {
+                c.eventsLost += end - c.eventsRead - kFleetEventRing;
+                c.eventsRead = end - kFleetEventRing;
+            }
+            for (; c.eventsRead < end; ++c.eventsRead) {
+                FleetEvent& e = slot.ring[c.eventsRead % kFleetEventRing];
+                if (e.seq.load(std::memory_order_acquire) != c.eventsRead + 1) { ++c.eventsLost; continue; }
+                Line l = { e.wallMs, cameras_[i], e.trackId, std::string(e.payload) };
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (e.seq.load(std::memory_order_relaxed) != c.eventsRead + 1) { ++c.eventsLost; continue; }
+                lines.push_back(l);
+            }
+        }
+        std::sort(lines.begin(), lines.end(), [](const Line& a, const Line& b) { return a.wallMs < b.wallMs; });
+        for (size_t i = 0; i < lines.size(); ++i)
+            std::cout << cv::format("%.3f cam%d #%d ", lines[i].wallMs / 1000.0, lines[i].camera, lines[i].trackId)
+                      << lines[i].payload << std::endl;
+    }
+
+    bool listenMetrics() {
+        listenFd_ = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listenFd_ < 0) return false;
+        int one = 1;
+        ::setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(static_cast<uint16_t>(metricsPort_));
+        return ::bind(listenFd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0 && ::listen(listenFd_, 8) == 0;
+    }
+
+    // Prometheus text format, one label per camera.
+    void serveMetrics() {
+        int fd = ::accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) return;
+        char buf[1024];
+        pollfd pfd = { fd, POLLIN, 0 };
+        if (::poll(&pfd, 1, 200) > 0) (void)::recv(fd, buf, sizeof(buf), 0);
+        std::string body;
+        for (size_t i = 0; i < children_.size(); ++i) {
+            const FleetSlot& s = shared_->slots[i];
+            const Child& c = children_[i];
+            const int cam = cameras_[i];
+            body += cv::format("qr_fleet_up{camera=\"%d\"} %d\n", cam, s.pid.load() > 0 ? 1 : 0);
+            body += cv::format("qr_fleet_frames_total{camera=\"%d\"} %llu\n", cam, (unsigned long long)s.frames.load());
+            body += cv::format("qr_fleet_codes_total{camera=\"%d\"} %llu\n", cam, (unsigned long long)s.codes.load());
+            body += cv::format("qr_fleet_frame_ms{camera=\"%d\"} %.3f\n", cam, s.frameUs.load() / 1000.0);
+            body += cv::format("qr_fleet_fps{camera=\"%d\"} %.2f\n", cam, s.fpsMilli.load() / 1000.0);
+            body += cv::format("qr_fleet_camera_outages_total{camera=\"%d\"} %llu\n", cam,
+                               (unsigned long long)s.outages.load());
+            body += cv::format("qr_fleet_restarts_total{camera=\"%d\"} %llu\n", cam, (unsigned long long)c.restarts);
+            body += cv::format("qr_fleet_events_lost_total{camera=\"%d\"} %llu\n", cam,
+                               (unsigned long long)c.eventsLost);
+        }
+        std::string resp = cv::format("HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                      "Content-Length: %zu\r\nConnection: close\r\n\r\n", body.size()) + body;
+        (void)::send(fd, resp.data(), resp.size(), MSG_NOSIGNAL);
+        ::close(fd);
+    }
+
+    const std::vector<int> cameras_;
+    const std::vector<std::string> childArgs_;
+    const int metricsPort_;
+    const uint64_t timeoutMs_; // heartbeat timeout while running
+    const std::string name_;
+    std::vector<Child> children_;
+    FleetShared* shared_ = nullptr;
+    int listenFd_ = -1;
+};
+// ---- End fleet supervisor ----
+
+// ---- Scan-event journal ----
+// Append-only history of every decoded code. The capture loop only queues
+// events; a writer thread group-commits whatever has accumulated (one
+// write() and one fdatasync() per batch) and then updates a memory-mapped
+// index next to each segment:
+//   seg-NNNNNNNN.log  records: {magic, length, crc32} + body
+//                     body: wall us, camera, track id, quad (8 floats),
+//                     payload length (u16), payload
+//   seg-NNNNNNNN.idx  header, time-ordered entries {wall us, offset, hash},
+//                     then an open-addressing table payload hash -> entry
+// Segments rotate by size. The index is derived data: on open, the newest
+// segment is scanned, a torn tail is cut at the first bad CRC and the
+// index is rebuilt if it lags the log.
+const uint32_t kJournalMagic = 0x4A415251; // "QRAJ"
+
+struct Crc32Table {
+    uint32_t entries[256];
+    Crc32Table() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            entries[i] = c;
+        }
+    }
+};
+// Built during static initialization, before any journal or scan thread.
+static const Crc32Table kCrc32Table;
+
+static uint32_t crc32(const void* data, size_t len, uint32_t crc = 0) {
+    crc = ~crc;
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < len; ++i) crc = kCrc32Table.entries[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint64_t fnv1a64(const std::string& s) {
+    uint64_t h = 1469598103934665603ull;
+    for (size_t i = 0; i < s.size(); ++i) {
+        h ^= static_cast<uint8_t>(s[i]);
+        h *= 1099511628211ull;
+    }
+    return h ? h : 1; // 0 marks an empty hash slot
+}
+
+struct JournalRecord {
+    int64_t wallUs = 0;
+    int32_t camera = 0;
+    int32_t trackId = -1;
+    float quad[8] = {};
+    std::string payload;
+};
+
+struct JournalIndexHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;   // time entries
+    uint64_t slots;      // hash slots, power of two
+    uint64_t count;      // entries published; written after the entries
+    int64_t firstUs, lastUs;
+    uint64_t reserved;
+};
+
+struct JournalTimeEntry {
+    int64_t wallUs;
+    uint64_t offset;     // record start in the .log
+    uint64_t hash;
+};
+
+struct JournalHashSlot {
+    uint64_t hash;
+    uint64_t entry;      // entry index + 1, 0 = empty
+};
+
+// One mapped .idx file, used by the writer (read-write) and by queries.
+class JournalIndex {
+public:
+    ~JournalIndex() { close(); }
+
+    static size_t fileSize(uint64_t capacity, uint64_t slots) {
+        return sizeof(JournalIndexHeader) + capacity * sizeof(JournalTimeEntry) + slots * sizeof(JournalHashSlot);
+    }
+
+    bool create(const std::string& path, uint64_t capacity) {
+        uint64_t slots = 1;
+        while (slots < 2 * capacity) slots <<= 1;
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) return false;
+        // Sparse: untouched pages of the table cost no disk.
+        if (::ftruncate(fd, static_cast<off_t>(fileSize(capacity, slots))) < 0) { ::close(fd); return false; }
+        if (!map(fd, true)) return false;
+        header_->magic = kJournalMagic;
+        header_->version = 1;
+        header_->capacity = capacity;
+        header_->slots = slots;
+        return true;
+    }
+
+    bool open(const std::string& path, bool writable) {
+        int fd = ::open(path.c_str(), (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+        if (fd < 0) return false;
+        if (!map(fd, writable)) return false;
+        if (header_->magic != kJournalMagic || size_ != fileSize(header_->capacity, header_->slots)) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+        if (base_) ::munmap(base_, size_);
+        base_ = nullptr;
+        header_ = nullptr;
+    }
+
+    bool full() const { return header_->count >= header_->capacity; }
+    uint64_t count() const { return header_->count; }
+    const JournalIndexHeader& header() const { return *header_; }
+    const JournalTimeEntry& entry(uint64_t i) const { return entries()[i]; }
+
+    void reset() {
+        std::memset(slotTable(), 0, header_->slots * sizeof(JournalHashSlot));
+        header_->count = 0;
+        header_->firstUs = header_->lastUs = 0;
+    }
+
+    void add(int64_t wallUs, uint64_t offset, uint64_t hash) {
+        const uint64_t n = header_->count;
+        JournalTimeEntry& e = entries()[n];
+        e.wallUs = wallUs;
+        e.offset = offset;
+        e.hash = hash;
+        JournalHashSlot* t = slotTable();
+        for (uint64_t i = hash & (header_->slots - 1);; i = (i + 1) & (header_->slots - 1)) {
+            if (t[i].entry) continue;
+            t[i].hash = hash;
+            t[i].entry = n + 1;
+            break;
+        }
+        if (n == 0) header_->firstUs = wallUs;
+        header_->lastUs = wallUs;
+        std::atomic_thread_fence(std::memory_order_release);
+        header_->count = n + 1;
+    }
+
+    // Entries whose payload hash equals `hash` (collisions included).
+    void lookup(uint64_t hash, std::vector<uint64_t>& out) const {
+        const JournalHashSlot* t = slotTable();
+        for (uint64_t i = hash & (header_->slots - 1); t[i].entry; i = (i + 1) & (header_->slots - 1))
+            if (t[i].hash == hash && t[i].entry <= header_->count) out.push_back(t[i].entry - 1);
+    }
+
+    // First entry with wallUs >= us (entries are appended in time order).
+    uint64_t lowerBound(int64_t us) const {
+        const JournalTimeEntry* e = entries();
+        return std::lower_bound(e, e + header_->count, us,
+                                [](const JournalTimeEntry& a, int64_t v) { return a.wallUs < v; }) - e;
+    }
+
+private:
+    bool map(int fd, bool writable) {
+        struct stat st;
+        if (::fstat(fd, &st) < 0 || st.st_size < static_cast<off_t>(sizeof(JournalIndexHeader))) {
+            ::close(fd);
+            return false;
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        void* p = ::mmap(nullptr, size_, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) return false;
+        base_ = static_cast<char*>(p);
+        header_ = reinterpret_cast<JournalIndexHeader*>(base_);
+        return true;
+    }
+
+    JournalTimeEntry* entries() const {
+        return reinterpret_cast<JournalTimeEntry*>(base_ + sizeof(JournalIndexHeader));
+    }
+    JournalHashSlot* slotTable() const {
+        return reinterpret_cast<JournalHashSlot*>(base_ + sizeof(JournalIndexHeader) +
+                                                  header_->capacity * sizeof(JournalTimeEntry));
+    }
+
+    char* base_ = nullptr;
+    size_t size_ = 0;
+    JournalIndexHeader* header_ = nullptr;
+};
+
+static std::string journalSegmentPath(const std::string& dir, uint32_t seg, const char* ext) {
+    return cv::format("%s/seg-%08u.%s", dir.c_str(), seg, ext);
+}
+
+static std::vector<uint32_t> listJournalSegments(const std::string& dir) {
+    std::vector<cv::String> files;
+    cv::glob(dir + "/seg-*.log", files, false);
+    std::vector<uint32_t> segs;
+    for (size_t i = 0; i < files.size(); ++i) {
+        unsigned n = 0;
+        const size_t slash = files[i].rfind('/');
+        if (std::sscanf(files[i].c_str() + (slash == cv::String::npos ? 0 : slash + 1), "seg-%8u.log", &n) == 1)
+            segs.push_back(n);
+    }
+    std::sort(segs.begin(), segs.end());
+    return segs;
+}
+
+static void encodeJournalRecord(const JournalRecord& r, std::string& out) {
+    const uint16_t len = static_cast<uint16_t>(std::min<size_t>(r.payload.size(), 65535));
+    std::string body(sizeof(r.wallUs) + sizeof(r.camera) + sizeof(r.trackId) + sizeof(r.quad) + sizeof(len) + len, '\0');
+    char* p = &body[0];
+    std::memcpy(p, &r.wallUs, sizeof(r.wallUs)); p += sizeof(r.wallUs);
+    std::memcpy(p, &r.camera, sizeof(r.camera)); p += sizeof(r.camera);
+    std::memcpy(p, &r.trackId, sizeof(r.trackId)); p += sizeof(r.trackId);
+    std::memcpy(p, r.quad, sizeof(r.quad)); p += sizeof(r.quad);
+    std::memcpy(p, &len, sizeof(len)); p += sizeof(len);
+    std::memcpy(p, r.payload.data(), len);
+    const uint32_t head[3] = { kJournalMagic, static_cast<uint32_t>(body.size()), crc32(body.data(), body.size()) };
+    out.append(reinterpret_cast<const char*>(head), sizeof(head));
+    out += body;
+}
+
+// Reads the record at `offset`; returns its total size or 0 if torn/corrupt.
+static size_t decodeJournalRecord(int fd, uint64_t offset, JournalRecord& r) {
+    uint32_t head[3];
+    if (::pread(fd, head, sizeof(head), static_cast<off_t>(offset)) != static_cast<ssize_t>(sizeof(head)) ||
+        head[0] != kJournalMagic || head[1] > (1u << 20))
+        return 0;
+    std::string body(head[1], '\0');
+    if (::pread(fd, &body[0], body.size(), static_cast<off_t>(offset + sizeof(head))) != static_cast<ssize_t>(body.size()) ||
+        crc32(body.data(), body.size()) != head[2])
+        return 0;
+    const size_t fixed = sizeof(r.wallUs) + sizeof(r.camera) + sizeof(r.trackId) + sizeof(r.quad) + sizeof(uint16_t);
+    if (body.size() < fixed) return 0;
+    const char* p = body.data();
+    std::memcpy(&r.wallUs, p, sizeof(r.wallUs)); p += sizeof(r.wallUs);
+    std::memcpy(&r.camera, p, sizeof(r.camera)); p += sizeof(r.camera);
+    std::memcpy(&r.trackId, p, sizeof(r.trackId)); p += sizeof(r.trackId);
+    std::memcpy(r.quad, p, sizeof(r.quad)); p += sizeof(r.quad);
+    uint16_t len;
+    std::memcpy(&len, p, sizeof(len)); p += sizeof(len);
+    if (body.size() != fixed + len) return 0;
+    r.payload.assign(p, len);
+    return sizeof(head) + body.size();
+}
+
+class ScanJournal {
+public:
+    struct Stats {
+        uint64_t events = 0;
+        uint64_t batches = 0;
+        uint64_t bytes = 0;
+        uint64_t dropped = 0;    // queue overflow or lost to a failed write/sync
+        uint64_t failedCommits = 0;
+        uint64_t segments = 0;   // segments opened by this run
+        double commitMsTotal = 0.0;
+        double commitMsMax = 0.0;
+    };
+
+    ScanJournal(const std::string& dir, int camera, size_t segmentBytes, double commitMs)
+        : dir_(dir), camera_(camera), segmentBytes_(std::max<size_t>(1 << 20, segmentBytes)),
+          commitMs_(std::max(1.0, commitMs)) {}
+    ~ScanJournal() { stop(); }
+
+    bool open(std::string& err) {
+        ::mkdir(dir_.c_str(), 0755); // EEXIST is fine
+        std::vector<uint32_t> segs = listJournalSegments(dir_);
+        const bool ok = segs.empty() ? openSegment(1) : recoverSegment(segs.back());
+        if (!ok) { err = "无法打开日志段于 " + dir_ + " (" + std::strerror(errno) + ")"; return false; }
+        worker_ = std::thread(&ScanJournal::run, this);
+        return true;
+    }
+
+    // Capture loop: queues the frame's decoded codes; never touches disk.
+    void append(const std::vector<DetectedCode>& codes, double wallMs) {
+        bool kick = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (size_t i = 0; i < codes.size(); ++i) {
+                if (codes[i].payload.empty()) continue;
+                if (queue_.size() >= kMaxQueued) { ++stats_.dropped; continue; }
+                JournalRecord r;
+                r.wallUs = static_cast<int64_t>(wallMs * 1000.0);
+                r.camera = camera_;
+                r.trackId = codes[i].trackId;
+                for (int k = 0; k < 4; ++k) {
+                    r.quad[2 * k] = codes[i].quad[k].x;
+                    r.quad[2 * k + 1] = codes[i].quad[k].y;
+                }
+                r.payload = codes[i].payload;
+                queue_.push_back(r);
+            }
+            kick = queue_.size() >= kBatchKick;
+        }
+        if (kick) cond_.notify_one();
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopping_) return;
+            stopping_ = true;
+        }
+        cond_.notify_one();
+        if (worker_.joinable()) worker_.join();
+        if (logFd_ >= 0) ::close(logFd_);
+        logFd_ = -1;
+        index_.close();
+    }
+
+    Stats stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+
+private:
+    static const size_t kMaxQueued = 1 << 20;
+    static const size_t kBatchKick = 4096;
+
+    bool openSegment(uint32_t seg) {
+        if (logFd_ >= 0) ::close(logFd_);
+        index_.close();
+        seg_ = seg;
+        logFd_ = ::open(journalSegmentPath(dir_, seg, "log").c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (logFd_ < 0) return false;
+        logBytes_ = 0;
+        // Smallest record is ~62 bytes; size the index so it never fills first.
+        if (!index_.create(journalSegmentPath(dir_, seg, "idx"), segmentBytes_ / 48 + 1)) return false;
+        ++stats_.segments;
+        return true;
+    }
+
+    // Reopen the newest segment after a restart or crash. Its index is
+    // reconciled even when the segment is full and writing moves on, since
+    // a crash after the last write left it behind the log.
+    bool recoverSegment(uint32_t seg) {
+        const std::string logPath = journalSegmentPath(dir_, seg, "log");
+        int fd = ::open(logPath.c_str(), O_RDWR | O_CLOEXEC);
+        if (fd < 0) return false;
+        std::vector<std::pair<int64_t, std::pair<uint64_t, uint64_t> > > records;
+        uint64_t off = 0;
+        JournalRecord r;
+        for (size_t n; (n = decodeJournalRecord(fd, off, r)) > 0; off += n)
+            records.push_back(std::make_pair(r.wallUs, std::make_pair(off, fnv1a64(r.payload))));
+        if (::ftruncate(fd, static_cast<off_t>(off)) < 0) { ::close(fd); return false; } // cut a torn tail
+        ::close(fd);
+
+        const std::string idxPath = journalSegmentPath(dir_, seg, "idx");
+        if (!index_.open(idxPath, true) && !index_.create(idxPath, segmentBytes_ / 48 + 1)) return false;
+        if (index_.count() != records.size()) {
+            index_.reset();
+            for (size_t i = 0; i < records.size() && !index_.full(); ++i)
+                index_.add(records[i].first, records[i].second.first, records[i].second.second);
+        }
+        if (off >= segmentBytes_) return openSegment(seg + 1);
+
+        seg_ = seg;
+        logFd_ = ::open(logPath.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (logFd_ < 0) return false;
+        logBytes_ = off;
+        return true;
+    }
+
+    void run() {
+        std::vector<JournalRecord> batch;
+        std::string buf;
+        for (;;) {
+            bool stopping;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cond_.wait_for(lock, std::chrono::microseconds(static_cast<int64_t>(commitMs_ * 1000.0)),
+                               [this] { return stopping_ || queue_.size() >= kBatchKick; });
+                batch.swap(queue_);
+                stopping = stopping_;
+            }
+            if (!batch.empty()) commit(batch, buf);
+            batch.clear();
+            if (stopping) break;
+        }
+    }
+
+    // Group commit: one write and one fdatasync for the whole batch, then the
+    // index. A crash between the two is repaired by recoverSegment(). A failed
+    // write or sync cuts the log back to the last durable byte (or moves on
+    // to a fresh segment if that fails too) so index offsets stay valid; the
+    // rest of the batch is counted as dropped.
+    void commit(const std::vector<JournalRecord>& batch, std::string& buf) {
+        const double t0 = nowMs();
+        size_t i = 0;
+        uint64_t written = 0;
+        bool failed = false;
+        while (i < batch.size()) {
+            if (logBytes_ >= segmentBytes_ || index_.full()) {
+                if (!openSegment(seg_ + 1)) {
+                    std::cerr << "日志段切换失败: " << std::strerror(errno) << std::endl;
+                    failed = true;
+                    break;
+                }
+            }
+            buf.clear();
+            std::vector<uint64_t> offsets;
+            size_t j = i;
+            const uint64_t room = std::min<uint64_t>(index_.header().capacity - index_.count(), batch.size() - i);
+            for (; j < i + room && logBytes_ + buf.size() < segmentBytes_; ++j) {
+                offsets.push_back(logBytes_ + buf.size());
+                encodeJournalRecord(batch[j], buf);
+            }
+            if (!writeDurably(buf)) {
+                failed = true;
+                break;
+            }
+            for (size_t k = i; k < j; ++k) index_.add(batch[k].wallUs, offsets[k - i], fnv1a64(batch[k].payload));
+            logBytes_ += buf.size();
+            written += buf.size();
+            i = j;
+        }
+        const double ms = nowMs() - t0;
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.events += i;
+        stats_.dropped += batch.size() - i;
+        if (failed) ++stats_.failedCommits;
+        ++stats_.batches;
+        stats_.bytes += written;
+        stats_.commitMsTotal += ms;
+        stats_.commitMsMax = std::max(stats_.commitMsMax, ms);
+    }
+
+    // Appends buf and syncs it. On failure the segment is restored to
+    // logBytes_, so whatever part of buf reached the file is discarded.
+    bool writeDurably(const std::string& buf) {
+        size_t done = 0;
+        const char* what = nullptr;
+        while (done < buf.size()) {
+            ssize_t n = ::write(logFd_, buf.data() + done, buf.size() - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) { what = "日志写入失败"; break; }
+            done += static_cast<size_t>(n);
+        }
+        if (!what && ::fdatasync(logFd_) < 0) what = "日志同步失败";
+        if (!what) return true;
+        std::cerr << what << ": " << std::strerror(errno) << std::endl;
+        if (::ftruncate(logFd_, static_cast<off_t>(logBytes_)) < 0 && !openSegment(seg_ + 1))
+            std::cerr << "日志段切换失败: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    const std::string dir_;
+    const int camera_;
+    const size_t segmentBytes_;
+    const double commitMs_;
+
+    std::thread worker_;
+    mutable std::mutex mutex_;
+    std::condition_variable cond_;
+    std::vector<JournalRecord> queue_;
+    bool stopping_ = false;
+    Stats stats_;
+
+    // Writer thread only.
+    uint32_t seg_ = 0;
+    int logFd_ = -1;
+    uint64_t logBytes_ = 0;
+    JournalIndex index_;
+};
+
+// --journal-query: payload lookups through the hash table, time ranges by
+// binary search on the time entries. Prints one line per event.
+static int runJournalQuery(const std::string& dir, const std::string& payload, double fromMs, double toMs) {
+    std::vector<uint32_t> segs = listJournalSegments(dir);
+    if (segs.empty()) {
+        std::cerr << "没有找到日志段: " << dir << std::endl;
+        return 2;
+    }
+    const double t0 = nowMs();
+    const int64_t fromUs = static_cast<int64_t>(fromMs * 1000.0), toUs = static_cast<int64_t>(toMs * 1000.0);
+    const uint64_t hash = payload.empty() ? 0 : fnv1a64(payload);
+    size_t hits = 0;
+    for (size_t s = 0; s < segs.size(); ++s) {
+        JournalIndex index;
+        if (!index.open(journalSegmentPath(dir, segs[s], "idx"), false)) {
+            std::cerr << "跳过无索引的日志段 " << segs[s] << std::endl;
+            continue;
+        }
+        const JournalIndexHeader& h = index.header();
+        if (h.count == 0 || h.lastUs < fromUs || h.firstUs > toUs) continue;
+        std::vector<uint64_t> entries;
+        if (hash) {
+            index.lookup(hash, entries);
+        } else {
+            for (uint64_t i = index.lowerBound(fromUs); i < h.count && index.entry(i).wallUs <= toUs; ++i)
+                entries.push_back(i);
+        }
+        if (entries.empty()) continue;
+        int fd = ::open(journalSegmentPath(dir, segs[s], "log").c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue;
+        for (size_t i = 0; i < entries.size(); ++i) {
+            const JournalTimeEntry& e = index.entry(entries[i]);
+            if (e.wallUs < fromUs || e.wallUs > toUs) continue;
+            JournalRecord r;
+            if (!decodeJournalRecord(fd, e.offset, r)) continue;
+            if (hash && r.payload != payload) continue; // hash collision
+            ++hits;
+            std::cout << cv::format("%.3f cam%d #%d [%.0f,%.0f %.0f,%.0f %.0f,%.0f %.0f,%.0f] ", r.wallUs / 1e6,
+                                    r.camera, r.trackId, r.quad[0], r.quad[1], r.quad[2], r.quad[3], r.quad[4],
+                                    r.quad[5], r.quad[6], r.quad[7])
+                      << r.payload << std::endl;
+        }
+        ::close(fd);
+    }
+    std::cerr << cv::format("%zu event(s) in %.2f ms", hits, nowMs() - t0) << std::endl;
+    return 0;
+}
+// ---- End scan-event journal ----
+
+// ---- Payload inverted index for recorded footage ----
+// --scan-archive streams a recorded video through the detector and builds
+// an index answering "in which frames / at what times did payload X
+// appear". Each payload's sightings are coalesced into runs of frames
+// (gaps up to kRunGap frames are bridged); a run becomes one posting
+// carrying its frame range, timestamps and the quad where it started.
+// Closed runs are appended to a spill file as they happen, so memory only
+// holds the currently open runs. finish() external-sorts the spill by
+// (hash, payload, first frame) in bounded chunks, merges the sorted chunks
+// and streams the directory, postings and strings out, so it never holds
+// more than one chunk either. The final file is
+//   header | directory (sorted by hash) | postings | payload strings
+// which --index-query maps read-only and binary-searches.
+const uint32_t kPayloadIndexMagic = 0x58444951; // "QIDX"
+
+struct PayloadIndexHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t payloads;
+    uint64_t postings;
+    uint64_t frames;       // frames scanned
+    uint64_t blobBytes;
+};
+
+struct PayloadIndexDirEntry {
+    uint64_t hash;
+    uint64_t firstPosting;
+    uint32_t postingCount;
+    uint32_t payloadLength;
+    uint64_t payloadOffset; // into the string blob
+};
+
+struct PayloadPosting {
+    uint64_t firstFrame, lastFrame;
+    double firstMs, lastMs; // stream timestamps
+    float quad[8];          // at firstFrame
+};
+
+// Spill and sort-run record: [hash u64][length u32][payload][posting].
+struct PayloadSpillRecord {
+    uint64_t hash;
+    std::string payload;
+    PayloadPosting post;
+
+    bool operator<(const PayloadSpillRecord& o) const {
+        if (hash != o.hash) return hash < o.hash;
+        const int c = payload.compare(o.payload);
+        if (c != 0) return c < 0;
+        return post.firstFrame < o.post.firstFrame;
+    }
+};
+
+static void writeSpillRecord(std::ostream& out, const PayloadSpillRecord& r) {
+    const uint32_t len = static_cast<uint32_t>(r.payload.size());
+    out.write(reinterpret_cast<const char*>(&r.hash), sizeof(r.hash));
+    out.write(reinterpret_cast<const char*>(&len), sizeof(len));
+    out.write(r.payload.data(), len);
+    out.write(reinterpret_cast<const char*>(&r.post), sizeof(r.post));
+}
+
+static bool readSpillRecord(std::istream& in, PayloadSpillRecord& r) {
+    uint32_t len;
+    if (!in.read(reinterpret_cast<char*>(&r.hash), sizeof(r.hash)) ||
+        !in.read(reinterpret_cast<char*>(&len), sizeof(len)))
+        return false;
+    r.payload.resize(len);
+    return (len == 0 || in.read(&r.payload[0], len)) && in.read(reinterpret_cast<char*>(&r.post), sizeof(r.post));
+}
+
+static bool appendFile(std::ostream& out, const std::string& path) {
+    std::ifstream in(path.c_str(), std::ios::binary);
+    if (!in) return false;
+    std::vector<char> buf(1 << 20);
+    while (in) {
+        in.read(buf.data(), buf.size());
+        out.write(buf.data(), in.gcount());
+    }
+    return static_cast<bool>(out);
+}
+
+class PayloadIndexBuilder {
+public:
+    static const uint64_t kRunGap = 2;
+    static const size_t kSortChunkBytes = 64u << 20; // spill bytes sorted in memory at once
+
+    explicit PayloadIndexBuilder(const std::string& path) : path_(path), spillPath_(path + ".spill") {}
+
+    bool open() {
+        spill_.open(spillPath_.c_str(), std::ios::binary | std::ios::trunc);
+        return static_cast<bool>(spill_);
+    }
+
+    // Feed one frame's results, in frame order.
+    void add(uint64_t frame, double streamMs, const std::vector<DetectedCode>& codes) {
+        frames_ = frame + 1;
+        for (size_t i = 0; i < codes.size(); ++i) {
+            const std::string& p = codes[i].payload;
+            if (p.empty()) continue;
+            std::map<std::string, PayloadPosting>::iterator it = open_.find(p);
+            if (it != open_.end() && frame <= it->second.lastFrame + kRunGap) {
+                it->second.lastFrame = frame;
+                it->second.lastMs = streamMs;
+                continue;
+            }
+            if (it != open_.end()) spill(it->first, it->second);
+            PayloadPosting post;
+            post.firstFrame = post.lastFrame = frame;
+            post.firstMs = post.lastMs = streamMs;
+            for (int k = 0; k < 4; ++k) {
+                post.quad[2 * k] = codes[i].quad[k].x;
+                post.quad[2 * k + 1] = codes[i].quad[k].y;
+            }
+            open_[p] = post;
+        }
+        // Close runs that can no longer be extended.
+        for (std::map<std::string, PayloadPosting>::iterator it = open_.begin(); it != open_.end();) {
+            if (it->second.lastFrame + kRunGap < frame) {
+                spill(it->first, it->second);
+                open_.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // Flush open runs and write the final index; removes all temporaries.
+    bool finish(std::string& err) {
+        for (std::map<std::string, PayloadPosting>::iterator it = open_.begin(); it != open_.end(); ++it)
+            spill(it->first, it->second);
+        open_.clear();
+        spill_.close();
+
+        std::vector<std::string> runs;
+        const bool ok = sortRuns(runs) && merge(runs);
+        for (size_t i = 0; i < runs.size(); ++i) std::remove(runs[i].c_str());
+        std::remove(spillPath_.c_str());
+        std::remove((path_ + ".dir").c_str());
+        std::remove((path_ + ".post").c_str());
+        std::remove((path_ + ".blob").c_str());
+        if (!ok) err = "无法写入 " + path_;
+        return ok;
+    }
+
+    uint64_t payloads() const { return payloads_; }
+    uint64_t postings() const { return postings_; }
+
+private:
+    void spill(const std::string& payload, const PayloadPosting& post) {
+        PayloadSpillRecord r;
+        r.hash = fnv1a64(payload);
+        r.payload = payload;
+        r.post = post;
+        writeSpillRecord(spill_, r);
+    }
+
+    // Pass 1: cut the spill into chunks of about kSortChunkBytes, sort each
+    // and write it as a run file.
+    bool sortRuns(std::vector<std::string>& runs) {
+        std::ifstream in(spillPath_.c_str(), std::ios::binary);
+        if (!in) return false;
+        std::vector<PayloadSpillRecord> chunk;
+        PayloadSpillRecord r;
+        bool more = true;
+        while (more) {
+            chunk.clear();
+            size_t bytes = 0;
+            while (bytes < kSortChunkBytes && (more = readSpillRecord(in, r))) {
+                bytes += sizeof(r) + r.payload.size();
+                chunk.push_back(r);
+            }
+            if (chunk.empty()) break;
+            std::sort(chunk.begin(), chunk.end());
+            runs.push_back(cv::format("%s.run%zu", path_.c_str(), runs.size()));
+            std::ofstream out(runs.back().c_str(), std::ios::binary | std::ios::trunc);
+            for (size_t i = 0; i < chunk.size(); ++i) writeSpillRecord(out, chunk[i]);
+            if (!out) return false;
+        }
+        return true;
+    }
+
+    // Pass 2: k-way merge of the runs. Records arrive grouped by payload in
+    // hash order, so directory entries, postings and strings stream into
+    // three temporaries that are then concatenated behind the header.
+    bool merge(const std::vector<std::string>& runs) {
+        struct Head {
+            PayloadSpillRecord rec;
+            size_t run;
+            bool operator>(const Head& o) const { return o.rec < rec; }
+        };
+        std::vector<std::unique_ptr<std::ifstream> > inputs;
+        std::priority_queue<Head, std::vector<Head>, std::greater<Head> > heap;
+        for (size_t i = 0; i < runs.size(); ++i) {
+            inputs.push_back(std::unique_ptr<std::ifstream>(new std::ifstream(runs[i].c_str(), std::ios::binary)));
+            Head h;
+            h.run = i;
+            if (readSpillRecord(*inputs[i], h.rec)) heap.push(h);
+        }
+
+        std::ofstream dirOut((path_ + ".dir").c_str(), std::ios::binary | std::ios::trunc);
+        std::ofstream postOut((path_ + ".post").c_str(), std::ios::binary | std::ios::trunc);
+        std::ofstream blobOut((path_ + ".blob").c_str(), std::ios::binary | std::ios::trunc);
+        uint64_t payloads = 0, postings = 0, blobBytes = 0;
+        PayloadIndexDirEntry cur;
+        std::string curPayload;
+        bool open = false;
+        while (!heap.empty()) {
+            Head h = heap.top();
+            heap.pop();
+            if (!open || h.rec.hash != cur.hash || h.rec.payload != curPayload) {
+                if (open) dirOut.write(reinterpret_cast<const char*>(&cur), sizeof(cur));
+                cur.hash = h.rec.hash;
+                cur.firstPosting = postings;
+                cur.postingCount = 0;
+                cur.payloadLength = static_cast<uint32_t>(h.rec.payload.size());
+                cur.payloadOffset = blobBytes;
+                curPayload = h.rec.payload;
+                blobOut.write(curPayload.data(), curPayload.size());
+                blobBytes += curPayload.size();
+                ++payloads;
+                open = true;
+            }
+            postOut.write(reinterpret_cast<const char*>(&h.rec.post), sizeof(h.rec.post));
+            ++cur.postingCount;
+            ++postings;
+            if (readSpillRecord(*inputs[h.run], h.rec)) heap.push(h);
+        }
+        if (open) dirOut.write(reinterpret_cast<const char*>(&cur), sizeof(cur));
+        dirOut.close();
+        postOut.close();
+        blobOut.close();
+        if (!dirOut || !postOut || !blobOut) return false;
+
+        PayloadIndexHeader hdr = { kPayloadIndexMagic, 1, payloads, postings, frames_, blobBytes };
+        std::ofstream out(path_.c_str(), std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+        if (!appendFile(out, path_ + ".dir") || !appendFile(out, path_ + ".post") || !appendFile(out, path_ + ".blob"))
+            return false;
+        out.close();
+        if (!out) return false;
+        payloads_ = payloads;
+        postings_ = postings;
+        return true;
+    }
+
+    const std::string path_;
+    const std::string spillPath_;
+    std::ofstream spill_;
+    std::map<std::string, PayloadPosting> open_;
+    uint64_t frames_ = 0;
+    uint64_t payloads_ = 0;
+    uint64_t postings_ = 0;
+};
+
+static int runArchiveScan(const std::string& video, const std::string& indexPath, const DetectorConfig& cfg) {
+    cv::VideoCapture in(video);
+    if (!in.isOpened()) {
+        std::cerr << "无法打开视频: " << video << std::endl;
+        return 2;
+    }
+    PayloadIndexBuilder builder(indexPath);
+    if (!builder.open()) {
+        std::cerr << "无法写入 " << indexPath << ".spill" << std::endl;
+        return 3;
+    }
+    if (cfg.threads > 0) cv::setNumThreads(cfg.threads);
+    QrDetector detector(cfg);
+    cv::Mat frame;
+    uint64_t n = 0;
+    const double t0 = nowMs();
+    while (!g_signal_exit && in.read(frame) && !frame.empty()) {
+        const double streamMs = in.get(cv::CAP_PROP_POS_MSEC);
+        builder.add(n++, streamMs, detector.detect(frame));
+        if (n % 500 == 0) std::cerr << cv::format("\r%llu frames", (unsigned long long)n) << std::flush;
+    }
+    std::string err;
+    if (!builder.finish(err)) {
+        std::cerr << err << std::endl;
+        return 3;
+    }
+    std::cout << cv::format("\rindexed %llu frames in %.1f s: %llu payloads, %llu postings -> %s",
+                            (unsigned long long)n, (nowMs() - t0) / 1000.0, (unsigned long long)builder.payloads(),
+                            (unsigned long long)builder.postings(), indexPath.c_str()) << std::endl;
+    return 0;
+}
+
+static int runIndexQuery(const std::string& indexPath, const std::string& payload) {
+    const double t0 = nowMs();
+    int fd = ::open(indexPath.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || ::fstat(fd, &st) < 0 || st.st_size < static_cast<off_t>(sizeof(PayloadIndexHeader))) {
+        std::cerr << "无法打开索引: " << indexPath << std::endl;
+        if (fd >= 0) ::close(fd);
+        return 2;
+    }
+    const size_t size = static_cast<size_t>(st.st_size);
+    void* p = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) return 2;
+    const char* base = static_cast<const char*>(p);
+    const PayloadIndexHeader& h = *reinterpret_cast<const PayloadIndexHeader*>(base);
+    const size_t need = sizeof(h) + h.payloads * sizeof(PayloadIndexDirEntry) + h.postings * sizeof(PayloadPosting) +
+                        h.blobBytes;
+    if (h.magic != kPayloadIndexMagic || need != size) {
+        std::cerr << "索引文件格式错误: " << indexPath << std::endl;
+        ::munmap(p, size);
+        return 2;
+    }
+    const PayloadIndexDirEntry* dir = reinterpret_cast<const PayloadIndexDirEntry*>(base + sizeof(h));
+    const PayloadPosting* postings = reinterpret_cast<const PayloadPosting*>(dir + h.payloads);
+    const char* blob = reinterpret_cast<const char*>(postings + h.postings);
+
+    const uint64_t hash = fnv1a64(payload);
+    const PayloadIndexDirEntry* it = std::lower_bound(
+        dir, dir + h.payloads, hash, [](const PayloadIndexDirEntry& e, uint64_t v) { return e.hash < v; });
+    size_t runs = 0;
+    for (; it != dir + h.payloads && it->hash == hash; ++it) {
+        if (payload.compare(0, std::string::npos, blob + it->payloadOffset, it->payloadLength) != 0) continue;
+        for (uint32_t k = 0; k < it->postingCount; ++k) {
+            const PayloadPosting& q = postings[it->firstPosting + k];
+            std::cout << cv::format("frames %llu-%llu  %.3f-%.3f s  at [%.0f,%.0f %.0f,%.0f %.0f,%.0f %.0f,%.0f]",
+                                    (unsigned long long)q.firstFrame, (unsigned long long)q.lastFrame,
+                                    q.firstMs / 1000.0, q.lastMs / 1000.0, q.quad[0], q.quad[1], q.quad[2],
+                                    q.quad[3], q.quad[4], q.quad[5], q.quad[6], q.quad[7]) << std::endl;
+            ++runs;
+        }
+    }
+    std::cerr << cv::format("%zu run(s) of %llu indexed frames, %.3f ms", runs, (unsigned long long)h.frames,
+                            nowMs() - t0) << std::endl;
+    ::munmap(p, size);
+    return 0;
+}
+// ---- End payload inverted index ----
+
+// ---- Startup auto-tuner ----
+// Picks the fastest detector configuration whose decode yield stays within
+// `tolerance` of the best yield seen, measured on the same set of frames
+// (a few seconds of live capture or a recorded sample). The sweep is staged
+// (backend x scale, then threads, then gate) to keep calibration short.
+// The winner is persisted with cv::FileStorage and reused on later starts.
+struct TuneResult {
+    DetectorConfig cfg;
+    double msPerFrame = 0.0; // median
+    int decoded = 0;         // decoded payloads summed over the sample
+};
+
+// Frames from a video file, or from every image in a directory. `names`
+// (optional) receives each frame's file name, or its index for video.
+static bool loadSampleFrames(const std::string& path, size_t maxFrames, std::vector<cv::Mat>& frames,
+                             std::vector<std::string>* names = nullptr) {
+    struct stat st;
+    if (::stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+        std::vector<cv::String> files;
+        cv::glob(path + "/*", files, false);
+        std::sort(files.begin(), files.end());
+        for (size_t i = 0; i < files.size() && frames.size() < maxFrames; ++i) {
+            cv::Mat img = cv::imread(files[i], cv::IMREAD_COLOR);
+            if (img.empty()) continue;
+            frames.push_back(img);
+            if (names) {
+                size_t slash = files[i].find_last_of('/');
+                names->push_back(slash == std::string::npos ? files[i] : files[i].substr(slash + 1));
+            }
+        }
+        return !frames.empty();
+    }
+    cv::VideoCapture src(path);
+    if (!src.isOpened()) return false;
+    cv::Mat f;
+    while (frames.size() < maxFrames && src.read(f) && !f.empty()) {
+        if (names) names->push_back(cv::format("%zu", frames.size()));
+        frames.push_back(f);
+        f = cv::Mat(); // next read allocates
+    }
+    return !frames.empty();
+}
+
+// Sample up to `maxFrames` frames spread over `seconds` of capture. The
+// frame rate is estimated from the first frames to pick a keep-every-Nth
+// stride, so memory stays at about maxFrames frames however long the
+// window or large the frames; if the estimate was low, every other kept
+// frame is dropped and the stride doubles.
+static void captureSampleFrames(cv::VideoCapture& cap, double seconds, size_t maxFrames,
+                                std::vector<cv::Mat>& frames) {
+    const size_t limit = std::max<size_t>(1, maxFrames);
+    const double start = nowMs();
+    const double end = start + seconds * 1000.0;
+    const size_t kProbe = 10; // frames read before the stride is fixed
+    size_t stride = 1, read = 0;
+    cv::Mat f;
+    while (nowMs() < end && !g_signal_exit) {
+        if (!cap.read(f) || f.empty()) break;
+        if (read == kProbe) {
+            const double fps = kProbe * 1000.0 / std::max(1.0, nowMs() - start);
+            stride = std::max<size_t>(1, static_cast<size_t>(std::ceil(fps * seconds / limit)));
+        }
+        if (read++ % stride == 0) frames.push_back(f);
+        f = cv::Mat();
+        if (frames.size() > limit) {
+            size_t k = 0;
+            for (size_t i = 0; i < frames.size(); i += 2) frames[k++] = frames[i];
+            frames.resize(k);
+            stride *= 2;
+        }
+    }
+}
+
+static TuneResult evaluateConfig(const DetectorConfig& cfg, const std::vector<cv::Mat>& frames) {
+    TuneResult r;
+    r.cfg = cfg;
+    if (frames.empty()) return r;
+    cv::setNumThreads(cfg.threads > 0 ? cfg.threads : -1);
+    QrDetector det(cfg);
+    det.detect(frames[0]); // warm-up: first call allocates
+    std::vector<double> ms;
+    ms.reserve(frames.size());
+    for (size_t i = 0; i < frames.size(); ++i) {
+        double t0 = nowMs();
+        std::vector<DetectedCode> codes = det.detect(frames[i]);
+        ms.push_back(nowMs() - t0);
+        for (size_t k = 0; k < codes.size(); ++k)
+            if (!codes[k].payload.empty()) ++r.decoded;
+    }
+    std::nth_element(ms.begin(), ms.begin() + ms.size() / 2, ms.end());
+    r.msPerFrame = ms[ms.size() / 2];
+    return r;
+}
+
+static TuneResult autoTune(const std::vector<cv::Mat>& frames, double tolerance) {
+    std::vector<TuneResult> results;
+    int bestYield = 0;
+
+    // Fastest result (within tolerance of the best yield so far) wins.
+    auto pick = [&]() {
+        const TuneResult* best = nullptr;
+        for (size_t i = 0; i < results.size(); ++i) {
+            if (results[i].decoded < (1.0 - tolerance) * bestYield) continue;
+            if (!best || results[i].msPerFrame < best->msPerFrame) best = &results[i];
+        }
+        return best ? *best : results.front();
+    };
+    auto run = [&](const DetectorConfig& cfg) {
+        TuneResult r = evaluateConfig(cfg, frames);
+        bestYield = std::max(bestYield, r.decoded);
+        results.push_back(r);
+        std::cout << cv::format("  %-48s %7.2f ms  decoded %d", cfg.describe().c_str(),
+                                r.msPerFrame, r.decoded) << std::endl;
+    };
+
+    std::vector<std::string> backends;
+    backends.push_back("classic");
+#if QR_HAVE_ARUCO_BACKEND
+    backends.push_back("aruco");
+#endif
+    const double scales[] = {1.0, 0.75, 0.5, 0.35};
+    for (size_t b = 0; b < backends.size(); ++b)
+        for (double sc : scales) {
+            DetectorConfig cfg;
+            cfg.backend = backends[b];
+            cfg.scale = sc;
+            run(cfg);
+        }
+
+    const int hw = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    DetectorConfig base = pick().cfg;
+    const int threadCounts[] = {1, 2, hw / 2, hw};
+    for (int t : threadCounts) {
+        if (t < 1 || t > hw || (t == 2 && hw < 4)) continue;
+        DetectorConfig cfg = base;
+        cfg.threads = t;
+        run(cfg);
+    }
+
+    base = pick().cfg;
+    const double gates[] = {2.0, 4.0, 8.0};
+    for (double g : gates) {
+        DetectorConfig cfg = base;
+        cfg.gate = g;
+        run(cfg);
+    }
+
+    cv::setNumThreads(-1);
+    return pick();
+}
+
+static bool saveTune(const std::string& path, const TuneResult& r, cv::Size frameSize) {
+    cv::FileStorage fs(path, cv::FileStorage::WRITE);
+    if (!fs.isOpened()) return false;
+    fs << "backend" << r.cfg.backend;
+    fs << "scale" << r.cfg.scale;
+    fs << "threads" << r.cfg.threads;
+    fs << "gate" << r.cfg.gate;
+    fs << "frame_width" << frameSize.width;
+    fs << "frame_height" << frameSize.height;
+    fs << "ms_per_frame" << r.msPerFrame;
+    fs << "decoded" << r.decoded;
+    fs << "tuned_at_ms" << static_cast<double>(wallClockMs());
+    return true;
+}
+
+// Only accepted when tuned at the same capture resolution.
+static bool loadTune(const std::string& path, cv::Size frameSize, DetectorConfig& cfg) {
+    cv::FileStorage fs;
+    try {
+        if (!fs.open(path, cv::FileStorage::READ)) return false;
+    } catch (const cv::Exception&) {
+        return false;
+    }
+    if ((int)fs["frame_width"] != frameSize.width || (int)fs["frame_height"] != frameSize.height)
+        return false;
+    DetectorConfig loaded;
+    std::string backend = (std::string)fs["backend"];
+    if (backend == "classic" || (backend == "aruco" && QR_HAVE_ARUCO_BACKEND)) loaded.backend = backend;
+    double scale = (double)fs["scale"];
+    if (scale > 0.0 && scale <= 1.0) loaded.scale = scale;
+    loaded.threads = std::max(0, (int)fs["threads"]);
+    loaded.gate = std::max(0.0, (double)fs["gate"]);
+    cfg = loaded;
+    return true;
+}
+// ---- End startup auto-tuner ----
+
+// ---- Pareto sweep over a recorded corpus ----
+// Runs every point of a parameter grid over the same in-memory corpus and
+// scores throughput against decode recall from a ground-truth file. Video
+// is decoded once up front; configurations that only differ in backend,
+// tiling or gate share one prepare() pass per frame, and the texture score
+// used by the gate is computed once per frame.
+//
+// Truth file: one line per frame, "<name>\t<payload>[\t<payload>...]", where
+// name is the image file name or the 0-based video frame index. Frames
+// without a line are expected to contain no codes.
+struct SweepPoint {
+    DetectorConfig cfg;
+    double msPerFrame = 0.0;
+    uint64_t expected = 0;
+    uint64_t matched = 0;
+    uint64_t falsePositives = 0;
+    uint64_t gated = 0;
+    bool pareto = false;
+
+    double recall() const { return expected ? static_cast<double>(matched) / expected : 0.0; }
+};
+
+static bool loadTruth(const std::string& path, std::map<std::string, std::set<std::string> >& truth) {
+    std::ifstream in(path.c_str());
+    if (!in) return false;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line[line.size() - 1] == '\r') line.erase(line.size() - 1);
+        if (line.empty() || line[0] == '#') continue;
+        std::stringstream ss(line);
+        std::string name, payload;
+        std::getline(ss, name, '\t');
+        std::set<std::string>& set = truth[name];
+        while (std::getline(ss, payload, '\t'))
+            if (!payload.empty()) set.insert(payload);
+    }
+    return true;
+}
+
+// Grid spec: "key=v1|v2;key=v1|v2" overriding the default values per key.
+static bool buildSweepGrid(const std::string& spec, std::vector<DetectorConfig>& grid, std::string& err) {
+    const char* order[] = {"backend", "scale", "pyramid", "binarize", "tiles", "threads", "gate"};
+    const int hw = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    std::map<std::string, std::vector<std::string> > axes;
+#if QR_HAVE_ARUCO_BACKEND
+    axes["backend"] = {"classic", "aruco"};
+#else
+    axes["backend"] = {"classic"};
+#endif
+    axes["scale"] = {"1"};
+    axes["pyramid"] = {"0", "1", "2"};
+    axes["binarize"] = {"none", "otsu", "adaptive"};
+    axes["tiles"] = {"1", "2"};
+    axes["threads"] = {"1", cv::format("%d", hw)};
+    axes["gate"] = {"0", "4"};
+    if (hw == 1) axes["threads"].pop_back();
+
+    std::stringstream ss(spec);
+    std::string item;
+    while (std::getline(ss, item, ';')) {
+        if (item.empty()) continue;
+        size_t eq = item.find('=');
+        if (eq == std::string::npos) { err = "缺少 '=': " + item; return false; }
+        std::string key = item.substr(0, eq);
+        if (!axes.count(key)) { err = "未知参数: " + key; return false; }
+        std::vector<std::string> values;
+        std::stringstream vs(item.substr(eq + 1));
+        std::string v;
+        while (std::getline(vs, v, '|')) if (!v.empty()) values.push_back(v);
+        if (values.empty()) { err = "参数没有取值: " + key; return false; }
+        axes[key] = values;
+    }
+
+    std::vector<std::string> specs(1);
+    for (const char* key : order) {
+        std::vector<std::string> next;
+        for (size_t i = 0; i < specs.size(); ++i)
+            for (size_t k = 0; k < axes[key].size(); ++k)
+                next.push_back(specs[i] + key + "=" + axes[key][k] + ",");
+        specs.swap(next);
+    }
+    grid.clear();
+    for (size_t i = 0; i < specs.size(); ++i) {
+        DetectorConfig cfg;
+        if (!parseDetectorConfig(specs[i], cfg, err)) return false;
+        grid.push_back(cfg);
+    }
+    return true;
+}
+
+static std::string jsonEscape(const std::string& s) {
+    std::string out;
+    for (size_t i = 0; i < s.size(); ++i) {
+        unsigned char c = static_cast<unsigned char>(s[i]);
+        if (c == '"' || c == '\\') { out += '\\'; out += static_cast<char>(c); }
+        else if (c < 0x20) out += cv::format("\\u%04x", c);
+        else out += static_cast<char>(c);
+    }
+    return out;
+}
+
+static void markPareto(std::vector<SweepPoint>& points) {
+    for (size_t i = 0; i < points.size(); ++i) {
+        points[i].pareto = true;
+        for (size_t j = 0; j < points.size() && points[i].pareto; ++j) {
+            if (i == j) continue;
+            bool noWorse = points[j].msPerFrame <= points[i].msPerFrame &&
+                           points[j].recall() >= points[i].recall();
+            bool better = points[j].msPerFrame < points[i].msPerFrame ||
+                          points[j].recall() > points[i].recall();
+            if (noWorse && better) points[i].pareto = false;
+        }
+    }
+}
+
+static bool writeSweepResults(const std::string& prefix, const std::string& corpus, size_t frames,
+                              const std::vector<SweepPoint>& points) {
+    std::ofstream csv((prefix + ".csv").c_str());
+    std::ofstream json((prefix + ".json").c_str());
+    if (!csv || !json) return false;
+
+    csv << "backend,scale,pyramid,binarize,tiles,threads,gate,ms_per_frame,fps,recall,"
+           "expected,matched,false_positives,gated,pareto\n";
+    for (size_t i = 0; i < points.size(); ++i) {
+        const SweepPoint& p = points[i];
+        csv << cv::format("%s,%.3f,%d,%s,%d,%d,%.2f,%.3f,%.1f,%.4f,%llu,%llu,%llu,%llu,%d\n",
+                          p.cfg.backend.c_str(), p.cfg.scale, p.cfg.pyramid, p.cfg.binarize.c_str(),
+                          p.cfg.tiles, p.cfg.threads, p.cfg.gate, p.msPerFrame,
+                          p.msPerFrame > 0 ? 1000.0 / p.msPerFrame : 0.0, p.recall(),
+                          (unsigned long long)p.expected, (unsigned long long)p.matched,
+                          (unsigned long long)p.falsePositives, (unsigned long long)p.gated, p.pareto ? 1 : 0);
+    }
+
+    std::vector<size_t> frontier;
+    for (size_t i = 0; i < points.size(); ++i) if (points[i].pareto) frontier.push_back(i);
+    std::sort(frontier.begin(), frontier.end(), [&](size_t a, size_t b) {
+        return points[a].msPerFrame < points[b].msPerFrame;
+    });
+
+    json << "{\n  \"corpus\": \"" << jsonEscape(corpus) << "\",\n  \"frames\": " << frames
+         << ",\n  \"points\": [\n";
+    for (size_t i = 0; i < points.size(); ++i) {
+        const SweepPoint& p = points[i];
+        json << cv::format("    {\"config\": \"%s\", \"ms_per_frame\": %.3f, \"recall\": %.4f, "
+                           "\"false_positives\": %llu, \"gated\": %llu, \"pareto\": %s}%s\n",
+                           p.cfg.describe().c_str(), p.msPerFrame, p.recall(),
+                           (unsigned long long)p.falsePositives, (unsigned long long)p.gated,
+                           p.pareto ? "true" : "false", i + 1 < points.size() ? "," : "");
+    }
+    json << "  ],\n  \"frontier\": [\n";
+    for (size_t i = 0; i < frontier.size(); ++i)
+        json << "    " << frontier[i] << (i + 1 < frontier.size() ? ",\n" : "\n");
+    json << "  ]\n}\n";
+    return true;
+}
+
+static int runSweep(const std::string& corpus, const std::string& truthPath, const std::string& gridSpec,
+                    const std::string& outPrefix, size_t maxFrames) {
+    std::vector<DetectorConfig> grid;
+    std::string err;
+    if (!buildSweepGrid(gridSpec, grid, err)) {
+        std::cerr << "--sweep-grid: " << err << std::endl;
+        return 2;
+    }
+    std::map<std::string, std::set<std::string> > truth;
+    if (!loadTruth(truthPath, truth)) {
+        std::cerr << "无法读取真值文件 " << truthPath << std::endl;
+        return 2;
+    }
+    std::vector<cv::Mat> frames;
+    std::vector<std::string> names;
+    double t0 = nowMs();
+    if (!loadSampleFrames(corpus, maxFrames, frames, &names)) {
+        std::cerr << "无法读取样本 " << corpus << std::endl;
+        return 2;
+    }
+    std::cout << cv::format("sweep: %zu frames decoded in %.1f s, %zu configurations",
+                            frames.size(), (nowMs() - t0) / 1000.0, grid.size()) << std::endl;
+
+    std::vector<const std::set<std::string>*> expected(frames.size());
+    const std::set<std::string> none;
+    for (size_t f = 0; f < frames.size(); ++f) {
+        std::map<std::string, std::set<std::string> >::const_iterator it = truth.find(names[f]);
+        expected[f] = it != truth.end() ? &it->second : &none;
+    }
+
+    // Gate score once per frame; every gate threshold reuses it.
+    std::vector<double> texture(frames.size());
+    std::vector<double> textureMs(frames.size());
+    {
+        QrDetector probe((DetectorConfig()));
+        for (size_t f = 0; f < frames.size(); ++f) {
+            double ts = nowMs();
+            texture[f] = probe.textureScore(frames[f]);
+            textureMs[f] = nowMs() - ts;
+        }
+    }
+
+    // Group by (threads, preprocessing) so each group prepares every frame once.
+    std::vector<size_t> order(grid.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        if (grid[a].threads != grid[b].threads) return grid[a].threads < grid[b].threads;
+        return grid[a].preprocessKey() < grid[b].preprocessKey();
+    });
+
+    std::vector<SweepPoint> points(grid.size());
+    std::vector<QrDetector::Prepared> prepared;
+    std::vector<double> prepareMs;
+    std::string groupKey;
+    for (size_t n = 0; n < order.size(); ++n) {
+        const DetectorConfig& cfg = grid[order[n]];
+        cv::setNumThreads(cfg.threads > 0 ? cfg.threads : -1);
+        QrDetector det(cfg);
+
+        std::string key = cv::format("%d|", cfg.threads) + cfg.preprocessKey();
+        if (key != groupKey) {
+            groupKey = key;
+            prepared.assign(frames.size(), QrDetector::Prepared());
+            prepareMs.assign(frames.size(), 0.0);
+            for (size_t f = 0; f < frames.size(); ++f) {
+                double ts = nowMs();
+                det.prepare(frames[f], prepared[f]);
+                prepareMs[f] = nowMs() - ts;
+                // Only scratch buffers need a private copy (untimed): the next
+                // prepare() reuses them. A view of frames[f] stays valid and
+                // thresholded output is already owned by prepared[f].
+                if (det.usesScratch(prepared[f].image)) prepared[f].image = prepared[f].image.clone();
+            }
+        }
+
+        SweepPoint& p = points[order[n]];
+        p.cfg = cfg;
+        det.detectPrepared(prepared[0]); // warm-up
+        double totalMs = 0.0;
+        for (size_t f = 0; f < frames.size(); ++f) {
+            const std::set<std::string>& want = *expected[f];
+            p.expected += want.size();
+            totalMs += cfg.gate > 0.0 ? textureMs[f] : 0.0;
+            if (cfg.gate > 0.0 && texture[f] < cfg.gate) { ++p.gated; continue; }
+
+            double ts = nowMs();
+            std::vector<DetectedCode> codes = det.detectPrepared(prepared[f]);
+            totalMs += prepareMs[f] + (nowMs() - ts);
+
+            std::set<std::string> got;
+            for (size_t k = 0; k < codes.size(); ++k)
+                if (!codes[k].payload.empty()) got.insert(codes[k].payload);
+            for (std::set<std::string>::const_iterator it = got.begin(); it != got.end(); ++it) {
+                if (want.count(*it)) ++p.matched; else ++p.falsePositives;
+            }
+        }
+        p.msPerFrame = totalMs / frames.size();
+        std::cout << cv::format("  [%3zu/%zu] %-80s %8.2f ms  recall %.3f", n + 1, order.size(),
+                                cfg.describe().c_str(), p.msPerFrame, p.recall()) << std::endl;
+    }
+    cv::setNumThreads(-1);
+
+    markPareto(points);
+    if (!writeSweepResults(outPrefix, corpus, frames.size(), points)) {
+        std::cerr << "无法写入 " << outPrefix << ".csv/.json" << std::endl;
+        return 3;
+    }
+    std::cout << "Pareto frontier:" << std::endl;
+    for (size_t i = 0; i < points.size(); ++i)
+        if (points[i].pareto)
+            std::cout << cv::format("  %8.2f ms  recall %.3f  %s", points[i].msPerFrame, points[i].recall(),
+                                    points[i].cfg.describe().c_str()) << std::endl;
+    std::cout << "wrote " << outPrefix << ".csv and " << outPrefix << ".json" << std::endl;
+    return 0;
+}
+// ---- End Pareto sweep ----
+
+// ---- Band scan benchmark ----
+// Compares the band-fused finder scan at several band budgets against the
+// same scan run as separate whole-frame passes (gray plane, binary plane,
+// finder scan) and against OpenCV's cvtColor + adaptiveThreshold. Times
+// are measured; the DRAM column is a traffic model, not a measurement: a
+// fused pass reads the input once (channels B/px), separate passes also
+// write and re-read each intermediate plane (+2 B/px per plane).
+static int runBandBench(const std::string& source) {
+    std::vector<cv::Mat> frames;
+    if (source == "4k") {
+        // Synthetic UHD frame: noise background with scattered finder-like squares.
+        cv::Mat f(2160, 3840, CV_8UC3);
+        cv::randu(f, cv::Scalar::all(60), cv::Scalar::all(200));
+        cv::RNG rng(62);
+        for (int i = 0; i < 24; ++i) {
+            const int m = 6 + rng.uniform(0, 6);
+            const cv::Point o(rng.uniform(0, 3840 - 7 * m), rng.uniform(0, 2160 - 7 * m));
+            cv::rectangle(f, cv::Rect(o.x, o.y, 7 * m, 7 * m), cv::Scalar::all(0), cv::FILLED);
+            cv::rectangle(f, cv::Rect(o.x + m, o.y + m, 5 * m, 5 * m), cv::Scalar::all(255), cv::FILLED);
+            cv::rectangle(f, cv::Rect(o.x + 2 * m, o.y + 2 * m, 3 * m, 3 * m), cv::Scalar::all(0), cv::FILLED);
+        }
+        frames.push_back(f);
+    } else if (!loadSampleFrames(source, 20, frames)) {
+        std::cerr << "无法读取基准图片: " << source << std::endl;
+        return 2;
+    }
+
+    const int kRepeats = 10;
+    double pixels = 0.0;
+    for (size_t i = 0; i < frames.size(); ++i) pixels += frames[i].total();
+    pixels *= kRepeats;
+
+    // Traffic model per input pixel (see above); gray input has no gray plane.
+    const double inBytes = frames[0].channels();
+    const double planes = frames[0].channels() == 3 ? 2.0 : 1.0;
+
+    struct Variant { std::string name; size_t budget; bool separate; double bytesPerPx; };
+    std::vector<Variant> variants;
+    const size_t sizes[] = { 64 * 1024, 256 * 1024, 1024 * 1024 };
+    for (size_t i = 0; i < 3; ++i)
+        variants.push_back(Variant{ cv::format("bands %zu KB", sizes[i] / 1024), sizes[i], false, inBytes });
+    variants.push_back(Variant{ cv::format("bands L2/2 (%zu KB)", BandFinderScanner::defaultBudget() / 1024),
+                                BandFinderScanner::defaultBudget(), false, inBytes });
+    variants.push_back(Variant{ "separate passes", 0, true, inBytes + 2.0 * planes });
+
+    std::cout << cv::format("%zu frame(s), %d repeats, %.1f Mpx per pass", frames.size(), kRepeats,
+                            pixels / kRepeats / 1e6) << std::endl;
+    for (size_t v = 0; v < variants.size(); ++v) {
+        BandFinderScanner scanner(variants[v].budget);
+        auto run = [&](const cv::Mat& f) -> const std::vector<FinderHit>& {
+            return variants[v].separate ? scanner.scanSeparate(f) : scanner.scan(f);
+        };
+        run(frames[0]); // warm-up
+        size_t hits = 0;
+        const int64 c0 = cv::getCPUTickCount();
+        const double t0 = nowMs();
+        for (int r = 0; r < kRepeats; ++r)
+            for (size_t i = 0; i < frames.size(); ++i) hits += run(frames[i]).size();
+        const double ms = nowMs() - t0;
+        const double cpp = (cv::getCPUTickCount() - c0) / pixels;
+        std::cout << cv::format("  %-24s rows/band %5d  %8.2f ms/frame  %6.2f cycles/px  model %.0f B/px DRAM  finders %zu",
+                                variants[v].name.c_str(), scanner.bandRows(), ms / (kRepeats * frames.size()), cpp,
+                                variants[v].bytesPerPx, hits / (kRepeats * frames.size())) << std::endl;
+    }
+
+    // Baseline preprocessing only (no finder scan): what the OpenCV locate path pays up front.
+    cv::Mat gray, bin;
+    const int64 c0 = cv::getCPUTickCount();
+    const double t0 = nowMs();
+    for (int r = 0; r < kRepeats; ++r) {
+        for (size_t i = 0; i < frames.size(); ++i) {
+            if (frames[i].channels() == 3) cv::cvtColor(frames[i], gray, cv::COLOR_BGR2GRAY);
+            else gray = frames[i];
+            cv::adaptiveThreshold(gray, bin, 255, cv::ADAPTIVE_THRESH_MEAN_C, cv::THRESH_BINARY, 31, 6);
+        }
+    }
+    const double ms = nowMs() - t0;
+    std::cout << cv::format("  %-24s %15s %8.2f ms/frame  %6.2f cycles/px  model %.0f B/px DRAM  (no finder scan)",
+                            "cvtColor+adaptiveThr", "", ms / (kRepeats * frames.size()),
+                            (cv::getCPUTickCount() - c0) / pixels, inBytes + 2.0 * planes) << std::endl;
+    return 0;
+}
+// ---- End band scan benchmark ----
+
+// ---- Mirror self-check ----
+// Decodes IMAGE (a normal, dark-on-light code), then its transpose with
+// mirror retries forced on. Passes when the transposed copy yields the same
+// payloads and mirrorRecovered goes up.
+static int runMirrorCheck(const std::string& path, DetectorConfig cfg) {
+    cv::Mat image = cv::imread(path, cv::IMREAD_COLOR);
+    if (image.empty()) {
+        std::cerr << "无法读取图片: " << path << std::endl;
+        return 2;
+    }
+    cfg.mirror = true;
+    QrDetector detector(cfg);
+    std::set<std::string> expected, recovered;
+    const std::vector<DetectedCode> plain = detector.detect(image);
+    for (size_t i = 0; i < plain.size(); ++i)
+        if (!plain[i].payload.empty()) expected.insert(plain[i].payload);
+    if (expected.empty()) {
+        std::cerr << "原图中没有可解码的二维码: " << path << std::endl;
+        return 2;
+    }
+    const uint64_t before = detector.polarityStats().mirrorRecovered;
+    cv::Mat transposed;
+    cv::transpose(image, transposed);
+    const std::vector<DetectedCode> mirrored = detector.detect(transposed);
+    for (size_t i = 0; i < mirrored.size(); ++i)
+        if (!mirrored[i].payload.empty()) recovered.insert(mirrored[i].payload);
+    const uint64_t gained = detector.polarityStats().mirrorRecovered - before;
+    const bool ok = gained > 0 && recovered == expected;
+    std::cout << cv::format("mirror check (%s): %zu payload(s), transposed decoded %zu, mirrorRecovered +%llu: %s",
+                            cfg.describe().c_str(), expected.size(), recovered.size(),
+                            (unsigned long long)gained, ok ? "PASS" : "FAIL") << std::endl;
+    return ok ? 0 : 1;
+}
+// ---- End mirror self-check ----
+
+int main(int argc, char** argv) {
+    // Constants for clarity
+    const int kFrameWidth = 640;
+    const int kFrameHeight = 480;
+    const char* kWindowTitle = "QR Detect";
+
+    // Parse options and optional input source
+    // Usage: ./detector [--list] [--preview-width N] [--preview-fps N]
+    //                   [--record FILE] [--record-fps N] [--snapshot-dir DIR]
+    //                   [--sink-queue N] [--sink-drop oldest|newest]
+    //                   [--headless] [--http-port N] [--http-width N] [--http-fps N]
+    //                   [--detector SPEC] [--shadow SPEC] [--shadow-sample R]
+    //                   [--shadow-log FILE] [--shadow-frames DIR] [0|1]
+    //                   [--autotune SECONDS] [--autotune-sample PATH]
+    //                   [--autotune-tolerance R] [--tune-file FILE]
+    //                   [--sweep CORPUS --truth FILE [--sweep-grid G] [--sweep-out PREFIX]
+    //                    [--sweep-max-frames N]]
+    //                   [--analytics FILE] [--calibration FILE]
+    //                   [--hires WxH] [--hires-burst N] [--hires-cooldown MS]
+    //                   [--bench-bands PATH|4k] [--check-mirror IMAGE]
+    //                   [--linescan STEP] [--linescan-code-rows N] [--linescan-block N]
+    //                   [--linescan-print]   (one line per reported code with its belt row)
+    //                   [--symbologies qr[,barcode]]
+    //                   [--config FILE] [--control SOCKET]   (FILE re-read on SIGHUP)
+    //                   [--no-reconnect]
+    //                   [--fleet 0,1 [--fleet-metrics-port N] [--fleet-timeout-ms MS]]
+    //                                                            (one process per camera)
+    //                   [--journal DIR] [--journal-segment-mb N] [--journal-commit-ms MS]
+    //                   [--journal-query DIR [--payload TEXT] [--from MS] [--to MS]]
+    //                   [--scan-archive VIDEO --index FILE] [--index-query FILE --payload TEXT]
+    //   SPEC is key=value[,key=value...]: backend=classic|aruco, scale=0..1, pyramid=N,
+    //   binarize=none|otsu|adaptive, tiles=N, stripes=N, stripe_batch=K, stripe_overlap=F,
+    //   threads=N, gate=G, locate=opencv|bands, band_kb=N, mirror=0|1
+    int requestedIndex = -1;
+    int previewWidth = 640;
+    double previewFps = 15.0;
+    std::string recordPath;
+    double recordFps = 30.0;
+    std::string snapshotDir;
+    int sinkQueue = 8;
+    DropPolicy sinkDrop = DropPolicy::DropOldest;
+    bool headless = false;
+    int httpPort = 0;           // 0 = no preview stream
+    int httpWidth = 480;
+    double httpFps = 5.0;
+    DetectorConfig detectorCfg;
+    DetectorConfig shadowCfg;
+    bool shadowEnabled = false;
+    double shadowSample = 0.1;
+    std::string shadowLog;
+    std::string shadowFrames;
+    bool detectorGiven = false;
+    double autotuneSeconds = 0.0;   // 0 = no live calibration
+    std::string autotuneSample;
+    double autotuneTolerance = 0.02;
+    std::string tuneFile = "detector_tune.yml";
+    std::string sweepCorpus;
+    std::string benchBands;
+    std::string checkMirror;
+    int lineScanStep = 0;        // 0 = area-camera frames
+    int lineScanCodeRows = 240;
+    int lineScanBlock = 0;       // rows taken from each captured frame, 0 = all
+    bool lineScanPrint = false;
+    std::vector<std::string> extraSymbologies; // besides QR
+    std::string sweepTruth;
+    std::string sweepGrid;
+    std::string sweepOut = "sweep";
+    int sweepMaxFrames = 500;
+    std::string analyticsPath;
+    std::string configPath;      // hot-reloadable settings, see LiveConfig
+    std::string controlPath;     // Unix socket accepting reload/status
+    bool reconnect = true;       // wait for the camera to come back instead of exiting
+    std::vector<int> fleetCameras;   // supervisor mode when non-empty
+    int fleetMetricsPort = 0;
+    int fleetTimeoutMs = 10000;
+    std::string fleetChild;          // set by the supervisor: "SHM:SLOT"
+    int indexArg = -1;               // argv position of the camera index
+    std::string journalDir;
+    double journalSegmentMb = 64.0;
+    double journalCommitMs = 50.0;
+    std::string journalQuery;
+    std::string queryPayload;
+    double queryFromMs = 0.0;
+    double queryToMs = 9e15;
+    std::string scanArchive;
+    std::string indexPath;
+    std::string indexQuery;
+    std::string calibrationPath;
+    cv::Size hiresSize;          // empty = no high-res bursts
+    int hiresBurst = 3;
+    double hiresCooldownMs = 1000.0;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--list") {
+            listCameras(2); // only probe 0 and 1
+            return 0;
+        }
+        if (arg == "--preview-width" && i + 1 < argc) { previewWidth = std::atoi(argv[++i]); continue; }
+        if (arg == "--preview-fps" && i + 1 < argc) { previewFps = std::atof(argv[++i]); continue; }
+        if (arg == "--record" && i + 1 < argc) { recordPath = argv[++i]; continue; }
+        if (arg == "--record-fps" && i + 1 < argc) { recordFps = std::atof(argv[++i]); continue; }
+        if (arg == "--snapshot-dir" && i + 1 < argc) { snapshotDir = argv[++i]; continue; }
+        if (arg == "--sink-queue" && i + 1 < argc) { sinkQueue = std::max(1, std::atoi(argv[++i])); continue; }
+        if (arg == "--fleet" && i + 1 < argc) {
+            std::stringstream ss(argv[++i]);
+            std::string item;
+            while (std::getline(ss, item, ',')) {
+                if (item != "0" && item != "1") {
+                    std::cerr << "--fleet 仅支持摄像头索引 0 或 1." << std::endl;
+                    return 2;
+                }
+                const int camera = std::atoi(item.c_str());
+                if (std::find(fleetCameras.begin(), fleetCameras.end(), camera) != fleetCameras.end()) {
+                    std::cerr << "--fleet 摄像头索引 " << camera << " 重复." << std::endl;
+                    return 2;
+                }
+                fleetCameras.push_back(camera);
+            }
+            continue;
+        }
+        if (arg == "--fleet-metrics-port" && i + 1 < argc) { fleetMetricsPort = std::atoi(argv[++i]); continue; }
+        if (arg == "--fleet-timeout-ms" && i + 1 < argc) { fleetTimeoutMs = std::atoi(argv[++i]); continue; }
+        if (arg == "--fleet-child" && i + 1 < argc) { fleetChild = argv[++i]; continue; }
+        if (arg == "--no-reconnect") { reconnect = false; continue; }
+        if (arg == "--journal" && i + 1 < argc) { journalDir = argv[++i]; continue; }
+        if (arg == "--journal-segment-mb" && i + 1 < argc) { journalSegmentMb = std::atof(argv[++i]); continue; }
+        if (arg == "--journal-commit-ms" && i + 1 < argc) { journalCommitMs = std::atof(argv[++i]); continue; }
+        if (arg == "--journal-query" && i + 1 < argc) { journalQuery = argv[++i]; continue; }
+        if (arg == "--scan-archive" && i + 1 < argc) { scanArchive = argv[++i]; continue; }
+        if (arg == "--index" && i + 1 < argc) { indexPath = argv[++i]; continue; }
+        if (arg == "--index-query" && i + 1 < argc) { indexQuery = argv[++i]; continue; }
+        if (arg == "--payload" && i + 1 < argc) { queryPayload = argv[++i]; continue; }
+        if (arg == "--from" && i + 1 < argc) { queryFromMs = std::atof(argv[++i]); continue; }
+        if (arg == "--to" && i + 1 < argc) { queryToMs = std::atof(argv[++i]); continue; }
+        if (arg == "--headless") { headless = true; continue; }
+        if (arg == "--http-port" && i + 1 < argc) { httpPort = std::atoi(argv[++i]); continue; }
+        if (arg == "--http-width" && i + 1 < argc) { httpWidth = std::atoi(argv[++i]); continue; }
+        if (arg == "--http-fps" && i + 1 < argc) { httpFps = std::atof(argv[++i]); continue; }
+        if ((arg == "--detector" || arg == "--shadow") && i + 1 < argc) {
+            bool isShadow = arg == "--shadow";
+            std::string err;
+            if (!parseDetectorConfig(argv[++i], isShadow ? shadowCfg : detectorCfg, err)) {
+                std::cerr << arg << ": " << err << std::endl;
+                return 2;
+            }
+            if (isShadow) shadowEnabled = true; else detectorGiven = true;
+            continue;
+        }
+        if (arg == "--hires" && i + 1 < argc) {
+            int w = 0, h = 0;
+            if (std::sscanf(argv[++i], "%dx%d", &w, &h) != 2 || w <= 0 || h <= 0) {
+                std::cerr << "--hires 格式应为 WxH, 例如 1920x1080." << std::endl;
+                return 2;
+            }
+            hiresSize = cv::Size(w, h);
+            continue;
+        }
+        if (arg == "--hires-burst" && i + 1 < argc) { hiresBurst = std::atoi(argv[++i]); continue; }
+        if (arg == "--hires-cooldown" && i + 1 < argc) { hiresCooldownMs = std::atof(argv[++i]); continue; }
+        if (arg == "--calibration" && i + 1 < argc) { calibrationPath = argv[++i]; continue; }
+        if (arg == "--analytics" && i + 1 < argc) { analyticsPath = argv[++i]; continue; }
+        if (arg == "--config" && i + 1 < argc) { configPath = argv[++i]; continue; }
+        if (arg == "--control" && i + 1 < argc) { controlPath = argv[++i]; continue; }
+        if (arg == "--linescan" && i + 1 < argc) { lineScanStep = std::max(1, std::atoi(argv[++i])); continue; }
+        if (arg == "--linescan-code-rows" && i + 1 < argc) { lineScanCodeRows = std::max(1, std::atoi(argv[++i])); continue; }
+        if (arg == "--linescan-block" && i + 1 < argc) { lineScanBlock = std::max(0, std::atoi(argv[++i])); continue; }
+        if (arg == "--linescan-print") { lineScanPrint = true; continue; }
+        if (arg == "--symbologies" && i + 1 < argc) {
+            std::stringstream ss(argv[++i]);
+            std::string name;
+            while (std::getline(ss, name, ',')) {
+                if (name.empty() || name == "qr") continue;
+                if (!MultiSymbologyDetector::supported(name)) {
+                    std::cerr << "不支持的码制: " << name << " (可用: qr"
+                              << (MultiSymbologyDetector::supported("barcode") ? ", barcode" : "") << ")" << std::endl;
+                    return 2;
+                }
+                extraSymbologies.push_back(name);
+            }
+            continue;
+        }
+        if (arg == "--bench-bands" && i + 1 < argc) { benchBands = argv[++i]; continue; }
+        if (arg == "--check-mirror" && i + 1 < argc) { checkMirror = argv[++i]; continue; }
+        if (arg == "--sweep" && i + 1 < argc) { sweepCorpus = argv[++i]; continue; }
+        if (arg == "--truth" && i + 1 < argc) { sweepTruth = argv[++i]; continue; }
+        if (arg == "--sweep-grid" && i + 1 < argc) { sweepGrid = argv[++i]; continue; }
+        if (arg == "--sweep-out" && i + 1 < argc) { sweepOut = argv[++i]; continue; }
+        if (arg == "--sweep-max-frames" && i + 1 < argc) { sweepMaxFrames = std::max(1, std::atoi(argv[++i])); continue; }
+        if (arg == "--autotune" && i + 1 < argc) { autotuneSeconds = std::atof(argv[++i]); continue; }
+        if (arg == "--autotune-sample" && i + 1 < argc) { autotuneSample = argv[++i]; continue; }
+        if (arg == "--autotune-tolerance" && i + 1 < argc) { autotuneTolerance = std::atof(argv[++i]); continue; }
+        if (arg == "--tune-file" && i + 1 < argc) { tuneFile = argv[++i]; continue; }
+        if (arg == "--shadow-sample" && i + 1 < argc) { shadowSample = std::atof(argv[++i]); continue; }
+        if (arg == "--shadow-log" && i + 1 < argc) { shadowLog = argv[++i]; continue; }
+        if (arg == "--shadow-frames" && i + 1 < argc) { shadowFrames = argv[++i]; continue; }
+        if (arg == "--sink-drop" && i + 1 < argc) {
+            std::string p = argv[++i];
+            if (p != "oldest" && p != "newest") {
+                std::cerr << "--sink-drop 仅支持 oldest 或 newest." << std::endl;
+                return 2;
+            }
+            sinkDrop = (p == "newest") ? DropPolicy::DropNewest : DropPolicy::DropOldest;
+            continue;
+        }
+
+        bool numeric = !arg.empty() &&
+                       std::all_of(arg.begin(), arg.end(), [](unsigned char c){ return std::isdigit(c); });
+        if (!numeric) {
+            std::cerr << "仅支持摄像头索引 0 或 1 (不支持图片/视频路径)." << std::endl;
+            return 2;
+        }
+        requestedIndex = std::stoi(arg);
+        indexArg = i;
+        if (requestedIndex < 0 || requestedIndex > 1) {
+            std::cerr << "无效的摄像头索引 " << requestedIndex
+                      << ". 仅支持 0 或 1." << std::endl;
+            return 2;
+        }
+    }
+
+    // Supervisor: children get the same options minus the camera index and
+    // the endpoints only one process can own.
+    if (!fleetCameras.empty()) {
+        if (static_cast<int>(fleetCameras.size()) > kFleetMaxSlots) {
+            std::cerr << "--fleet 最多 " << kFleetMaxSlots << " 个摄像头." << std::endl;
+            return 2;
+        }
+        std::vector<std::string> childArgs;
+        for (int i = 1; i < argc; ++i) {
+            const std::string a = argv[i];
+            if (i == indexArg) continue;
+            if (a == "--fleet" || a == "--fleet-metrics-port" || a == "--fleet-timeout-ms" || a == "--http-port" ||
+                a == "--control") {
+                ++i;
+                continue;
+            }
+            childArgs.push_back(a);
+        }
+        // The default tune file would be shared by every camera: name it
+        // explicitly so each child gets its own copy.
+        if (std::find(childArgs.begin(), childArgs.end(), "--tune-file") == childArgs.end()) {
+            childArgs.push_back("--tune-file");
+            childArgs.push_back(tuneFile);
+        }
+        signal(SIGINT, handleSignal);
+        signal(SIGTERM, handleSignal);
+        FleetSupervisor supervisor(fleetCameras, childArgs, fleetMetricsPort, fleetTimeoutMs);
+        return supervisor.run();
+    }
+    std::unique_ptr<FleetReporter> fleetReporter;
+    if (!fleetChild.empty()) {
+        fleetReporter.reset(new FleetReporter());
+        if (!fleetReporter->open(fleetChild)) {
+            std::cerr << "无法连接共享内存 " << fleetChild << std::endl;
+            return 4;
+        }
+    }
+
+    // Offline modes: no camera needed.
+    if (!journalQuery.empty()) return runJournalQuery(journalQuery, queryPayload, queryFromMs, queryToMs);
+    if (!indexQuery.empty()) {
+        if (queryPayload.empty()) {
+            std::cerr << "--index-query 需要 --payload TEXT." << std::endl;
+            return 2;
+        }
+        return runIndexQuery(indexQuery, queryPayload);
+    }
+    if (!scanArchive.empty()) {
+        if (indexPath.empty()) {
+            std::cerr << "--scan-archive 需要 --index FILE." << std::endl;
+            return 2;
+        }
+        signal(SIGINT, handleSignal);
+        return runArchiveScan(scanArchive, indexPath, detectorCfg);
+    }
+    if (!benchBands.empty()) return runBandBench(benchBands);
+    if (!checkMirror.empty()) return runMirrorCheck(checkMirror, detectorCfg);
+    if (lineScanStep > 0 && !hiresSize.empty()) {
+        std::cerr << "--linescan 不能与 --hires 同时使用." << std::endl;
+        return 2;
+    }
+    if (!sweepCorpus.empty()) {
+        if (sweepTruth.empty()) {
+            std::cerr << "--sweep 需要 --truth FILE." << std::endl;
+            return 2;
+        }
+        return runSweep(sweepCorpus, sweepTruth, sweepGrid, sweepOut, static_cast<size_t>(sweepMaxFrames));
+    }
+
+    cv::VideoCapture cap;
+    int cameraIndex = requestedIndex;
+
+    if (requestedIndex >= 0) {
+        if (!tryOpenCamera(requestedIndex, cap, kFrameWidth, kFrameHeight)) {
+            std::cerr << "无法打开摄像头索引 " << requestedIndex
+                      << " (仅支持 0 或 1)." << std::endl;
+            return 3;
+        }
+    } else {
+        // No argument: try 0 then 1 only
+        int indices[2] = {0,1};
+        bool opened = false;
+        for (int idx : indices) {
+            if (tryOpenCamera(idx, cap, kFrameWidth, kFrameHeight)) { opened = true; cameraIndex = idx; break; }
+        }
+        if (!opened) {
+            std::cerr << "无法打开摄像头 (仅尝试 /dev/video0 与 /dev/video1).\n"
+                      << "提示:\n"
+                      << "  1) 运行: ./detector --list 查看可用设备 (仅列出 0,1)\n"
+                      << "  2) 指定: ./detector 0  或  ./detector 1\n"
+                      << "  3) 现在已不支持文件/图片/URL 输入\n";
+            return 1;
+        }
+    }
+
+    // Detector configuration: --detector wins, then a fresh calibration,
+    // then a warm start from the last persisted calibration.
+    const cv::Size frameSize(static_cast<int>(cap.get(cv::CAP_PROP_FRAME_WIDTH)),
+                             static_cast<int>(cap.get(cv::CAP_PROP_FRAME_HEIGHT)));
+    if (!detectorGiven && (autotuneSeconds > 0.0 || !autotuneSample.empty())) {
+        std::vector<cv::Mat> sample;
+        if (!autotuneSample.empty()) {
+            if (!loadSampleFrames(autotuneSample, 60, sample)) {
+                std::cerr << "无法读取标定样本 " << autotuneSample << std::endl;
+                return 2;
+            }
+        } else {
+            if (fleetReporter) fleetReporter->beat(FLEET_TUNING);
+            std::cout << "autotune: capturing " << autotuneSeconds << " s of frames..." << std::endl;
+            captureSampleFrames(cap, autotuneSeconds, 60, sample);
+        }
+        if (!sample.empty()) {
+            if (fleetReporter) fleetReporter->beat(FLEET_TUNING);
+            std::cout << "autotune: " << sample.size() << " frames" << std::endl;
+            double t0 = nowMs();
+            TuneResult best = autoTune(sample, autotuneTolerance);
+            detectorCfg = best.cfg;
+            std::cout << cv::format("autotune: picked %s (%.2f ms, decoded %d) in %.1f s",
+                                    best.cfg.describe().c_str(), best.msPerFrame, best.decoded,
+                                    (nowMs() - t0) / 1000.0) << std::endl;
+            if (!tuneFile.empty() && !saveTune(tuneFile, best, frameSize))
+                std::cerr << "无法写入 " << tuneFile << std::endl;
+        }
+    } else if (!detectorGiven && !tuneFile.empty() && loadTune(tuneFile, frameSize, detectorCfg)) {
+        std::cout << "warm start from " << tuneFile << ": " << detectorCfg.describe() << std::endl;
+    }
+
+    // QR code detector
+    if (detectorCfg.threads > 0) cv::setNumThreads(detectorCfg.threads);
+    QrDetector qrDetector(detectorCfg);
+    if (detectorCfg.stripes > 1) {
+        std::cout << cv::format("stripe scan: %.0f%% of a full locate pass per frame, every row revisited "
+                                "within %d frames", 100.0 * detectorCfg.stripeBudget(),
+                                (detectorCfg.stripes + detectorCfg.stripeBatch - 1) / detectorCfg.stripeBatch)
+                  << std::endl;
+    }
+    std::shared_ptr<LensModel> lens;
+    if (!calibrationPath.empty()) {
+        lens.reset(new LensModel());
+        std::string err;
+        if (!lens->load(calibrationPath, frameSize, err)) {
+            std::cerr << "--calibration: " << err << std::endl;
+            return 2;
+        }
+        qrDetector.setLens(lens);
+    }
+
+    std::unique_ptr<MultiSymbologyDetector> symbologies;
+    if (!extraSymbologies.empty()) symbologies.reset(new MultiSymbologyDetector(qrDetector, extraSymbologies));
+
+    // Shadow detector only observes; it never drives outputs.
+    std::unique_ptr<ShadowRunner> shadow;
+    if (shadowEnabled) {
+        shadow.reset(new ShadowRunner(shadowCfg, shadowSample, shadowLog, shadowFrames));
+        shadow->start();
+        std::cout << "shadow: " << shadowCfg.describe() << " vs primary " << detectorCfg.describe()
+                  << " on " << shadowSample * 100.0 << "% of frames" << std::endl;
+    }
+
+    Mat frame;
+
+    // Enable terminal key handling with RAII
+    TerminalRawGuard terminalGuard;
+
+    // Register signal handlers for clean exit (restores terminal)
+    signal(SIGINT, handleSignal);
+    signal(SIGTERM, handleSignal);
+    signal(SIGHUP, configPath.empty() ? handleSignal : handleReloadSignal);
+
+    // Display runs on its own thread; the loop below never touches HighGUI.
+    std::unique_ptr<PreviewDisplay> display;
+    if (!headless) {
+        display.reset(new PreviewDisplay(kWindowTitle, previewWidth, previewFps));
+        display->start();
+    }
+
+    std::unique_ptr<MjpegServer> stream;
+    if (httpPort > 0) {
+        stream.reset(new MjpegServer(httpPort, httpWidth, httpFps, 75));
+        if (!stream->start()) {
+            std::cerr << "无法监听 127.0.0.1:" << httpPort << " (" << std::strerror(errno) << ")" << std::endl;
+            return 4;
+        }
+        std::cout << "MJPEG preview: http://127.0.0.1:" << httpPort << "/stream" << std::endl;
+    }
+
+    // Media sinks encode on their own threads; the loop only enqueues.
+    std::unique_ptr<VideoRecorderSink> recorder;
+    std::unique_ptr<SnapshotSink> snapshots;
+    if (!recordPath.empty()) {
+        recorder.reset(new VideoRecorderSink(recordPath, recordFps, sinkQueue, sinkDrop));
+        recorder->start();
+    }
+    if (!snapshotDir.empty()) {
+        snapshots.reset(new SnapshotSink(snapshotDir, 90, sinkQueue, sinkDrop));
+        snapshots->start();
+    }
+
+    // Diagnostics run on sampled frames on their own worker.
+    std::unique_ptr<QualityAnalytics> analytics;
+    if (!analyticsPath.empty()) {
+        analytics.reset(new QualityAnalytics(2));
+        analytics->start();
+    }
+
+    std::unique_ptr<HiResBurst> hires;
+    if (!hiresSize.empty()) hires.reset(new HiResBurst(cap, cameraIndex, frameSize, hiresSize, hiresBurst, hiresCooldownMs));
+
+    std::unique_ptr<LineScanBuffer> lineScan;
+    if (lineScanStep > 0) {
+        lineScan.reset(new LineScanBuffer(lineScanStep, lineScanCodeRows));
+        std::cout << cv::format("line scan: pass every %d rows, overlap for codes up to %d rows",
+                                lineScanStep, lineScanCodeRows) << std::endl;
+    }
+
+    std::unique_ptr<CameraHotplug> hotplug;
+    if (reconnect) {
+        hotplug.reset(new CameraHotplug(cameraIndex, kFrameWidth, kFrameHeight));
+        if (!hotplug->start()) {
+            std::cerr << "inotify 不可用, 摄像头断开时将直接退出 (" << std::strerror(errno) << ")" << std::endl;
+            hotplug.reset();
+        }
+    }
+
+    std::unique_ptr<ScanJournal> journal;
+    if (!journalDir.empty()) {
+        journal.reset(new ScanJournal(journalDir, cameraIndex,
+                                      static_cast<size_t>(journalSegmentMb * 1024 * 1024), journalCommitMs));
+        std::string err;
+        if (!journal->open(err)) {
+            std::cerr << "--journal: " << err << std::endl;
+            return 4;
+        }
+    }
+
+    CodeTracker tracker;
+    long long frameIndex = 0;
+    FpsStats stats;
+    
+    // Live settings; the base is what the command line asked for.
+    LiveConfig live;
+    live.detector = detectorCfg;
+    live.recordPath = recordPath;
+    live.recordFps = recordFps;
+    live.snapshotDir = snapshotDir;
+    live.previewFps = previewFps;
+    live.httpFps = httpFps;
+    std::unique_ptr<ConfigReloader> reloader;
+    if (!configPath.empty()) {
+        reloader.reset(new ConfigReloader(configPath, live, controlPath));
+        std::string err;
+        if (!reloader->loadInitial(err)) {
+            std::cerr << "--config: " << err << std::endl;
+            return 2;
+        }
+        if (!reloader->start()) {
+            std::cerr << "无法监听控制套接字 " << controlPath << " (" << std::strerror(errno) << ")" << std::endl;
+            return 4;
+        }
+    } else if (!controlPath.empty()) {
+        std::cerr << "--control 需要 --config FILE." << std::endl;
+        return 2;
+    }
+    // Sinks replaced by a reload drain and close on their own threads.
+    std::vector<std::thread> retiring;
+    auto retire = [&retiring](AsyncSink* sink) {
+        retiring.push_back(std::thread([sink] {
+            sink->stop();
+            AsyncSink::Counters c = sink->counters();
+            std::cout << cv::format("%s sink (replaced by reload): offered %llu, written %llu, dropped %llu, failed %llu",
+                                    sink->name().c_str(), (unsigned long long)c.offered,
+                                    (unsigned long long)c.written, (unsigned long long)c.dropped,
+                                    (unsigned long long)c.failed) << std::endl;
+            delete sink;
+        }));
+    };
+
+    while (true) {
+        // Reconfigure between frames; the camera and workers stay up.
+        if (reloader) {
+            if (g_reload_request) {
+                g_reload_request = 0;
+                reloader->request();
+            }
+            double requestedAt = 0.0;
+            std::shared_ptr<const LiveConfig> next = reloader->take(requestedAt);
+            if (next) {
+                const double t0 = nowMs();
+                if (next->detector.describe() != live.detector.describe()) {
+                    qrDetector.reconfigure(next->detector);
+                    cv::setNumThreads(next->detector.threads > 0 ? next->detector.threads : -1);
+                }
+                if (next->recordPath != live.recordPath || next->recordFps != live.recordFps || !recorder) {
+                    if (recorder) retire(recorder.release());
+                    if (!next->recordPath.empty()) {
+                        recorder.reset(new VideoRecorderSink(next->recordPath, next->recordFps, sinkQueue, sinkDrop));
+                        recorder->start();
+                    }
+                }
+                if (next->snapshotDir != live.snapshotDir || !snapshots) {
+                    if (snapshots) retire(snapshots.release());
+                    if (!next->snapshotDir.empty()) {
+                        snapshots.reset(new SnapshotSink(next->snapshotDir, 90, sinkQueue, sinkDrop));
+                        snapshots->start();
+                    }
+                }
+                if (display) display->setMaxFps(next->previewFps);
+                if (stream) stream->setMaxFps(next->httpFps);
+                live = *next;
+                const double now = nowMs();
+                reloader->markApplied(live.version, now - requestedAt);
+                std::cout << cv::format("config v%d applied: reload latency %.1f ms (apply %.2f ms) %s, %zu roi(s)",
+                                        live.version, now - requestedAt, now - t0,
+                                        live.detector.describe().c_str(), live.rois.size()) << std::endl;
+            }
+        }
+
+        double start = nowMs(); // start timing this frame
+
+        if (!cap.read(frame) || frame.empty()) {
+            auto quit = [&display, &fleetReporter] {
+                if (fleetReporter) fleetReporter->beat(FLEET_RECONNECTING);
+                return exitRequested(display ? display->takeKey() : -1);
+            };
+            if (hotplug && hotplug->reconnect(cap, quit)) continue;
+            break;
+        }
+        if (hires && hires->consume(frame)) {
+            if (hires->failed()) break;
+            if (exitRequested(display ? display->takeKey() : -1)) break;
+            continue;
+        }
+
+        long long firstRow = 0;
+        if (lineScan) {
+            // The driver delivers each block as a short frame; an area camera
+            // can stand in by taking its centre rows.
+            const int take = lineScanBlock > 0 ? std::min(lineScanBlock, frame.rows) : frame.rows;
+            lineScan->append(frame.rowRange((frame.rows - take) / 2, (frame.rows - take) / 2 + take));
+            if (!lineScan->ready()) {
+                if (exitRequested(display ? display->takeKey() : -1)) break;
+                continue;
+            }
+            frame = lineScan->window(firstRow);
+        }
+
+        double detectStart = nowMs();
+        const std::vector<cv::Rect> regions = lineScan ? std::vector<cv::Rect>() : tracker.regions();
+        auto runDetect = [&](const cv::Mat& image, const std::vector<cv::Rect>& r) {
+            return symbologies ? symbologies->detect(image, r) : qrDetector.detect(image, r);
+        };
+        std::vector<DetectedCode> codes;
+        if (live.rois.empty() || lineScan) {
+            codes = runDetect(frame, regions);
+        } else {
+            // Configured ROIs only; tracked regions are whole-frame hints and do not apply.
+            const cv::Rect bounds(0, 0, frame.cols, frame.rows);
+            for (size_t r = 0; r < live.rois.size(); ++r) {
+                const cv::Rect roi = live.rois[r] & bounds;
+                if (roi.empty()) continue;
+                std::vector<DetectedCode> part = runDetect(frame(roi), std::vector<cv::Rect>());
+                for (size_t i = 0; i < part.size(); ++i) {
+                    for (int k = 0; k < 4; ++k) part[i].quad[k] += cv::Point2f((float)roi.x, (float)roi.y);
+                    codes.push_back(part[i]);
+                }
+            }
+        }
+        double detectMs = nowMs() - detectStart;
+        if (lineScan) {
+            std::vector<long long> rows;
+            codes = lineScan->commit(codes, firstRow, lineScanPrint ? &rows : nullptr);
+            if (lineScanPrint && !codes.empty()) {
+                // One buffered write per pass, no flush: the pass must not wait on the terminal.
+                std::string out;
+                for (size_t i = 0; i < codes.size(); ++i)
+                    out += cv::format("line scan: row %lld ", rows[i]) + codes[i].payload + "\n";
+                std::cout << out;
+            }
+            // Consumers outlive this pass; the ring rows will be overwritten.
+            frame = frame.clone();
+        }
+        if (hires) hires->update(codes);
+        std::vector<TrackEvent> events = tracker.update(codes);
+        ++frameIndex;
+        
+        double dur = nowMs() - start;
+        double avgMs = stats.updateAvgMs(dur);
+        double fps = stats.tickFps();
+        if (journal) journal->append(codes, wallClockMs());
+        if (fleetReporter)
+            fleetReporter->frame(avgMs, fps, codes.size(), hotplug ? hotplug->stats().outages : 0, events);
+
+        // Consumers share the frame buffer; once any of them holds it, drop
+        // our handle so the next cap.read() allocates instead of overwriting.
+        bool shared = false;
+
+        if (shadow && shadow->wants() && shadow->submit(frame, codes, detectMs, frameIndex))
+            shared = true;
+
+        const bool analyze = analytics && !codes.empty();
+        if (recorder || analyze || (snapshots && hasAppeared(events))) {
+            SinkItem item;
+            item.frame = frame;
+            item.codes = codes;
+            item.events = events;
+            item.timestampMs = wallClockMs();
+            item.frameIndex = frameIndex;
+            if (recorder) recorder->offer(item);
+            if (snapshots && hasAppeared(events)) snapshots->offer(item);
+            if (analyze) analytics->offer(item);
+            shared = true;
+        }
+
+        // Overlays are drawn by the preview consumers on the downscaled image.
+        bool showDue = display && display->due();
+        bool streamDue = stream && stream->due();
+        if (showDue || streamDue) {
+            std::string statsText = cv::format("avg %.2f ms  fps %.1f  QR %d",
+                               avgMs, fps, static_cast<int>(codes.size()));
+            if (showDue) display->publish(frame, codes, statsText);
+            if (streamDue) stream->publish(frame, codes, statsText);
+            shared = true;
+        }
+        if (shared) frame.release();
+
+        if (exitRequested(display ? display->takeKey() : -1)) break;
+    }
+
+    // Terminal restored automatically by TerminalRawGuard
+    if (journal) {
+        journal->stop();
+        const ScanJournal::Stats js = journal->stats();
+        const double b = js.batches ? static_cast<double>(js.batches) : 1.0;
+        std::cout << cv::format("journal: %llu events in %llu group commits (%.1f per commit, %.2f ms avg, "
+                                "%.2f ms max), %.1f MB, %llu segment(s) opened, %llu dropped, %llu failed commit(s)",
+                                (unsigned long long)js.events, (unsigned long long)js.batches, js.events / b,
+                                js.commitMsTotal / b, js.commitMsMax, js.bytes / (1024.0 * 1024.0),
+                                (unsigned long long)js.segments, (unsigned long long)js.dropped,
+                                (unsigned long long)js.failedCommits) << std::endl;
+    }
+    if (hotplug && hotplug->stats().outages) {
+        const CameraHotplug::Stats& hs = hotplug->stats();
+        std::cout << cv::format("camera: %llu outage(s), %.0f ms total, longest %.0f ms",
+                                (unsigned long long)hs.outages, hs.totalMs, hs.longestMs) << std::endl;
+    }
+    if (reloader) {
+        reloader->stop();
+        std::cout << "config: ran with version " << live.version << std::endl;
+    }
+    for (size_t i = 0; i < retiring.size(); ++i) retiring[i].join();
+    if (lineScan) {
+        const LineScanBuffer::Stats& ls = lineScan->stats();
+        std::cout << cv::format("line scan: %llu rows, %llu passes, %llu codes reported, %llu deferred, "
+                                "%llu overlap duplicates suppressed, %llu rows dropped, ring %.1f MB",
+                                ls.rows, ls.passes, ls.reported, ls.deferred, ls.duplicates, ls.droppedRows,
+                                lineScan->bytes() / (1024.0 * 1024.0)) << std::endl;
+    }
+    if (hires) {
+        const HiResBurst::Stats& hs = hires->stats();
+        double n = hs.triggers ? static_cast<double>(hs.triggers) : 1.0;
+        std::cout << cv::format("hires: %llu bursts, %llu recovered (%.0f%%), %llu switch failures, "
+                                "%llu reopens, switch up %.1f ms, down %.1f ms, burst %.1f ms avg",
+                                (unsigned long long)hs.triggers, (unsigned long long)hs.recovered,
+                                100.0 * hs.recovered / n, (unsigned long long)hs.switchFailures,
+                                (unsigned long long)hs.reopens,
+                                hs.upMsTotal / n, hs.downMsTotal / n, hs.burstMsTotal / n) << std::endl;
+        if (hs.disabled) std::cout << "hires: bursts disabled after failing to switch back to low resolution" << std::endl;
+    }
+    if (lens) {
+        const QrDetector::UndistortStats& us = qrDetector.undistortStats();
+        std::cout << cv::format("undistort: retried %llu, recovered %llu, skipped %llu (size mismatch), "
+                                "%.2f ms avg per retry, %zu/%zu map tiles built",
+                                (unsigned long long)us.retried, (unsigned long long)us.recovered,
+                                (unsigned long long)us.skipped, us.retried ? us.totalMs / us.retried : 0.0,
+                                lens->tilesBuilt(), lens->tilesTotal()) << std::endl;
+    }
+    if (symbologies) symbologies->printSummary(std::cout);
+    {
+        const QrDetector::PolarityStats& ps = qrDetector.polarityStats();
+        if (ps.invertedRegions || ps.mirrorRetried)
+            std::cout << cv::format("polarity: %llu inverted regions, mirror retried %llu, recovered %llu",
+                                    (unsigned long long)ps.invertedRegions, (unsigned long long)ps.mirrorRetried,
+                                    (unsigned long long)ps.mirrorRecovered) << std::endl;
+        const FinderGroupStats& gs = qrDetector.groupStats();
+        if (gs.hits)
+            std::cout << cv::format("finder grouping: %llu hits, %llu regions, %llu partner candidates over the cap",
+                                    (unsigned long long)gs.hits, (unsigned long long)gs.regions,
+                                    (unsigned long long)gs.droppedPartners) << std::endl;
+    }
+    if (shadow) {
+        shadow->stop();
+        ShadowRunner::Summary sh = shadow->summary();
+        double n = sh.sampled ? static_cast<double>(sh.sampled) : 1.0;
+        std::cout << cv::format("shadow: sampled %llu (skipped busy %llu), agree %llu, disagree %llu\n"
+                                "  primary %s: %.2f ms avg, %llu decoded\n"
+                                "  shadow  %s: %.2f ms avg, %llu decoded",
+                                (unsigned long long)sh.sampled, (unsigned long long)sh.skippedBusy,
+                                (unsigned long long)sh.agree, (unsigned long long)sh.disagree,
+                                detectorCfg.describe().c_str(), sh.primaryMsTotal / n,
+                                (unsigned long long)sh.primaryDecoded,
+                                shadow->config().describe().c_str(), sh.shadowMsTotal / n,
+                                (unsigned long long)sh.shadowDecoded) << std::endl;
+    }
+    if (stream) {
+        stream->stop();
+        std::cout << "mjpeg stream: encoded " << stream->framesEncoded() << " frames, rejected "
+                  << stream->rejectedClients() << " connection(s) over the limit" << std::endl;
+    }
+    if (display) display->stop();
+    AsyncSink* sinks[3] = { recorder.get(), snapshots.get(), analytics.get() };
+    for (AsyncSink* sink : sinks) {
+        if (!sink) continue;
+        sink->stop();
+        AsyncSink::Counters c = sink->counters();
+        std::cout << cv::format("%s sink: offered %llu, written %llu, dropped %llu, failed %llu",
+                                sink->name().c_str(), (unsigned long long)c.offered,
+                                (unsigned long long)c.written, (unsigned long long)c.dropped,
+                                (unsigned long long)c.failed) << std::endl;
+    }
+    if (analytics) {
+        analytics->printSummary(std::cout);
+        if (!analytics->exportJson(analyticsPath))
+            std::cerr << "无法写入 " << analyticsPath << std::endl;
+    }
+    if (display) {
+        LabelCache::Stats ls = display->labelStats();
+        std::cout << cv::format("label cache: %zu entries, hits %llu, misses %llu, evictions %llu (%.1f%% hit)",
+                                ls.entries, (unsigned long long)ls.hits, (unsigned long long)ls.misses,
+                                (unsigned long long)ls.evictions, 100.0 * ls.hitRate()) << std::endl;
+    }
+    cap.release();
+    return hires && hires->failed() ? 4 : 0;
+}
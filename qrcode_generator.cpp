@@ -1,4 +1,5 @@
-// Interactive QR code generator with GUI and hotkeys (libqrencode backend)
+// Interactive QR code generator with GUI and hotkeys (libqrencode backend).
+// --batch generates codes headlessly from a CSV/TSV file or stdin.
 
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgcodecs.hpp>
@@ -6,11 +7,32 @@
 
 #include <qrencode.h>
 
+#include <cctype>
 #include <cstdlib>
 #include <ctime>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <functional>
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <set>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace cv;
 
@@ -24,9 +46,10 @@ struct State {
     int quietZone;             // modules
     bool showHelp;
     std::string defaultOut;    // optional save path
+    bool pngBilevel;           // .png as 1-bit, one pixel per module
 
     State()
-        : text("Hello, QR!"), version(0), eclIdx(1), scale(15), quietZone(7), showHelp(false) {}
+        : text("Hello, QR!"), version(0), eclIdx(1), scale(15), quietZone(7), showHelp(false), pngBilevel(false) {}
 };
 
 static inline QRecLevel eclFromIdx(int idx) {
@@ -42,40 +65,198 @@ static inline std::string eclName(int idx) {
     return names[clampi(idx,0,3)];
 }
 
-static Mat renderQR(const State& s) {
+static QRcode* encodeQR(const State& s) {
+    if (s.text.empty()) return nullptr;
+    return QRcode_encodeString(s.text.c_str(), s.version, eclFromIdx(s.eclIdx), QR_MODE_8, 1);
+}
+
+// Side length in pixels of the bordered, scaled symbol.
+static inline int rasterSide(int width, int quietZone, int scale) {
+    return (width + 2 * std::max(0, quietZone)) * std::max(1, scale);
+}
+static inline int rasterSide(const QRcode* code, int quietZone, int scale) {
+    return rasterSide(code->width, quietZone, scale);
+}
+
+// Writes the symbol straight into `dst` (rasterSide() square, 8UC1 or
+// 8UC3, may be a ROI of a larger canvas). Each module row is expanded once
+// into the first of its `scale` pixel rows, runs of equal modules filled
+// with memset (modules are black or white, so this works for any channel
+// count), and then copied to the remaining rows with memcpy. No temporary
+// images.
+static void rasterizeQR(const unsigned char* data, int w, int quietZone, int scale, Mat& dst) {
+    const int qz = std::max(0, quietZone);
+    const int sc = std::max(1, scale);
+    const size_t px = dst.elemSize();
+    const size_t rowBytes = static_cast<size_t>(dst.cols) * px;
+    const size_t modBytes = static_cast<size_t>(sc) * px;
+    CV_Assert(dst.depth() == CV_8U && dst.cols == rasterSide(w, qz, sc) && dst.rows == dst.cols);
+
+    const int border = qz * sc;
+    for (int y = 0; y < border; ++y) {
+        std::memset(dst.ptr<uchar>(y), 255, rowBytes);
+        std::memset(dst.ptr<uchar>(dst.rows - 1 - y), 255, rowBytes);
+    }
+    for (int my = 0; my < w; ++my) {
+        const unsigned char* src = data + static_cast<size_t>(my) * w;
+        uchar* row = dst.ptr<uchar>(border + my * sc);
+        std::memset(row, 255, border * px);
+        uchar* out = row + border * px;
+        for (int mx = 0; mx < w;) {
+            const unsigned char dark = src[mx] & 0x01; // LSB = dark module
+            int run = 1;
+            while (mx + run < w && (src[mx + run] & 0x01) == dark) ++run;
+            std::memset(out, dark ? 0 : 255, run * modBytes);
+            out += run * modBytes;
+            mx += run;
+        }
+        std::memset(out, 255, border * px);
+        for (int k = 1; k < sc; ++k) std::memcpy(dst.ptr<uchar>(border + my * sc + k), row, rowBytes);
+    }
+}
+static void rasterizeQR(const QRcode* code, int quietZone, int scale, Mat& dst) {
+    rasterizeQR(code->data, code->width, quietZone, scale, dst);
+}
+
+// `ok` (optional) is false when a placeholder is returned instead of a code.
+static Mat renderQR(const State& s, bool* ok = nullptr) {
+    if (ok) *ok = false;
     if (s.text.empty()) {
         return Mat(240, 240, CV_8UC1, Scalar(255));
     }
 
-    QRcode* code = QRcode_encodeString(s.text.c_str(), s.version, eclFromIdx(s.eclIdx), QR_MODE_8, 1);
+    QRcode* code = encodeQR(s);
     if (!code) {
         return Mat(240, 240, CV_8UC1, Scalar(200));
     }
-    const int w = code->width; // modules
-    const unsigned char* data = code->data;
+    if (ok) *ok = true;
+    const int side = rasterSide(code, s.quietZone, s.scale);
+    Mat out(side, side, CV_8UC1);
+    rasterizeQR(code, s.quietZone, s.scale, out);
+    QRcode_free(code);
+    return out;
+}
 
-    Mat modules(w, w, CV_8UC1, Scalar(255));
-    for (int y = 0; y < w; ++y) {
-        for (int x = 0; x < w; ++x) {
-            // data bit: LSB of each byte indicates dark module
-            unsigned char b = data[y * w + x];
-            bool dark = (b & 0x01) != 0;
-            modules.at<unsigned char>(y, x) = dark ? 0 : 255;
+// Small LRU map: most recent at the front of `order_`. `cost` lets callers
+// bound the total by bytes instead of by entry count.
+template <typename V>
+class LruCache {
+public:
+    explicit LruCache(size_t budget) : budget_(budget) {}
+
+    const V* find(const std::string& key) {
+        auto it = index_.find(key);
+        if (it == index_.end()) { ++misses_; return nullptr; }
+        ++hits_;
+        order_.splice(order_.begin(), order_, it->second);
+        return &it->second->value;
+    }
+
+    void put(const std::string& key, const V& value, size_t cost = 1) {
+        if (cost > budget_) return; // would evict everything for one entry
+        auto old = index_.find(key);
+        if (old != index_.end()) { // raced with another filler: keep the newer value
+            used_ -= old->second->cost;
+            order_.erase(old->second);
+        }
+        order_.push_front(Entry{key, value, cost});
+        index_[key] = order_.begin();
+        used_ += cost;
+        while (used_ > budget_) {
+            used_ -= order_.back().cost;
+            index_.erase(order_.back().key);
+            order_.pop_back();
         }
     }
-    QRcode_free(code);
 
-    int qz = std::max(0, s.quietZone);
-    Mat bordered(w + 2*qz, w + 2*qz, CV_8UC1, Scalar(255));
-    modules.copyTo(bordered(Rect(qz, qz, w, w)));
+    size_t hits() const { return hits_; }
+    size_t misses() const { return misses_; }
+    double hitRate() const { return hits_ + misses_ ? 100.0 * hits_ / (hits_ + misses_) : 0.0; }
 
-    int sc = std::max(1, s.scale);
-    Mat up;
-    resize(bordered, up, Size(bordered.cols*sc, bordered.rows*sc), 0, 0, INTER_NEAREST);
-    return up;
-}
+private:
+    struct Entry {
+        std::string key;
+        V value;
+        size_t cost;
+    };
+    const size_t budget_;
+    size_t used_ = 0;
+    size_t hits_ = 0, misses_ = 0;
+    std::list<Entry> order_;
+    std::unordered_map<std::string, typename std::list<Entry>::iterator> index_;
+};
+
+// Encoded module matrix, owned (the QRcode is freed right after encoding).
+struct ModuleMatrix {
+    uint64_t id;    // unique per encode, keys the raster cache
+    int width;
+    std::vector<unsigned char> data;
+};
 
-static void overlayInfo(Mat& canvas, const State& s) {
+// Two-stage cache for the GUI: encoding keyed by (text, version, ECL,
+// mode), rasterisation keyed by (matrix, scale, quiet zone). Changing only
+// scale or quiet zone re-rasterises from the cached matrix; redraws and
+// saves of an unchanged symbol cost neither stage. Shared by the render
+// and save threads; the lock covers lookups only, never encode or raster.
+class RenderCache {
+public:
+    RenderCache() : matrices_(64), rasters_(64u << 20) {}
+
+    // nullptr for empty text or when encoding fails (failures are cached too).
+    std::shared_ptr<const ModuleMatrix> matrix(const State& s) {
+        if (s.text.empty()) return std::shared_ptr<const ModuleMatrix>();
+        const std::string key = format("%d/%d/%d/", s.version, s.eclIdx, static_cast<int>(QR_MODE_8)) + s.text;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (const std::shared_ptr<const ModuleMatrix>* hit = matrices_.find(key)) return *hit;
+        }
+        std::shared_ptr<const ModuleMatrix> m;
+        if (QRcode* code = encodeQR(s)) {
+            ModuleMatrix* mm = new ModuleMatrix();
+            mm->id = ++nextId_;
+            mm->width = code->width;
+            mm->data.assign(code->data, code->data + static_cast<size_t>(code->width) * code->width);
+            QRcode_free(code);
+            m.reset(mm);
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        matrices_.put(key, m);
+        return m;
+    }
+
+    // Grey raster of the current symbol, or an empty Mat. Shared with the
+    // cache: read only.
+    Mat raster(const State& s) {
+        std::shared_ptr<const ModuleMatrix> m = matrix(s);
+        if (!m) return Mat();
+        const std::string key = format("%llu/%d/%d", (unsigned long long)m->id, s.scale, s.quietZone);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (const Mat* hit = rasters_.find(key)) return *hit;
+        }
+        const int side = rasterSide(m->width, s.quietZone, s.scale);
+        Mat out(side, side, CV_8UC1);
+        rasterizeQR(m->data.data(), m->width, s.quietZone, s.scale, out);
+        std::lock_guard<std::mutex> lock(mutex_);
+        rasters_.put(key, out, out.total());
+        return out;
+    }
+
+    std::string summary() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return format("Cache: encode %.0f%% of %zu, raster %.0f%% of %zu",
+                      matrices_.hitRate(), matrices_.hits() + matrices_.misses(),
+                      rasters_.hitRate(), rasters_.hits() + rasters_.misses());
+    }
+
+private:
+    LruCache<std::shared_ptr<const ModuleMatrix> > matrices_;
+    LruCache<Mat> rasters_;   // budget in bytes
+    std::atomic<uint64_t> nextId_{0};
+    mutable std::mutex mutex_;
+};
+
+static void overlayInfo(Mat& canvas, const State& s, const RenderCache& cache) {
     if (!s.showHelp) return; // only show overlay when toggled on
     if (canvas.channels() == 1) cvtColor(canvas, canvas, COLOR_GRAY2BGR);
     int y = 20;
@@ -89,7 +270,20 @@ static void overlayInfo(Mat& canvas, const State& s) {
     put(format("Version: %d (v/V)  ECL: %s (e/E)", s.version, eclName(s.eclIdx).c_str()));
     put(format("Scale: %d (+/- or =/_)  QuietZone: %d ([/ ] or {/})", s.scale, s.quietZone));
     if (!s.defaultOut.empty()) put("Save: s -> " + s.defaultOut); else put("Save: s -> auto name");
-    if (s.showHelp) {UVWXYZabcdefghijklmnopqrstuvwxyz";
+    if (s.showHelp) {
+        y += 8;
+        put("Keys:", Scalar(200,200,200));
+        put("  Type to append, Backspace to delete", Scalar(200,200,200));
+        put("  v/V version, e/E error correction", Scalar(200,200,200));
+        put("  +/- or =/_ scale, [/ ] or {/} quiet zone", Scalar(200,200,200));
+        put("  r random, c clear, s save, h help, q/ESC quit", Scalar(200,200,200));
+        put("  PgUp/PgDn zoom, arrows pan, Home fit", Scalar(200,200,200));
+        put(cache.summary(), Scalar(200,200,200));
+    }
+}
+
+static std::string randomText() {
+    static const char alnum[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
     int len = 12 + (std::rand() % 13);
     std::string s; s.reserve(len);
     for (int i = 0; i < len; ++i) s.push_back(alnum[std::rand() % (sizeof(alnum)-1)]);
@@ -100,45 +294,1019 @@ static std::string autoFileName(const State& s) {
     return format("qrcode_v%d_ecl%s_sc%d_qz%d.png", s.version, eclName(s.eclIdx).c_str(), s.scale, s.quietZone);
 }
 
-int main(int argc, char** argv) {
-    std::srand((unsigned)std::time(nullptr));
-    State s;
-        y += 8;
-        put("Keys:", Scalar(200,200,200));
-        put("  Type to append, Backspace to delete", Scalar(200,200,200));
-        put("  v/V version, e/E error correction", Scalar(200,200,200));
-        put("  +/- or =/_ scale, [/ ] or {/} quiet zone", Scalar(200,200,200));
-        put("  r random, c clear, s save, h help, q/ESC quit", Scalar(200,200,200));
+// ---- Output formats ----
+// Print workflows do not want an 8-bit raster at the print scale. These
+// writers serialise the module matrix directly:
+//   .svg  one path, dark modules merged into horizontal runs; viewBox in
+//         modules, width/height at `scale` px per module
+//   .pdf  one page, runs as filled rectangles, `scale` pt per module
+//   .pbm  P4, one bit per module
+//   .png  with --png-bilevel: 1-bit PNG, one pixel per module
+// Anything else (and plain .png) keeps the grey raster via imwrite.
+
+enum OutputFormat { OUT_RASTER, OUT_SVG, OUT_PDF, OUT_PBM, OUT_PNG1 };
+
+static OutputFormat formatForPath(const std::string& path, bool pngBilevel) {
+    const size_t dot = path.rfind('.');
+    if (dot == std::string::npos || path.find('/', dot) != std::string::npos) return OUT_RASTER;
+    std::string ext = path.substr(dot + 1);
+    for (size_t i = 0; i < ext.size(); ++i) ext[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(ext[i])));
+    if (ext == "svg") return OUT_SVG;
+    if (ext == "pdf") return OUT_PDF;
+    if (ext == "pbm") return OUT_PBM;
+    if (ext == "png" && pngBilevel) return OUT_PNG1;
+    return OUT_RASTER;
+}
+
+// Calls fn(x, y, n) for each run of n dark modules starting at (x, y), in
+// bordered-symbol coordinates, row by row.
+template <typename Fn>
+static void forEachRun(const unsigned char* data, int w, int qz, Fn fn) {
+    for (int y = 0; y < w; ++y) {
+        const unsigned char* row = data + static_cast<size_t>(y) * w;
+        for (int x = 0; x < w;) {
+            if (!(row[x] & 1)) { ++x; continue; }
+            int end = x + 1;
+            while (end < w && (row[end] & 1)) ++end;
+            fn(qz + x, qz + y, end - x);
+            x = end;
+        }
     }
 }
 
-static std::string randomText() {
-    static const char alnum[] = "0123456789ABCDEFGHIJKLMNOPQRST
+static void appendf(std::string& out, const char* fmt, int a, int b, int c = 0) {
+    char buf[64];
+    const int n = std::snprintf(buf, sizeof(buf), fmt, a, b, c);
+    out.append(buf, static_cast<size_t>(std::max(0, n)));
+}
+
+static std::string svgBytes(const unsigned char* data, int w, int qz, int scale) {
+    const int side = w + 2 * qz;
+    std::string out;
+    out.reserve(64 + static_cast<size_t>(w) * w);
+    char head[256];
+    std::snprintf(head, sizeof(head),
+                  "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\" viewBox=\"0 0 %d %d\" "
+                  "shape-rendering=\"crispEdges\">\n<rect width=\"%d\" height=\"%d\" fill=\"#fff\"/>\n<path d=\"",
+                  side * scale, side * scale, side, side, side, side);
+    out += head;
+    // "z" returns the pen to the run start, so later runs move relatively.
+    int px = 0, py = 0;
+    bool first = true;
+    forEachRun(data, w, qz, [&](int x, int y, int n) {
+        if (first) appendf(out, "M%d %d", x, y);
+        else appendf(out, "m%d %d", x - px, y - py);
+        appendf(out, "h%dv1h-%dz", n, n);
+        px = x; py = y; first = false;
+    });
+    out += "\"/>\n</svg>\n";
+    return out;
+}
+
+// Single-page PDF 1.4; page coordinates are bottom-up, so rows flip.
+static std::string pdfBytes(const unsigned char* data, int w, int qz, int scale) {
+    const int side = w + 2 * qz;
+    std::string content;
+    appendf(content, "q %d 0 0 %d 0 0 cm\n0 g\n", scale, scale);
+    forEachRun(data, w, qz, [&](int x, int y, int n) { appendf(content, "%d %d %d 1 re\n", x, side - 1 - y, n); });
+    content += "f\nQ\n";
+
+    std::string out = "%PDF-1.4\n";
+    std::vector<size_t> offsets;
+    const auto object = [&](const std::string& body) {
+        offsets.push_back(out.size());
+        char head[32];
+        std::snprintf(head, sizeof(head), "%zu 0 obj\n", offsets.size());
+        out += head;
+        out += body;
+        out += "\nendobj\n";
+    };
+    char buf[160];
+    object("<< /Type /Catalog /Pages 2 0 R >>");
+    object("<< /Type /Pages /Kids [3 0 R] /Count 1 >>");
+    std::snprintf(buf, sizeof(buf), "<< /Type /Page /Parent 2 0 R /MediaBox [0 0 %d %d] /Resources << >> /Contents 4 0 R >>",
+                  side * scale, side * scale);
+    object(buf);
+    std::snprintf(buf, sizeof(buf), "<< /Length %zu >>\nstream\n", content.size());
+    object(buf + content + "endstream");
+    const size_t xref = out.size();
+    std::snprintf(buf, sizeof(buf), "xref\n0 %zu\n0000000000 65535 f \n", offsets.size() + 1);
+    out += buf;
+    for (size_t i = 0; i < offsets.size(); ++i) {
+        std::snprintf(buf, sizeof(buf), "%010zu 00000 n \n", offsets[i]);
+        out += buf;
+    }
+    std::snprintf(buf, sizeof(buf), "trailer\n<< /Size %zu /Root 1 0 R >>\nstartxref\n%zu\n%%%%EOF\n",
+                  offsets.size() + 1, xref);
+    out += buf;
+    return out;
+}
+
+// P4: rows packed MSB first, 1 = black, each row padded to a byte.
+static std::string pbmBytes(const unsigned char* data, int w, int qz) {
+    const int side = w + 2 * qz;
+    const size_t stride = (static_cast<size_t>(side) + 7) / 8;
+    std::string out;
+    appendf(out, "P4\n%d %d\n", side, side);
+    const size_t header = out.size();
+    out.resize(header + stride * side, '\0');
+    forEachRun(data, w, qz, [&](int x, int y, int n) {
+        unsigned char* row = reinterpret_cast<unsigned char*>(&out[header + stride * y]);
+        for (int i = x; i < x + n; ++i) row[i >> 3] |= static_cast<unsigned char>(0x80u >> (i & 7));
+    });
+    return out;
+}
+
+// Serialises one symbol in a module-level format; false for OUT_RASTER or
+// when the encoder rejects the image.
+static bool encodeModules(OutputFormat f, const unsigned char* data, int w, int quietZone, int scale,
+                          std::vector<unsigned char>& out) {
+    const int qz = std::max(0, quietZone);
+    const int sc = std::max(1, scale);
+    std::string bytes;
+    switch (f) {
+        case OUT_SVG: bytes = svgBytes(data, w, qz, sc); break;
+        case OUT_PDF: bytes = pdfBytes(data, w, qz, sc); break;
+        case OUT_PBM: bytes = pbmBytes(data, w, qz); break;
+        case OUT_PNG1: {
+            Mat img(rasterSide(w, qz, 1), rasterSide(w, qz, 1), CV_8UC1);
+            rasterizeQR(data, w, qz, 1, img);
+            std::vector<int> params;
+            params.push_back(IMWRITE_PNG_BILEVEL);
+            params.push_back(1);
+            return imencode(".png", img, out, params);
+        }
+        default: return false;
+    }
+    out.assign(bytes.begin(), bytes.end());
+    return true;
+}
+
+static bool writeBytes(const std::string& path, const std::vector<unsigned char>& bytes) {
+    FILE* f = std::fopen(path.c_str(), "wb");
+    if (!f) return false;
+    const bool ok = std::fwrite(bytes.data(), 1, bytes.size(), f) == bytes.size();
+    return std::fclose(f) == 0 && ok;
+}
+
+// Size and serialisation time of each format against the grey PNG raster,
+// version 40 at the given scale and quiet zone.
+static int runFormatBench(int scale, int quietZone) {
+    QRcode* code = QRcode_encodeString("BENCH", 40, QR_ECLEVEL_M, QR_MODE_8, 1);
+    if (!code) {
+        std::cerr << "编码失败" << std::endl;
+        return 1;
+    }
+    typedef std::chrono::steady_clock Clock;
+    std::printf("version 40, scale %d, quiet zone %d\n%-10s %12s %10s\n", scale, quietZone, "format", "bytes", "ms");
+    {
+        const Clock::time_point t0 = Clock::now();
+        Mat img(rasterSide(code, quietZone, scale), rasterSide(code, quietZone, scale), CV_8UC1);
+        rasterizeQR(code, quietZone, scale, img);
+        std::vector<unsigned char> png;
+        imencode(".png", img, png);
+        std::printf("%-10s %12zu %10.2f\n", "png-gray", png.size(),
+                    std::chrono::duration<double, std::milli>(Clock::now() - t0).count());
+    }
+    const OutputFormat formats[] = {OUT_SVG, OUT_PDF, OUT_PBM, OUT_PNG1};
+    const char* names[] = {"svg", "pdf", "pbm", "png-1bit"};
+    int failures = 0;
+    for (int k = 0; k < 4; ++k) {
+        const Clock::time_point t0 = Clock::now();
+        std::vector<unsigned char> bytes;
+        if (!encodeModules(formats[k], code->data, code->width, quietZone, scale, bytes)) ++failures;
+        std::printf("%-10s %12zu %10.2f\n", names[k], bytes.size(),
+                    std::chrono::duration<double, std::milli>(Clock::now() - t0).count());
+    }
+    QRcode_free(code);
+    return failures ? 1 : 0;
+}
+// ---- End output formats ----
+
+// ---- Background rendering ----
+// The GUI thread only handles keys and shows finished frames. A render
+// thread turns the latest State into a canvas no larger than the viewport:
+// display pixels are sampled straight from the module matrix, so a version
+// 40 code at scale 64 costs the same as a small one. Every request bumps a
+// generation; an in-flight render that falls behind is abandoned between
+// row blocks and never shown. Full-resolution images exist only in saves,
+// which run on their own thread.
+
+static const int kViewMax = 720; // px, largest side of the code viewport
+
+// zoom == 0 shows the symbol at its own scale when that fits and fits it to
+// kViewMax otherwise. cx/cy are the view centre as a fraction of the
+// bordered symbol, so they survive version and quiet-zone changes.
+struct Viewport {
+    double zoom;   // display px per module
+    double cx, cy;
+
+    Viewport() : zoom(0), cx(0.5), cy(0.5) {}
+};
+
+static double viewScale(const Viewport& vp, int modules, int scale) {
+    if (vp.zoom > 0) return vp.zoom;
+    return modules * scale <= kViewMax ? scale : static_cast<double>(kViewMax) / modules;
+}
+
+// Side in display px of the viewport for `total` modules at `ppm`.
+static int viewSide(int total, double ppm) {
+    return std::min(kViewMax, static_cast<int>(std::ceil(total * ppm)));
+}
+
+// Nearest-module sampling of the bordered symbol at `ppm` display px per
+// module straight into dst, a viewSide() square 8UC3 region of the window
+// canvas. Rows mapping to the same module row are copied. Returns false
+// when `stale` reports the request was superseded.
+static bool sampleViewport(const ModuleMatrix& m, int quietZone, double ppm, const Viewport& vp,
+                           Mat& dst, const std::function<bool()>& stale) {
+    CV_Assert(dst.type() == CV_8UC3 && dst.rows == dst.cols);
+    const int w = m.width;
+    const int qz = std::max(0, quietZone);
+    const int total = w + 2 * qz;
+    const int side = dst.cols;
+    const size_t rowBytes = static_cast<size_t>(side) * 3;
+    const double span = side / ppm;
+    const double room = std::max(0.0, total - span);
+    const double x0 = std::min(room, std::max(0.0, vp.cx * total - span / 2));
+    const double y0 = std::min(room, std::max(0.0, vp.cy * total - span / 2));
+
+    std::vector<int> col(side);
+    for (int x = 0; x < side; ++x) {
+        const int mx = static_cast<int>(std::floor(x0 + (x + 0.5) / ppm)) - qz;
+        col[x] = (mx >= 0 && mx < w) ? mx : -1;
+    }
+    int prev = 0;
+    for (int y = 0; y < side; ++y) {
+        if ((y & 63) == 0 && stale()) return false;
+        uchar* row = dst.ptr<uchar>(y);
+        const int my = static_cast<int>(std::floor(y0 + (y + 0.5) / ppm)) - qz;
+        if (y > 0 && my == prev) { std::memcpy(row, dst.ptr<uchar>(y - 1), rowBytes); continue; }
+        prev = my;
+        if (my < 0 || my >= w) { std::memset(row, 255, rowBytes); continue; }
+        const unsigned char* src = m.data.data() + static_cast<size_t>(my) * w;
+        for (int x = 0; x < side; ++x) {
+            const uchar v = (col[x] >= 0 && (src[col[x]] & 1)) ? 0 : 255;
+            row[3 * x] = row[3 * x + 1] = row[3 * x + 2] = v;
+        }
+    }
+    return true;
+}
+
+class BackgroundRenderer {
+public:
+    explicit BackgroundRenderer(RenderCache& cache) : cache_(cache) {
+        worker_ = std::thread(&BackgroundRenderer::run, this);
+    }
+    ~BackgroundRenderer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            done_ = true;
+        }
+        ++generation_; // abandon whatever is in flight
+        wake_.notify_one();
+        if (worker_.joinable()) worker_.join();
+    }
+
+    // Supersedes any queued or in-flight request.
+    void request(const State& s, const Viewport& vp, const std::string& status) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_.s = s;
+        pending_.vp = vp;
+        pending_.status = status;
+        hasPending_ = true;
+        ++generation_;
+        wake_.notify_one();
+    }
+
+    // Latest completed frame, handed out once.
+    bool takeFrame(Mat& frame) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!fresh_) return false;
+        frame = frame_;
+        fresh_ = false;
+        return true;
+    }
+
+    // True until the last frame has been taken: a frame finished between
+    // takeFrame() and busy() still keeps the caller polling.
+    bool busy() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return hasPending_ || rendering_ || fresh_;
+    }
+
+    // Display px per module and visible fraction of the last shown frame;
+    // the GUI thread zooms and pans relative to these.
+    double lastScale() const { std::lock_guard<std::mutex> lock(mutex_); return lastScale_; }
+    double lastVisible() const { std::lock_guard<std::mutex> lock(mutex_); return lastVisible_; }
+
+private:
+    struct Request {
+        State s;
+        Viewport vp;
+        std::string status;
+    };
+
+    void run() {
+        for (;;) {
+            Request req;
+            uint64_t gen;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [this] { return hasPending_ || done_; });
+                if (done_) break;
+                req = pending_;
+                hasPending_ = false;
+                rendering_ = true;
+                gen = generation_.load();
+            }
+            const std::function<bool()> stale = [this, gen] { return generation_.load() != gen; };
+            Mat canvas;
+            double ppm = 0, visible = 1;
+            const bool ok = compose(req, stale, canvas, ppm, visible) && !stale();
+            std::lock_guard<std::mutex> lock(mutex_);
+            rendering_ = false;
+            if (ok) {
+                frame_ = canvas;
+                fresh_ = true;
+                lastScale_ = ppm;
+                lastVisible_ = visible;
+            } else {
+                ++cancelled_;
+            }
+        }
+    }
+
+    bool compose(const Request& req, const std::function<bool()>& stale, Mat& canvas,
+                 double& ppm, double& visible) {
+        const State& s = req.s;
+        std::shared_ptr<const ModuleMatrix> m = cache_.matrix(s);
+        if (stale()) return false;
+        // The view is sampled straight into the canvas; the gray raster
+        // cache only serves saves.
+        std::string info;
+        const int total = m ? m->width + 2 * std::max(0, s.quietZone) : 0;
+        if (m) ppm = viewScale(req.vp, total, s.scale);
+        const int side = m ? viewSide(total, ppm) : 240;
+        canvas.create(side + 120, std::max(side, 640), CV_8UC3);
+        canvas.setTo(Scalar(255,255,255));
+        Mat roi = canvas(Rect((canvas.cols - side) / 2, 10, side, side));
+        if (m) {
+            if (!sampleViewport(*m, s.quietZone, ppm, req.vp, roi, stale)) return false;
+            visible = std::min(1.0, side / (total * ppm));
+            const int full = rasterSide(m->width, s.quietZone, s.scale);
+            info = format("View %.0f%% of %dx%d px (PgUp/PgDn zoom, arrows pan, Home fit)",
+                          100.0 * ppm / s.scale, full, full);
+        } else {
+            roi.setTo(Scalar::all(s.text.empty() ? 255 : 200));
+        }
+        overlayInfo(canvas, s, cache_);
+        if (s.showHelp)
+            putText(canvas, format("Renders cancelled: %zu", cancelled_), Point(10, canvas.rows - 65),
+                    FONT_HERSHEY_SIMPLEX, 0.5, Scalar(96,96,96), 1, LINE_AA);
+        if (!info.empty())
+            putText(canvas, info, Point(10, canvas.rows - 40), FONT_HERSHEY_SIMPLEX, 0.5, Scalar(96,96,96), 1, LINE_AA);
+        if (!req.status.empty()) {
+            putText(canvas, req.status, Point(10, canvas.rows - 15), FONT_HERSHEY_SIMPLEX, 0.6, Scalar(0,0,0), 2, LINE_AA);
+            putText(canvas, req.status, Point(10, canvas.rows - 15), FONT_HERSHEY_SIMPLEX, 0.6, Scalar(0,128,255), 2, LINE_AA);
+        }
+        return true;
+    }
+
+    RenderCache& cache_;
+    std::thread worker_;
+    mutable std::mutex mutex_;
+    std::condition_variable wake_;
+    Request pending_;
+    bool hasPending_ = false, rendering_ = false, done_ = false;
+    std::atomic<uint64_t> generation_{0};
+    Mat frame_;
+    bool fresh_ = false;
+    double lastScale_ = 0, lastVisible_ = 1;
+    size_t cancelled_ = 0; // render thread only
+};
+
+// Full-resolution saves off the GUI thread. Queued saves are finished
+// before the program exits.
+class AsyncSaver {
+public:
+    explicit AsyncSaver(RenderCache& cache) : cache_(cache) {
+        worker_ = std::thread(&AsyncSaver::run, this);
+    }
+    ~AsyncSaver() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            done_ = true;
+        }
+        wake_.notify_one();
+        if (worker_.joinable()) worker_.join();
+    }
+
+    void save(const State& s, const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.push_back(std::make_pair(s, path));
+        wake_.notify_one();
+    }
+
+    bool takeResult(std::string& msg) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (results_.empty()) return false;
+        msg = results_.front();
+        results_.pop_front();
+        return true;
+    }
+
+    // Counts untaken results too, for the same reason as the renderer.
+    bool busy() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return !queue_.empty() || saving_ || !results_.empty();
+    }
+
+private:
+    void run() {
+        for (;;) {
+            std::pair<State, std::string> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [this] { return !queue_.empty() || done_; });
+                if (queue_.empty()) break;
+                job = queue_.front();
+                queue_.pop_front();
+                saving_ = true;
+            }
+            const auto t0 = std::chrono::steady_clock::now();
+            const OutputFormat f = formatForPath(job.second, job.first.pngBilevel);
+            std::string msg;
+            if (f != OUT_RASTER) msg = saveModules(f, job.first, job.second);
+            else msg = saveRaster(job.first, job.second);
+            const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+            std::lock_guard<std::mutex> lock(mutex_);
+            saving_ = false;
+            results_.push_back(msg.empty() ? "Save failed: " + job.second : msg + format(", %.0f ms)", ms));
+        }
+    }
+
+    // Both return "Saved: ... (details" or "" on failure.
+    std::string saveRaster(const State& s, const std::string& path) {
+        Mat qr = cache_.raster(s);
+        if (qr.empty()) qr = renderQR(s);
+        bool ok = false;
+        try {
+            ok = imwrite(path, qr);
+        } catch (const cv::Exception&) {
+            ok = false;
+        }
+        if (!ok) {
+            std::cerr << "无法写入 " << path << std::endl;
+            return std::string();
+        }
+        return format("Saved: %s (%dx%d", path.c_str(), qr.cols, qr.rows);
+    }
+
+    std::string saveModules(OutputFormat f, const State& s, const std::string& path) {
+        std::shared_ptr<const ModuleMatrix> m = cache_.matrix(s);
+        if (!m) {
+            std::cerr << "没有可保存的二维码 (内容为空或无法编码)" << std::endl;
+            return std::string();
+        }
+        std::vector<unsigned char> bytes;
+        if (!encodeModules(f, m->data.data(), m->width, s.quietZone, s.scale, bytes) || !writeBytes(path, bytes)) {
+            std::cerr << "无法写入 " << path << std::endl;
+            return std::string();
+        }
+        return format("Saved: %s (%zu bytes", path.c_str(), bytes.size());
+    }
+
+    RenderCache& cache_;
+    std::thread worker_;
+    mutable std::mutex mutex_;
+    std::condition_variable wake_;
+    std::deque<std::pair<State, std::string> > queue_;
+    std::deque<std::string> results_;
+    bool saving_ = false, done_ = false;
+};
+
+// Navigation keys as returned by waitKeyEx: GTK/X11 keysyms, then Win32
+// virtual keys in the high word.
+enum NavKey { NAV_NONE, NAV_LEFT, NAV_UP, NAV_RIGHT, NAV_DOWN, NAV_ZOOM_IN, NAV_ZOOM_OUT, NAV_FIT };
+
+static NavKey navKey(int key) {
+    switch (key) {
+        case 0xFF51: case 0x250000: return NAV_LEFT;
+        case 0xFF52: case 0x260000: return NAV_UP;
+        case 0xFF53: case 0x270000: return NAV_RIGHT;
+        case 0xFF54: case 0x280000: return NAV_DOWN;
+        case 0xFF55: case 0x210000: return NAV_ZOOM_IN;
+        case 0xFF56: case 0x220000: return NAV_ZOOM_OUT;
+        case 0xFF50: case 0x240000: return NAV_FIT;
+        default: return NAV_NONE;
+    }
+}
+// ---- End background rendering ----
+
+// ---- Batch generation ----
+// Input: one code per line, CSV or TSV (tab wins if the line has one):
+//   payload[,name]
+// CSV fields may be double-quoted with "" as an escaped quote. Blank lines
+// and lines starting with '#' are skipped. Files are memory-mapped; stdin
+// is read into memory.
+//
+// Records are encoded and rasterised on a work-stealing pool: the record
+// list is cut into fixed chunks dealt round-robin to per-worker deques;
+// workers pop their own chunks from the front and steal from the back of
+// others when they run dry. Every output depends only on its record and
+// its line number (filenames come from the template, nothing random), so
+// the output set is identical for any thread count. PNG bytes are written
+// by a separate writer thread behind a bounded queue.
+
+struct BatchRecord {
+    size_t line;            // 1-based input line
+    std::string payload;
+    std::string name;       // optional second column
+};
+
+// Owns the input bytes: an mmap of the file, or stdin read into memory.
+class BatchInput {
+public:
+    ~BatchInput() { if (map_) munmap(map_, size_); }
+
+    bool open(const std::string& path) {
+        if (path == "-") {
+            std::vector<char> buf(1 << 16);
+            size_t n;
+            while ((n = std::fread(buf.data(), 1, buf.size(), stdin)) > 0) stdin_.append(buf.data(), n);
+            data_ = stdin_.data();
+            size_ = stdin_.size();
+            return true;
+        }
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) { if (fd >= 0) close(fd); return false; }
+        size_ = static_cast<size_t>(st.st_size);
+        if (size_ > 0) {
+            map_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map_ == MAP_FAILED) { map_ = nullptr; close(fd); return false; }
+            madvise(map_, size_, MADV_SEQUENTIAL);
+            data_ = static_cast<const char*>(map_);
+        }
+        close(fd);
+        return true;
+    }
+
+    // Splits into records; the payload/name strings are the only copies made.
+    std::vector<BatchRecord> records() const {
+        std::vector<BatchRecord> out;
+        size_t line = 0;
+        for (size_t pos = 0; pos < size_;) {
+            const char* nl = static_cast<const char*>(std::memchr(data_ + pos, '\n', size_ - pos));
+            size_t end = nl ? static_cast<size_t>(nl - data_) : size_;
+            ++line;
+            size_t len = end - pos;
+            if (len > 0 && data_[pos + len - 1] == '\r') --len;
+            if (len > 0 && data_[pos] != '#') {
+                BatchRecord r;
+                r.line = line;
+                splitFields(data_ + pos, len, r);
+                out.push_back(r);
+            }
+            pos = end + 1;
+        }
+        return out;
+    }
+
+private:
+    static void splitFields(const char* p, size_t len, BatchRecord& r) {
+        if (std::memchr(p, '\t', len)) {
+            const char* tab = static_cast<const char*>(std::memchr(p, '\t', len));
+            r.payload.assign(p, tab - p);
+            const char* rest = tab + 1;
+            const char* tab2 = static_cast<const char*>(std::memchr(rest, '\t', p + len - rest));
+            r.name.assign(rest, (tab2 ? tab2 : p + len) - rest);
+            return;
+        }
+        std::string* fields[2] = { &r.payload, &r.name };
+        int f = 0;
+        size_t i = 0;
+        while (i <= len && f < 2) {
+            std::string& out = *fields[f];
+            if (i < len && p[i] == '"') {
+                for (++i; i < len; ++i) {
+                    if (p[i] == '"') {
+                        if (i + 1 < len && p[i + 1] == '"') { out.push_back('"'); ++i; }
+                        else { ++i; break; }
+                    } else {
+                        out.push_back(p[i]);
+                    }
+                }
+                while (i < len && p[i] != ',') ++i;
+            } else {
+                const size_t start = i;
+                while (i < len && p[i] != ',') ++i;
+                out.assign(p + start, i - start);
+            }
+            ++i; // skip the comma
+            ++f;
+        }
+    }
+
+    void* map_ = nullptr;
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    std::string stdin_;
+};
+
+static uint64_t fnv1a64(const std::string& s) {
+    uint64_t h = 1469598103934665603ull;
+    for (size_t i = 0; i < s.size(); ++i) {
+        h ^= static_cast<unsigned char>(s[i]);
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// Filename template: {n} or {n:06} record number (1-based, in input order),
+// {line} input line, {name} second column (falls back to {n}), {hash}
+// 16 hex digits of the payload's FNV-1a hash.
+static std::string expandTemplate(const std::string& tpl, size_t n, const BatchRecord& r) {
+    std::string out;
+    for (size_t i = 0; i < tpl.size(); ++i) {
+        if (tpl[i] != '{') { out.push_back(tpl[i]); continue; }
+        size_t close = tpl.find('}', i);
+        if (close == std::string::npos) { out += tpl.substr(i); break; }
+        std::string key = tpl.substr(i + 1, close - i - 1);
+        int width = 0;
+        size_t colon = key.find(':');
+        if (colon != std::string::npos) {
+            width = std::atoi(key.c_str() + colon + 1);
+            key = key.substr(0, colon);
+        }
+        if (key == "n") out += format("%0*zu", width, n);
+        else if (key == "line") out += format("%0*zu", width, r.line);
+        else if (key == "hash") out += format("%016llx", (unsigned long long)fnv1a64(r.payload));
+        else if (key == "name") {
+            if (r.name.empty()) { out += format("%0*zu", width, n); }
+            else {
+                for (size_t k = 0; k < r.name.size(); ++k) {
+                    char c = r.name[k];
+                    out.push_back(c == '/' || c == '\\' || c < 32 ? '_' : c);
+                }
+            }
+        } else {
+            out += tpl.substr(i, close - i + 1); // unknown: keep literally
+        }
+        i = close;
+    }
+    return out;
+}
+
+// Writes encoded files on its own thread. push() blocks when `capacity`
+// files are pending, so a slow disk throttles the encoders instead of
+// growing memory.
+class AsyncFileWriter {
+public:
+    explicit AsyncFileWriter(size_t capacity) : capacity_(std::max<size_t>(1, capacity)) {
+        worker_ = std::thread(&AsyncFileWriter::run, this);
+    }
+    ~AsyncFileWriter() { finish(); }
+
+    void push(std::string path, std::vector<unsigned char> bytes) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        notFull_.wait(lock, [this] { return queue_.size() < capacity_; });
+        queue_.push_back(Item());
+        queue_.back().path.swap(path);
+        queue_.back().bytes.swap(bytes);
+        notEmpty_.notify_one();
+    }
+
+    void finish() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            done_ = true;
+        }
+        notEmpty_.notify_one();
+        if (worker_.joinable()) worker_.join();
+    }
+
+    size_t failed() const { return failed_.load(); }
+
+private:
+    struct Item {
+        std::string path;
+        std::vector<unsigned char> bytes;
+    };
+
+    void run() {
+        std::set<std::string> dirs; // parents already created
+        for (;;) {
+            Item item;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                notEmpty_.wait(lock, [this] { return !queue_.empty() || done_; });
+                if (queue_.empty()) break;
+                std::swap(item, queue_.front());
+                queue_.pop_front();
+                notFull_.notify_one();
+            }
+            makeParents(item.path, dirs);
+            FILE* f = std::fopen(item.path.c_str(), "wb");
+            if (!f || std::fwrite(item.bytes.data(), 1, item.bytes.size(), f) != item.bytes.size()) {
+                if (failed_++ < 5) std::cerr << "无法写入 " << item.path << std::endl;
+            }
+            if (f) std::fclose(f);
+        }
+    }
+
+    static void makeParents(const std::string& path, std::set<std::string>& dirs) {
+        size_t slash = path.rfind('/');
+        if (slash == std::string::npos || slash == 0) return;
+        const std::string dir = path.substr(0, slash);
+        if (dirs.count(dir)) return;
+        for (size_t i = 1; i <= dir.size(); ++i)
+            if (i == dir.size() || dir[i] == '/') mkdir(dir.substr(0, i).c_str(), 0755); // EEXIST is fine
+        dirs.insert(dir);
+    }
+
+    const size_t capacity_;
+    std::thread worker_;
+    std::mutex mutex_;
+    std::condition_variable notEmpty_, notFull_;
+    std::deque<Item> queue_;
+    bool done_ = false;
+    std::atomic<size_t> failed_{0};
+};
+
+// Per-worker deques of chunk indices; pop own front, steal others' back.
+class ChunkScheduler {
+public:
+    ChunkScheduler(size_t chunks, size_t workers) : queues_(workers), locks_(workers) {
+        for (size_t c = 0; c < chunks; ++c) queues_[c % workers].push_back(c);
+    }
+
+    bool next(size_t worker, size_t& chunk) {
+        {
+            std::lock_guard<std::mutex> lock(locks_[worker]);
+            if (!queues_[worker].empty()) {
+                chunk = queues_[worker].front();
+                queues_[worker].pop_front();
+                return true;
+            }
+        }
+        for (size_t k = 1; k < queues_.size(); ++k) {
+            const size_t victim = (worker + k) % queues_.size();
+            std::lock_guard<std::mutex> lock(locks_[victim]);
+            if (!queues_[victim].empty()) {
+                chunk = queues_[victim].back();
+                queues_[victim].pop_back();
+                steals_.fetch_add(1);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    size_t steals() const { return steals_.load(); }
+
+private:
+    std::vector<std::deque<size_t> > queues_;
+    std::vector<std::mutex> locks_;
+    std::atomic<size_t> steals_{0};
+};
+
+struct BatchOptions {
+    std::string input;                   // path or "-"
+    std::string outTemplate = "qr_{n:06}.png";
+    int threads = 0;                     // 0 = hardware concurrency
+};
+
+static int runBatch(const BatchOptions& opt, const State& style) {
+    BatchInput input;
+    if (!input.open(opt.input)) {
+        std::cerr << "无法读取输入: " << opt.input << std::endl;
+        return 2;
+    }
+    const auto t0 = std::chrono::steady_clock::now();
+    const std::vector<BatchRecord> records = input.records();
+    const size_t workers = opt.threads > 0 ? static_cast<size_t>(opt.threads)
+                                           : std::max(1u, std::thread::hardware_concurrency());
+    const size_t kChunk = 64;
+    const size_t chunks = (records.size() + kChunk - 1) / kChunk;
+
+    ChunkScheduler scheduler(chunks, workers);
+    AsyncFileWriter writer(4 * workers * kChunk);
+    std::atomic<size_t> done{0};
+    std::mutex errMutex;
+    std::vector<size_t> failedLines;
+
+    auto work = [&](size_t w) {
+        State st = style;
+        const OutputFormat f = formatForPath(opt.outTemplate, style.pngBilevel);
+        std::vector<int> pngParams;
+        pngParams.push_back(IMWRITE_PNG_COMPRESSION);
+        pngParams.push_back(1); // label printing favours speed; output is still lossless
+        size_t chunk;
+        while (scheduler.next(w, chunk)) {
+            const size_t end = std::min(records.size(), (chunk + 1) * kChunk);
+            for (size_t i = chunk * kChunk; i < end; ++i) {
+                st.text = records[i].payload;
+                std::vector<unsigned char> png;
+                bool encoded = false;
+                if (f != OUT_RASTER) {
+                    if (QRcode* code = encodeQR(st)) {
+                        encoded = encodeModules(f, code->data, code->width, st.quietZone, st.scale, png);
+                        QRcode_free(code);
+                    }
+                } else {
+                    Mat img = renderQR(st, &encoded);
+                    encoded = encoded && imencode(".png", img, png, pngParams);
+                }
+                if (!encoded) {
+                    std::lock_guard<std::mutex> lock(errMutex);
+                    failedLines.push_back(records[i].line);
+                    continue;
+                }
+                writer.push(expandTemplate(opt.outTemplate, i + 1, records[i]), std::move(png));
+            }
+            done.fetch_add(end - chunk * kChunk);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (size_t w = 0; w < workers; ++w) pool.push_back(std::thread(work, w));
+    // Progress about once a second on stderr.
+    for (int tick = 1; done.load() < records.size(); ++tick) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (tick % 10) continue;
+        const double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        std::cerr << format("\r%zu/%zu codes, %.0f codes/s", done.load(), records.size(), done.load() / s)
+                  << std::flush;
+    }
+    for (size_t w = 0; w < pool.size(); ++w) pool[w].join();
+    writer.finish();
+
+    const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::sort(failedLines.begin(), failedLines.end());
+    const size_t ok = records.size() - failedLines.size() - writer.failed();
+    std::cout << format("\rgenerated %zu/%zu codes in %.2f s: %.0f codes/s (%zu threads, %zu steals)",
+                        ok, records.size(), secs, secs > 0 ? ok / secs : 0.0, workers, scheduler.steals())
+              << std::endl;
+    for (size_t i = 0; i < failedLines.size() && i < 10; ++i)
+        std::cerr << "第 " << failedLines[i] << " 行无法编码 (内容过长或为空)" << std::endl;
+    return failedLines.empty() && writer.failed() == 0 ? 0 : 1;
+}
+// ---- End batch generation ----
+
+// ---- Raster benchmark ----
+// Previous renderQR body: per-module at<>, copyTo into a bordered Mat, then
+// an INTER_NEAREST resize. Kept only as the baseline for --bench-raster.
+static Mat rasterizeQRReference(const QRcode* code, int quietZone, int scale) {
+    const int w = code->width;
+    Mat modules(w, w, CV_8UC1, Scalar(255));
+    for (int y = 0; y < w; ++y)
+        for (int x = 0; x < w; ++x)
+            modules.at<unsigned char>(y, x) = (code->data[y * w + x] & 0x01) ? 0 : 255;
+    int qz = std::max(0, quietZone);
+    Mat bordered(w + 2*qz, w + 2*qz, CV_8UC1, Scalar(255));
+    modules.copyTo(bordered(Rect(qz, qz, w, w)));
+    int sc = std::max(1, scale);
+    Mat up;
+    resize(bordered, up, Size(bordered.cols*sc, bordered.rows*sc), 0, 0, INTER_NEAREST);
+    return up;
+}
+
+// Times both rasterisers for every version 1-40 at scales 1-64 (powers of
+// two, plus 3 and 15, the GUI default), checks that their pixels match,
+// and prints the speed-up per cell. Each cell repeats until ~20 ms.
+static int runRasterBench(int quietZone) {
+    const int scales[] = {1, 2, 3, 4, 8, 15, 16, 32, 64};
+    const int nScales = sizeof(scales) / sizeof(scales[0]);
+    typedef std::chrono::steady_clock Clock;
+    auto timeIt = [](const std::function<void()>& fn) {
+        int reps = 0;
+        const Clock::time_point t0 = Clock::now();
+        double elapsed = 0.0;
+        do {
+            fn();
+            ++reps;
+            elapsed = std::chrono::duration<double, std::micro>(Clock::now() - t0).count();
+        } while (elapsed < 20000.0);
+        return elapsed / reps;
+    };
+
+    std::printf("speed-up of direct rasteriser over at<>/copyTo/resize (quiet zone %d)\nver ", quietZone);
+    for (int k = 0; k < nScales; ++k) std::printf("  sc%-3d", scales[k]);
+    std::printf("\n");
+    double logSum = 0.0;
+    int cells = 0, mismatches = 0;
+    for (int v = 1; v <= 40; ++v) {
+        QRcode* code = QRcode_encodeString("BENCH", v, QR_ECLEVEL_M, QR_MODE_8, 1);
+        if (!code) continue;
+        std::printf("%3d ", v);
+        for (int k = 0; k < nScales; ++k) {
+            const int sc = scales[k];
+            Mat ref = rasterizeQRReference(code, quietZone, sc);
+            Mat direct(ref.size(), CV_8UC1);
+            rasterizeQR(code, quietZone, sc, direct);
+            if (norm(ref, direct, NORM_INF) != 0) ++mismatches;
+
+            const double refUs = timeIt([&] { ref = rasterizeQRReference(code, quietZone, sc); });
+            // Includes the allocation, as renderQR does.
+            const double newUs = timeIt([&] {
+                Mat out(ref.size(), CV_8UC1);
+                rasterizeQR(code, quietZone, sc, out);
+            });
+            std::printf(" %6.1fx", refUs / newUs);
+            logSum += std::log(refUs / newUs);
+            ++cells;
+        }
+        std::printf("\n");
+        std::fflush(stdout);
+        QRcode_free(code);
+    }
+    std::printf("geometric mean speed-up %.2fx over %d cells, %d pixel mismatches\n",
+                cells ? std::exp(logSum / cells) : 0.0, cells, mismatches);
+    return mismatches ? 1 : 0;
+}
+// ---- End raster benchmark ----
+
+int main(int argc, char** argv) {
+    std::srand((unsigned)std::time(nullptr));
+    State s;
+    BatchOptions batch;
+    // Usage: ./qrcode_generator [-t TEXT] [-o FILE]
+    //          [--version N] [--ecl L|M|Q|H] [--scale N] [--quiet-zone N]
+    //          [--png-bilevel] [--batch FILE|- [--out-template T] [--threads N]]
+    //          [--bench-raster] [--bench-formats]
+    // Output format follows the extension of -o / --out-template: .svg, .pdf,
+    // .pbm, .png (1-bit with --png-bilevel), anything else via imwrite.
     for (int i = 1; i < argc; ++i) {
         std::string a = argv[i];
         if ((a == "-t" || a == "--text") && i + 1 < argc) s.text = argv[++i];
         else if ((a == "-o" || a == "--output") && i + 1 < argc) s.defaultOut = argv[++i];
+        else if (a == "--version" && i + 1 < argc) s.version = clampi(std::atoi(argv[++i]), 0, 40);
+        else if (a == "--scale" && i + 1 < argc) s.scale = clampi(std::atoi(argv[++i]), 1, 64);
+        else if (a == "--quiet-zone" && i + 1 < argc) s.quietZone = clampi(std::atoi(argv[++i]), 0, 16);
+        else if (a == "--ecl" && i + 1 < argc) {
+            const std::string e = argv[++i];
+            const size_t idx = std::string("LMQH").find(e.empty() ? '?' : e[0]);
+            if (e.size() != 1 || idx == std::string::npos) {
+                std::cerr << "--ecl 取值 L, M, Q 或 H" << std::endl;
+                return 2;
+            }
+            s.eclIdx = static_cast<int>(idx);
+        }
+        else if (a == "--batch" && i + 1 < argc) batch.input = argv[++i];
+        else if (a == "--bench-raster") return runRasterBench(s.quietZone);
+        else if (a == "--bench-formats") return runFormatBench(s.scale, s.quietZone);
+        else if (a == "--png-bilevel") s.pngBilevel = true;
+        else if (a == "--out-template" && i + 1 < argc) batch.outTemplate = argv[++i];
+        else if (a == "--threads" && i + 1 < argc) batch.threads = std::max(0, std::atoi(argv[++i]));
     }
+    if (!batch.input.empty()) return runBatch(batch, s);
 
     const std::string kWin = "QR Code Generator";
     namedWindow(kWin, WINDOW_AUTOSIZE);
     bool needRedraw = true;
+    RenderCache cache;
+    AsyncSaver saver(cache);
+    BackgroundRenderer renderer(cache);
+    Viewport vp;
+    std::string status;
 
     for (;;) {
+        std::string saved;
+        while (saver.takeResult(saved)) { status = saved; needRedraw = true; }
         if (needRedraw) {
-            Mat qr = renderQR(s);
-            Mat canvas(qr.rows + 120, std::max(qr.cols, 640), CV_8UC3, Scalar(255,255,255));
-            int x = (canvas.cols - qr.cols) / 2;
-            Mat qrBgr; cvtColor(qr, qrBgr, COLOR_GRAY2BGR);
-            qrBgr.copyTo(canvas(Rect(x, 10, qr.cols, qr.rows)));
-            overlayInfo(canvas, s);
-            imshow(kWin, canvas);
+            renderer.request(s, vp, status);
             needRedraw = false;
         }
+        Mat frame;
+        if (renderer.takeFrame(frame)) imshow(kWin, frame);
 
-        int key = waitKeyEx(0);
+        // Block only when nothing is in flight; otherwise poll for results.
+        int key = waitKeyEx(renderer.busy() || saver.busy() ? 15 : 0);
         if (key < 0) continue;
+
+        // Navigation keys first: masked to 8 bits they alias Q/R/S/T.
+        const NavKey nav = navKey(key);
+        if (nav != NAV_NONE) {
+            const double step = 0.25 * renderer.lastVisible();
+            const double ppm = renderer.lastScale();
+            switch (nav) {
+                case NAV_LEFT: vp.cx -= step; break;
+                case NAV_RIGHT: vp.cx += step; break;
+                case NAV_UP: vp.cy -= step; break;
+                case NAV_DOWN: vp.cy += step; break;
+                case NAV_ZOOM_IN: if (ppm > 0) vp.zoom = std::min(256.0, ppm * 1.25); break;
+                case NAV_ZOOM_OUT: if (ppm > 0) vp.zoom = std::max(0.25, ppm / 1.25); break;
+                default: vp = Viewport(); break;
+            }
+            vp.cx = std::min(1.0, std::max(0.0, vp.cx));
+            vp.cy = std::min(1.0, std::max(0.0, vp.cy));
+            needRedraw = true;
+            continue;
+        }
         int ch = key & 0xFF; // normalize to ASCII; fixes shifted keys not being detected
+        status.clear();
 
         if (ch == 27 || ch == 'q' || ch == 'Q') break;
         if (ch == 'h' || ch == 'H') { s.showHelp = !s.showHelp; needRedraw = true; continue; }
@@ -159,16 +1327,10 @@ static std::string randomText() {
         if (ch == 'V') { s.version = clampi(s.version + 1, 0, 40); needRedraw = true; continue; }
 
         if (ch == 's' || ch == 'S') {
-            Mat qr = renderQR(s);
             std::string path = s.defaultOut.empty() ? autoFileName(s) : s.defaultOut;
-            imwrite(path, qr);
-            Mat canvas(qr.rows + 60, std::max(qr.cols, 480), CV_8UC3, Scalar(255,255,255));
-            Mat qrBgr; cvtColor(qr, qrBgr, COLOR_GRAY2BGR);
-            int x = (canvas.cols - qr.cols) / 2;
-            qrBgr.copyTo(canvas(Rect(x, 10, qr.cols, qr.rows)));
-            putText(canvas, "Saved: " + path, Point(10, canvas.rows - 15), FONT_HERSHEY_SIMPLEX, 0.6, Scalar(0,0,0), 2, LINE_AA);
-            putText(canvas, "Saved: " + path, Point(10, canvas.rows - 15), FONT_HERSHEY_SIMPLEX, 0.6, Scalar(0,128,255), 2, LINE_AA);
-            imshow(kWin, canvas);
+            saver.save(s, path);
+            status = "Saving: " + path;
+            needRedraw = true;
             continue;
         }
 